@@ -0,0 +1,915 @@
+// Benchmarks for the shell's hot paths. Built and run by `make bench`.
+// shell.c is compiled into this file directly so internal functions can
+// be driven without a terminal. Every result is printed as one JSON
+// object per line.
+#define SHELL_NO_MAIN
+#include "shell.c"
+
+#include <pty.h>
+
+#define SHELL_BINARY "./shell"
+#define PTY_READY_MS 3000       // Longest wait for the shell's first prompt
+
+// Heap calls made from shell.c and this file, counted through the
+// linker's --wrap option
+static unsigned long long heap_calls = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    heap_calls++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    heap_calls++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    heap_calls++;
+    return __real_realloc(ptr, size);
+}
+
+static int compare_ns(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts samples and returns the value at percentile p (0-100)
+static long long percentile(long long* samples, size_t count, int p) {
+    if (count == 0) return 0;
+    qsort(samples, count, sizeof(long long), compare_ns);
+    return samples[(count - 1) * p / 100];
+}
+
+static long long* samples_alloc(size_t count) {
+    long long* samples = malloc(count * sizeof(long long));
+    if (!samples) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return samples;
+}
+
+// Makes dir a fresh private directory for history files and points
+// HISTFILE inside it, so no benchmark touches the user's history
+static void bench_histfile(char* dir, size_t size, const char* name) {
+    snprintf(dir, size, "/tmp/shell_bench.XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    setenv("HISTFILE", path, 1);
+}
+
+static void bench_histfile_remove(const char* dir) {
+    char path[PATH_MAX];
+    const char* file = getenv("HISTFILE");
+    unlink(file);
+    snprintf(path, sizeof(path), "%s%s", file, HISTORY_INDEX_SUFFIX);
+    unlink(path);
+    rmdir(dir);
+    unsetenv("HISTFILE");
+}
+
+// Writes history entry i of a synthetic session into line
+static int history_sample(char* line, size_t size, size_t i) {
+    static const char* templates[] = {
+        "git commit -m \"fix issue %zu\"",
+        "make -C build%zu -j8",
+        "grep -rn pattern%zu src/",
+        "ssh host%zu.example.com uptime",
+        "cd ~/projects/app%zu",
+    };
+    return snprintf(line, size, templates[i % 5], i);
+}
+
+// Starts an ncurses screen that draws into an unlinked file, so its
+// size after a benchmark is the number of bytes the terminal received.
+// The terminal is "screen" because xterm's flash, sent on every search
+// miss, carries 100ms of padding that curses sleeps through.
+static SCREEN* bench_screen_open(FILE** out, FILE** in) {
+    // A file has no window size; make the line wide enough not to clip
+    setenv("LINES", "40", 1);
+    setenv("COLUMNS", "200", 1);
+    *out = tmpfile();
+    *in = fopen("/dev/null", "r");
+    if (*out == NULL || *in == NULL) {
+        perror("bench screen");
+        exit(1);
+    }
+    SCREEN* screen = newterm("screen", *out, *in);
+    if (screen == NULL) {
+        fprintf(stderr, "newterm failed\n");
+        exit(1);
+    }
+    set_term(screen);
+    return screen;
+}
+
+static void bench_screen_close(SCREEN* screen, FILE* out, FILE* in) {
+    endwin();
+    delscreen(screen);
+    fclose(out);
+    fclose(in);
+    unsetenv("LINES");
+    unsetenv("COLUMNS");
+}
+
+static long long screen_bytes(FILE* out) {
+    struct stat st;
+    fflush(out);
+    return fstat(fileno(out), &st) == 0 ? st.st_size : 0;
+}
+
+// parse_command() on a representative line, including the arena reset
+// that follows every command
+static void bench_parse_command(void) {
+    const char* sample = "grep -n --color=auto \"hello world\" 'src/*.c' | sort -k2 | uniq -c > out.txt";
+    const long iterations = 1000000;
+    char line[256];
+    size_t len = strlen(sample) + 1;
+    Arena arena = {0};
+
+    // Warm the arena once, as the first command of a session would
+    memcpy(line, sample, len);
+    parse_command(line, &arena);
+    arena_reset(&arena);
+
+    unsigned long long calls_before = heap_calls;
+    long long start = monotonic_ns();
+    size_t tokens = 0;
+    for (long i = 0; i < iterations; i++) {
+        memcpy(line, sample, len);
+        char** args = parse_command(line, &arena);
+        tokens += args[0] != NULL;  // Keep the result live
+        arena_reset(&arena);
+    }
+    long long elapsed = monotonic_ns() - start;
+    unsigned long long calls = heap_calls - calls_before;
+    arena_free(&arena);
+
+    printf("{\"bench\":\"parse_command\",\"iterations\":%ld,\"ns_per_op\":%.1f,"
+           "\"heap_allocs_per_op\":%.3f,\"parsed\":%zu}\n",
+           iterations, (double)elapsed / iterations, (double)calls / iterations, tokens);
+}
+
+// plan_get() for a line already in the plan cache, as when a history
+// line is recalled or a script repeats a line, against compiling it.
+// Misses cycle through more distinct lines than the cache holds.
+static void bench_plan_cache(void) {
+    const char* sample = "cd build && make -j8 > build.log 2>&1 || (tail -5 build.log; exit 1); echo done";
+    const long iterations = 1000000;
+    const int distinct = 2 * PLAN_CACHE_SLOTS;
+    char lines[2 * PLAN_CACHE_SLOTS][128];
+    for (int i = 0; i < distinct; i++) snprintf(lines[i], sizeof(lines[i]), "%s %d", sample, i);
+
+    plan_get(lines[0]);
+    unsigned long long calls_before = heap_calls;
+    long long start = monotonic_ns();
+    size_t nodes = 0;
+    for (long i = 0; i < iterations; i++) nodes += plan_get(lines[0])->node_count;
+    long long hit_ns = monotonic_ns() - start;
+    unsigned long long hit_calls = heap_calls - calls_before;
+
+    start = monotonic_ns();
+    for (long i = 0; i < iterations; i++) {
+        nodes += plan_get(lines[i % distinct])->node_count;
+        arena_reset(&command_arena);
+    }
+    long long miss_ns = monotonic_ns() - start;
+
+    printf("{\"bench\":\"plan_cache\",\"iterations\":%ld,\"hit_ns\":%.1f,\"miss_ns\":%.1f,"
+           "\"heap_allocs_per_hit\":%.3f,\"nodes\":%zu}\n",
+           iterations, (double)hit_ns / iterations, (double)miss_ns / iterations,
+           (double)hit_calls / iterations, nodes / (2 * iterations));
+}
+
+// Keystroke edits in the middle of a pasted-size line: insert a char,
+// step back, delete it, as an editor session would
+static void bench_gap_buffer(void) {
+    const size_t line_len = 64 * 1024;
+    const long iterations = 1000000;
+    GapBuffer gb = {0};
+    char* text = malloc(line_len);
+    memset(text, 'x', line_len);
+    gap_set(&gb, text, line_len);
+    free(text);
+
+    size_t cursor = line_len / 2;
+    long long start = monotonic_ns();
+    for (long i = 0; i < iterations; i++) {
+        gap_insert(&gb, cursor, "y", 1);
+        gap_delete(&gb, cursor, 1);
+        cursor = (i & 1) ? cursor + 1 : cursor - 1;
+    }
+    long long elapsed = monotonic_ns() - start;
+
+    String copy = {0};
+    start = monotonic_ns();
+    for (int i = 0; i < 1000; i++) gap_copy(&gb, 0, gap_length(&gb), &copy);
+    long long copy_elapsed = monotonic_ns() - start;
+    string_clear(&copy);
+    gap_free(&gb);
+
+    printf("{\"bench\":\"gap_buffer_edit\",\"line_bytes\":%zu,\"iterations\":%ld,"
+           "\"ns_per_edit\":%.1f,\"ns_per_full_copy\":%.1f}\n",
+           line_len, iterations, (double)elapsed / (iterations * 2), copy_elapsed / 1000.0);
+}
+
+// Runs the shell binary in batch mode over `lines` copies of line and
+// returns its peak RSS in KB
+static long batch_peak_rss(const char* line, long lines) {
+    int fds[2];
+    if (pipe(fds) == -1) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(SHELL_BINARY, SHELL_BINARY, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[0]);
+    FILE* input = fdopen(fds[1], "w");
+    for (long i = 0; i < lines; i++) fputs(line, input);
+    fclose(input);
+
+    int status;
+    struct rusage ru;
+    if (pid < 0 || wait4(pid, &status, 0, &ru) == -1) return -1;
+    return ru.ru_maxrss;
+}
+
+// Peak RSS of batch mode must not grow with the number of commands run
+static void bench_batch_rss(void) {
+    const char* line = "cd \".\" 'quoted arg' plain | ignored\n";
+    long small = batch_peak_rss(line, 10000);
+    long large = batch_peak_rss(line, 1000000);
+    printf("{\"bench\":\"batch_rss\",\"commands_small\":10000,\"rss_kb_small\":%ld,"
+           "\"commands_large\":1000000,\"rss_kb_large\":%ld}\n", small, large);
+}
+
+// history_add() with the on-disk log and index, then the cost of loading
+// a history of that size at startup
+static void bench_history_append(void) {
+    const size_t entries = 100000;
+    char dir[64];
+    char line[128];
+    bench_histfile(dir, sizeof(dir), "history");
+
+    History history;
+    history_open(&history);
+    long long start = monotonic_ns();
+    for (size_t i = 0; i < entries; i++) {
+        int len = history_sample(line, sizeof(line), i);
+        history_add(&history, line, len);
+    }
+    long long elapsed = monotonic_ns() - start;
+    history_close(&history);
+
+    start = monotonic_ns();
+    history_open(&history);
+    long long load = monotonic_ns() - start;
+    size_t loaded = history_count(&history);
+    history_close(&history);
+    bench_histfile_remove(dir);
+
+    printf("{\"bench\":\"history_append\",\"entries\":%zu,\"ns_per_append\":%.1f,"
+           "\"load_ms\":%.3f,\"loaded\":%zu}\n",
+           entries, (double)elapsed / entries, load / 1e6, loaded);
+}
+
+// Types term into reverse-i-search one key at a time, as a user would,
+// and records the latency of every keystroke
+static void search_type(ShellState* state, const char* term, long long* samples, size_t* count) {
+    state->searching = true;
+    for (const char* p = term; *p != '\0'; p++) {
+        long long start = monotonic_ns();
+        handle_search((unsigned char)*p, state);
+        samples[(*count)++] = monotonic_ns() - start;
+    }
+    handle_search(27, state);  // ESC ends the search
+}
+
+// handle_search() keystroke latency against the size of the history,
+// for a term with many matches and for one with none. The trigram index
+// is built before the first keystroke, as the first ctrl-r does.
+static void bench_search(void) {
+    static const size_t sizes[] = {10000, 100000, 1000000};
+    const int rounds = 20;
+    FILE* out;
+    FILE* in;
+    SCREEN* screen = bench_screen_open(&out, &in);
+    char line[128];
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        ShellState state;
+        memset(&state, 0, sizeof(state));
+        state.history_pos = -1;
+        // No log file: the entries live in memory as a session's would
+        state.history.log_fd = -1;
+        state.history.index_fd = -1;
+        for (size_t i = 0; i < sizes[s]; i++) {
+            int len = history_sample(line, sizeof(line), i);
+            history_add(&state.history, line, len);
+        }
+
+        long long start = monotonic_ns();
+        search_index_update(&state.search_index, &state.history);
+        long long build = monotonic_ns() - start;
+
+        const char* hit = "build1";
+        const char* miss = "zqxjv";
+        long long* hits = samples_alloc(rounds * strlen(hit));
+        long long* misses = samples_alloc(rounds * strlen(miss));
+        size_t hit_count = 0;
+        size_t miss_count = 0;
+        for (int r = 0; r < rounds; r++) {
+            search_type(&state, hit, hits, &hit_count);
+            search_type(&state, miss, misses, &miss_count);
+        }
+
+        printf("{\"bench\":\"history_search\",\"entries\":%zu,\"index_build_ms\":%.3f,"
+               "\"hit_p50_ns\":%lld,\"hit_p99_ns\":%lld,\"miss_p50_ns\":%lld,\"miss_p99_ns\":%lld}\n",
+               sizes[s], build / 1e6,
+               percentile(hits, hit_count, 50), percentile(hits, hit_count, 99),
+               percentile(misses, miss_count, 50), percentile(misses, miss_count, 99));
+        free(hits);
+        free(misses);
+        search_index_free(&state.search_index);
+        history_close(&state.history);
+        string_clear(&state.search_term);
+        string_clear(&state.view.text);
+        gap_free(&state.current_cmd);
+    }
+    bench_screen_close(screen, out, in);
+}
+
+// Fuzzy finder latency per keystroke, search and drawing included, as
+// the term is typed and then erased. The first key and every backspace
+// scan all distinct lines; the other keys narrow the previous matches.
+static void bench_fuzzy_search(void) {
+    static const size_t sizes[] = {10000, 100000, 1000000};
+    const char* term = "gitfix12";
+    const int rounds = 10;
+    FILE* out;
+    FILE* in;
+    SCREEN* screen = bench_screen_open(&out, &in);
+    char line[128];
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        ShellState state;
+        memset(&state, 0, sizeof(state));
+        state.history_pos = -1;
+        state.current_line = LINES - 1;
+        state.history.log_fd = -1;
+        state.history.index_fd = -1;
+        for (size_t i = 0; i < sizes[s]; i++) {
+            int len = history_sample(line, sizeof(line), i);
+            history_add(&state.history, line, len);
+        }
+
+        long long start = monotonic_ns();
+        fuzzy_index_update(&state.fuzzy_index, &state.history);
+        long long build = monotonic_ns() - start;
+
+        size_t keys = strlen(term);
+        long long* typed = samples_alloc(rounds * keys);
+        long long* erased = samples_alloc(rounds * keys);
+        size_t typed_count = 0;
+        size_t erased_count = 0;
+        size_t matches = 0;
+        for (int r = 0; r < rounds; r++) {
+            fuzzy_open(&state, "", 0);
+            fuzzy_refresh(&state);
+            for (size_t k = 0; k < keys; k++) {
+                start = monotonic_ns();
+                handle_fuzzy((unsigned char)term[k], &state);
+                fuzzy_refresh(&state);
+                typed[typed_count++] = monotonic_ns() - start;
+            }
+            matches = state.fuzzy_index.match_count;
+            for (size_t k = 0; k < keys; k++) {
+                start = monotonic_ns();
+                handle_fuzzy(127, &state);
+                fuzzy_refresh(&state);
+                erased[erased_count++] = monotonic_ns() - start;
+            }
+            state.fuzzy = false;
+            string_clear(&state.fuzzy_term);
+        }
+
+        printf("{\"bench\":\"fuzzy_search\",\"entries\":%zu,\"distinct\":%zu,\"index_build_ms\":%.3f,"
+               "\"matches\":%zu,\"type_p50_ns\":%lld,\"type_max_ns\":%lld,"
+               "\"erase_p50_ns\":%lld,\"erase_max_ns\":%lld,\"threads\":%zu}\n",
+               sizes[s], state.fuzzy_index.count, build / 1e6, matches,
+               percentile(typed, typed_count, 50), percentile(typed, typed_count, 100),
+               percentile(erased, erased_count, 50), percentile(erased, erased_count, 100),
+               fuzzy_thread_limit());
+        free(typed);
+        free(erased);
+        fuzzy_index_free(&state.fuzzy_index);
+        history_close(&state.history);
+        string_clear(&state.view.text);
+        gap_free(&state.current_cmd);
+    }
+    bench_screen_close(screen, out, in);
+}
+
+// redraw_prompt() for the three cases the editor meets: a keystroke at
+// the end of the line, a cursor move with no text change, and a full
+// repaint. Bytes are what the terminal receives per call.
+static void bench_redraw_prompt(void) {
+    const long iterations = 100000;
+    FILE* out;
+    FILE* in;
+    SCREEN* screen = bench_screen_open(&out, &in);
+    ShellState state;
+    memset(&state, 0, sizeof(state));
+    const char* text = "grep -rn --include='*.c' redraw_prompt src/ | sort | uniq -c";
+    size_t len = strlen(text);
+    gap_set(&state.current_cmd, text, len);
+    state.cursor_pos = len;
+    redraw_prompt(&state);
+
+    // Typing: one character added and removed again at the end
+    long long bytes = screen_bytes(out);
+    long long start = monotonic_ns();
+    for (long i = 0; i < iterations; i++) {
+        bool add = (i & 1) == 0;
+        if (add) gap_insert(&state.current_cmd, len, "x", 1);
+        else gap_delete(&state.current_cmd, len, 1);
+        state.cursor_pos = add ? len + 1 : len;
+        redraw_prompt(&state);
+    }
+    long long type_ns = monotonic_ns() - start;
+    long long type_bytes = screen_bytes(out) - bytes;
+
+    // Cursor movement only
+    bytes = screen_bytes(out);
+    start = monotonic_ns();
+    for (long i = 0; i < iterations; i++) {
+        state.cursor_pos = (i & 1) ? len : len / 2;
+        redraw_prompt(&state);
+    }
+    long long move_ns = monotonic_ns() - start;
+    long long move_bytes = screen_bytes(out) - bytes;
+
+    // Full repaint of prompt and text
+    bytes = screen_bytes(out);
+    start = monotonic_ns();
+    for (long i = 0; i < iterations; i++) {
+        state.view.valid = false;
+        state.current_line = (int)(i & 1);  // Forces curses to send the line again
+        redraw_prompt(&state);
+    }
+    long long full_ns = monotonic_ns() - start;
+    long long full_bytes = screen_bytes(out) - bytes;
+
+    string_clear(&state.view.text);
+    gap_free(&state.current_cmd);
+    bench_screen_close(screen, out, in);
+
+    printf("{\"bench\":\"redraw_prompt\",\"line_bytes\":%zu,\"iterations\":%ld,"
+           "\"type_ns\":%.1f,\"type_bytes\":%.1f,\"move_ns\":%.1f,\"move_bytes\":%.1f,"
+           "\"full_ns\":%.1f,\"full_bytes\":%.1f}\n",
+           len, iterations,
+           (double)type_ns / iterations, (double)type_bytes / iterations,
+           (double)move_ns / iterations, (double)move_bytes / iterations,
+           (double)full_ns / iterations, (double)full_bytes / iterations);
+}
+
+// Launch-to-reap latency of an external command through _command(), and
+// the same command answered by an in-process utility through
+// run_command()
+static void bench_command_latency(void) {
+    const int iterations = 2000;
+    long long* wall = samples_alloc(iterations);
+    long long* spawn = samples_alloc(iterations);
+    long long* inline_wall = samples_alloc(iterations);
+    CommandStats stats;
+    char true_path[] = "/bin/true";
+    char true_name[] = "true";
+
+    for (int i = 0; i < iterations; i++) {
+        char* args[] = {true_path, NULL};
+        long long start = monotonic_ns();
+        _command(args, &stats, false);
+        wall[i] = monotonic_ns() - start;
+        spawn[i] = stats.spawn_ns;
+    }
+    for (int i = 0; i < iterations; i++) {
+        char* args[] = {true_name, NULL};
+        long long start = monotonic_ns();
+        run_command(args, &stats, false);
+        inline_wall[i] = monotonic_ns() - start;
+    }
+
+    printf("{\"bench\":\"command_latency\",\"command\":\"/bin/true\",\"iterations\":%d,"
+           "\"spawn_p50_ns\":%lld,\"wall_p50_ns\":%lld,\"wall_p99_ns\":%lld,"
+           "\"inline_p50_ns\":%lld,\"inline_p99_ns\":%lld}\n",
+           iterations, percentile(spawn, iterations, 50),
+           percentile(wall, iterations, 50), percentile(wall, iterations, 99),
+           percentile(inline_wall, iterations, 50), percentile(inline_wall, iterations, 99));
+    free(wall);
+    free(spawn);
+    free(inline_wall);
+}
+
+// Runs command in the shell binary with -c and returns its wall time in
+// ns, with its peak RSS in KB in *rss_kb
+static long long shell_run(const char* command, long* rss_kb) {
+    long long start = monotonic_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The shell starts with only fds 0-2, as from a terminal
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+        execl(SHELL_BINARY, SHELL_BINARY, "-c", command, (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (pid < 0 || wait4(pid, &status, 0, &ru) == -1) return -1;
+    *rss_kb = ru.ru_maxrss;
+    return monotonic_ns() - start;
+}
+
+// Latency of a line holding a $(...), the rate a large $(...) is read
+// into its word, and two <(...) streams compared by cmp, at two sizes:
+// the shell's peak RSS must not grow with the size of the streams
+static void bench_substitution(void) {
+    const int iterations = 500;
+    long long* wall = samples_alloc(iterations);
+    char line[] = "true $(true)";
+    for (int i = 0; i < iterations; i++) {
+        long long start = monotonic_ns();
+        run_line(line);
+        wall[i] = monotonic_ns() - start;
+    }
+
+    const long capture_mb = 64;
+    char capture[64];
+    snprintf(capture, sizeof(capture), "true \"$(yes | head -c %ldM)\"", capture_mb);
+    long long start = monotonic_ns();
+    run_line(capture);
+    long long capture_ns = monotonic_ns() - start;
+
+    const long small_mb = 256, large_mb = 2048;
+    char command[128];
+    long small_rss = 0, large_rss = 0;
+    snprintf(command, sizeof(command), "cmp <(head -c %ldM /dev/zero) <(head -c %ldM /dev/zero)", small_mb, small_mb);
+    shell_run(command, &small_rss);
+    snprintf(command, sizeof(command), "cmp <(head -c %ldM /dev/zero) <(head -c %ldM /dev/zero)", large_mb, large_mb);
+    long long large_ns = shell_run(command, &large_rss);
+
+    printf("{\"bench\":\"substitution\",\"iterations\":%d,\"line_p50_ns\":%lld,\"line_p99_ns\":%lld,"
+           "\"capture_mb\":%ld,\"capture_mb_per_s\":%.0f,\"stream_mb\":%ld,\"stream_mb_per_s\":%.0f,"
+           "\"rss_kb_small\":%ld,\"rss_kb_large\":%ld}\n",
+           iterations, percentile(wall, iterations, 50), percentile(wall, iterations, 99),
+           capture_mb, capture_mb / (capture_ns / 1e9), large_mb, large_mb / (large_ns / 1e9),
+           small_rss, large_rss);
+    free(wall);
+}
+
+// Whether the file at path holds exactly text
+static bool file_holds(const char* path, const char* text) {
+    char buf[256];
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n == (ssize_t)strlen(text) && memcmp(buf, text, n) == 0;
+}
+
+// n>file >&n and n<file <&n run by the shell binary in batch mode, where
+// open() hands the file fd n itself: the output must land in the file.
+// Reports the launch-to-exit time of one such line.
+static void bench_redirect_dup(void) {
+    const int iterations = 200;
+    char dir[] = "/tmp/shell_bench_redirect_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    char command[PATH_MAX * 3], out_path[PATH_MAX], in_path[PATH_MAX], copy_path[PATH_MAX];
+    snprintf(out_path, sizeof(out_path), "%s/out", dir);
+    snprintf(in_path, sizeof(in_path), "%s/in", dir);
+    snprintf(copy_path, sizeof(copy_path), "%s/copy", dir);
+    int fd = open(in_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || !write_all(fd, "in\n", 3)) {
+        perror(in_path);
+        exit(1);
+    }
+    close(fd);
+
+    long rss = 0;
+    long long* wall = samples_alloc(iterations);
+    snprintf(command, sizeof(command), "/bin/echo out 3>%s >&3", out_path);
+    for (int i = 0; i < iterations; i++) wall[i] = shell_run(command, &rss);
+    bool output_ok = file_holds(out_path, "out\n");
+    snprintf(command, sizeof(command), "/bin/cat 3<%s <&3 >%s", in_path, copy_path);
+    shell_run(command, &rss);
+    bool input_ok = file_holds(copy_path, "in\n");
+
+    printf("{\"bench\":\"redirect_dup\",\"iterations\":%d,\"output_ok\":%s,\"input_ok\":%s,"
+           "\"line_p50_ns\":%lld,\"line_p99_ns\":%lld}\n",
+           iterations, output_ok ? "true" : "false", input_ok ? "true" : "false",
+           percentile(wall, iterations, 50), percentile(wall, iterations, 99));
+    free(wall);
+    unlink(out_path);
+    unlink(in_path);
+    unlink(copy_path);
+    rmdir(dir);
+}
+
+// Expands pattern as the argument of a command and returns how many
+// words it became
+static size_t glob_count(const char* pattern) {
+    char line[256];
+    snprintf(line, sizeof(line), "true %s", pattern);
+    Expansion e;
+    size_t count = 0;
+    if (expand_words(parse_command(line, &command_arena), 0, false, &e)) count = e.count - 1;
+    expanded_args = NULL;
+    arena_reset(&command_arena);
+    return count;
+}
+
+// Glob expansion over a 50k-entry build directory whose mtime is older
+// than the listing: cold reads the directory, warm reuses the cached
+// listing, and prefix narrows it by binary search before matching
+static void bench_glob(void) {
+    const int files = 50000;
+    const int cold_iterations = 20, warm_iterations = 200;
+    char dir[] = "/tmp/shell_bench_glob_XXXXXX";
+    char path[PATH_MAX];
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    snprintf(path, sizeof(path), "%s/build", dir);
+    mkdir(path, 0700);
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/build/f%05d.%c", dir, i / 2, i % 2 ? 'c' : 'o');
+        close(open(path, O_WRONLY | O_CREAT, 0600));
+    }
+    // An mtime from the last second is never trusted, so age it
+    struct timespec times[2] = {{.tv_sec = time(NULL) - 10}, {.tv_sec = time(NULL) - 10}};
+    snprintf(path, sizeof(path), "%s/build", dir);
+    utimensat(AT_FDCWD, path, times, 0);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL || chdir(dir) == -1) {
+        perror("chdir");
+        exit(1);
+    }
+
+    long long* cold = samples_alloc(cold_iterations);
+    long long* warm = samples_alloc(warm_iterations);
+    long long* prefix = samples_alloc(warm_iterations);
+    size_t matches = 0, prefix_matches = 0;
+    for (int i = 0; i < cold_iterations; i++) {
+        for (int slot = 0; slot < DIR_CACHE_SLOTS; slot++) {
+            free(dir_cache[slot].names);
+            dir_cache[slot].names = NULL;
+        }
+        long long start = monotonic_ns();
+        matches = glob_count("build/*.o");
+        cold[i] = monotonic_ns() - start;
+    }
+    for (int i = 0; i < warm_iterations; i++) {
+        long long start = monotonic_ns();
+        glob_count("build/*.o");
+        warm[i] = monotonic_ns() - start;
+        start = monotonic_ns();
+        prefix_matches = glob_count("build/f012*.[co]");
+        prefix[i] = monotonic_ns() - start;
+    }
+
+    printf("{\"bench\":\"glob\",\"files\":%d,\"matches\":%zu,\"cold_p50_ns\":%lld,\"warm_p50_ns\":%lld,"
+           "\"warm_p99_ns\":%lld,\"prefix_matches\":%zu,\"prefix_p50_ns\":%lld}\n",
+           files, matches, percentile(cold, cold_iterations, 50), percentile(warm, warm_iterations, 50),
+           percentile(warm, warm_iterations, 99), prefix_matches, percentile(prefix, warm_iterations, 50));
+    free(cold);
+    free(warm);
+    free(prefix);
+
+    if (chdir(cwd) == -1) perror("chdir");
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/build/f%05d.%c", dir, i / 2, i % 2 ? 'c' : 'o');
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/build", dir);
+    rmdir(path);
+    rmdir(dir);
+}
+
+// How late the timeout watchdog stops a command past its deadline, and
+// what launching /bin/true costs once ulimit forces fork() over
+// posix_spawn
+static void bench_timeout(void) {
+    const int iterations = 50, launches = 2000;
+    const long long deadline_ms = 20;
+    long long* late = samples_alloc(iterations);
+    long long* spawn = samples_alloc(launches);
+    long long* limited = samples_alloc(launches);
+    char line[64];
+    snprintf(line, sizeof(line), "timeout %lld.%03lld sleep 10", deadline_ms / 1000, deadline_ms % 1000);
+    for (int i = 0; i < iterations; i++) {
+        long long start = monotonic_ns();
+        run_line(line);
+        late[i] = monotonic_ns() - start - deadline_ms * 1000000;
+    }
+
+    // cat on an input that never ends, as "timeout 5 cat" on an idle
+    // terminal: the shell must launch it as a child it can stop
+    long long* utility_late = samples_alloc(iterations);
+    int input[2];
+    int saved_stdin = dup(STDIN_FILENO);
+    if (pipe(input) == -1 || saved_stdin == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    dup2(input[0], STDIN_FILENO);
+    snprintf(line, sizeof(line), "timeout %lld.%03lld cat", deadline_ms / 1000, deadline_ms % 1000);
+    for (int i = 0; i < iterations; i++) {
+        long long start = monotonic_ns();
+        run_line(line);
+        utility_late[i] = monotonic_ns() - start - deadline_ms * 1000000;
+    }
+    dup2(saved_stdin, STDIN_FILENO);
+    close(saved_stdin);
+    close(input[0]);
+    close(input[1]);
+
+    CommandStats stats;
+    char true_path[] = "/bin/true";
+    for (int i = 0; i < launches; i++) {
+        char* args[] = {true_path, NULL};
+        _command(args, &stats, false);
+        spawn[i] = stats.spawn_ns;
+    }
+    char ulimit_line[] = "ulimit -n 256";
+    run_line(ulimit_line);
+    for (int i = 0; i < launches; i++) {
+        char* args[] = {true_path, NULL};
+        _command(args, &stats, false);
+        limited[i] = stats.spawn_ns;
+    }
+    command_limits_set = 0;
+
+    printf("{\"bench\":\"timeout\",\"iterations\":%d,\"deadline_ms\":%lld,\"late_p50_ns\":%lld,"
+           "\"late_p99_ns\":%lld,\"cat_late_p50_ns\":%lld,\"spawn_p50_ns\":%lld,"
+           "\"limited_spawn_p50_ns\":%lld}\n",
+           iterations, deadline_ms, percentile(late, iterations, 50), percentile(late, iterations, 99),
+           percentile(utility_late, iterations, 50), percentile(spawn, launches, 50),
+           percentile(limited, launches, 50));
+    free(late);
+    free(utility_late);
+    free(spawn);
+    free(limited);
+}
+
+// Cost of the instrumentation on the hot paths: one counter bump plus
+// one histogram sample, as redraw_prompt() takes per call
+static void bench_stats(void) {
+    const long iterations = 10000000;
+    long long start = monotonic_ns();
+    for (long i = 0; i < iterations; i++) {
+        stat_count(STAT_REDRAW_PROMPT);
+        stat_record(STAT_REDRAW_TIME, i & 0xfffff);
+    }
+    long long elapsed = monotonic_ns() - start;
+    uint64_t recorded = stat_histograms[STAT_REDRAW_TIME].count;
+    stats_reset();
+    printf("{\"bench\":\"stats\",\"iterations\":%ld,\"recorded\":%llu,\"per_call_ns\":%.2f}\n",
+           iterations, (unsigned long long)recorded, (double)elapsed / iterations);
+}
+
+// Reads from the pty until byte shows up or timeout_ms passes. Returns
+// false on timeout or when the shell went away.
+static bool pty_wait_for(int fd, char byte, int timeout_ms) {
+    char buf[4096];
+    long long deadline = monotonic_ns() + timeout_ms * 1000000LL;
+    while (true) {
+        int left = (int)((deadline - monotonic_ns()) / 1000000);
+        if (left <= 0) return false;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, left) <= 0) continue;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) return false;
+        if (memchr(buf, byte, n) != NULL) return true;
+    }
+}
+
+// Reads whatever the shell prints until it has been quiet for quiet_ms
+static void pty_drain(int fd, int quiet_ms) {
+    char buf[4096];
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (poll(&pfd, 1, quiet_ms) > 0 && read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+// Drives the interactive shell through a pseudo-terminal and measures
+// the time from writing a key to the terminal receiving its echo: input
+// handling, redraw_prompt() and the curses refresh together
+static void bench_keystroke_latency(void) {
+    const int keys = 1000;
+    const int line_max = 100;  // Keys typed before the line is cleared
+    char dir[64];
+    bench_histfile(dir, sizeof(dir), "history");
+
+    struct winsize ws = {.ws_row = 40, .ws_col = 160};
+    int master;
+    pid_t pid = forkpty(&master, NULL, NULL, &ws);
+    if (pid == 0) {
+        setenv("TERM", "xterm", 1);
+        execl(SHELL_BINARY, SHELL_BINARY, (char*)NULL);
+        _exit(127);
+    }
+    if (pid == -1) {
+        perror("forkpty");
+        bench_histfile_remove(dir);
+        return;
+    }
+
+    long long* samples = samples_alloc(keys);
+    int typed = 0;
+    // The prompt ends in "$ " and the cwd; wait for the screen to settle
+    if (pty_wait_for(master, '$', PTY_READY_MS)) {
+        pty_drain(master, 200);
+        for (; typed < keys; typed++) {
+            if (typed > 0 && typed % line_max == 0) {
+                // Clear the line so it never wraps
+                if (write(master, "\x15", 1) != 1) break;
+                pty_drain(master, 20);
+            }
+            long long start = monotonic_ns();
+            if (write(master, "x", 1) != 1 || !pty_wait_for(master, 'x', 1000)) break;
+            samples[typed] = monotonic_ns() - start;
+        }
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(master);
+    bench_histfile_remove(dir);
+
+    printf("{\"bench\":\"keystroke_to_paint\",\"keys\":%d,\"p50_ns\":%lld,"
+           "\"p99_ns\":%lld,\"max_ns\":%lld}\n",
+           typed, percentile(samples, typed, 50), percentile(samples, typed, 99),
+           percentile(samples, typed, 100));
+    free(samples);
+}
+
+typedef struct {
+    const char* name;
+    void (*run)(void);
+} Bench;
+
+static const Bench benches[] = {
+    {"parse_command", bench_parse_command},
+    {"plan_cache", bench_plan_cache},
+    {"gap_buffer_edit", bench_gap_buffer},
+    {"batch_rss", bench_batch_rss},
+    {"history_append", bench_history_append},
+    {"history_search", bench_search},
+    {"fuzzy_search", bench_fuzzy_search},
+    {"redraw_prompt", bench_redraw_prompt},
+    {"command_latency", bench_command_latency},
+    {"substitution", bench_substitution},
+    {"redirect_dup", bench_redirect_dup},
+    {"glob", bench_glob},
+    {"timeout", bench_timeout},
+    {"stats", bench_stats},
+    {"keystroke_to_paint", bench_keystroke_latency},
+};
+
+// shell_bench [name...]: runs the named benchmarks, or all of them
+int main(int argc, char** argv) {
+    size_t count = sizeof(benches) / sizeof(benches[0]);
+    for (int i = 1; i < argc; i++) {
+        bool known = false;
+        for (size_t b = 0; b < count; b++) known |= strcmp(argv[i], benches[b].name) == 0;
+        if (!known) {
+            fprintf(stderr, "usage: %s [benchmark...]\nbenchmarks:", argv[0]);
+            for (size_t b = 0; b < count; b++) fprintf(stderr, " %s", benches[b].name);
+            fprintf(stderr, "\n");
+            return 2;
+        }
+    }
+    for (size_t b = 0; b < count; b++) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++) selected |= strcmp(argv[i], benches[b].name) == 0;
+        if (!selected) continue;
+        benches[b].run();
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -14,6 +15,30 @@
 #include <locale.h>
 #include <ctype.h>
 #include <time.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern char** environ;
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -26,6 +51,67 @@
 #define MAX_INPUT_SIZE 1024
 #define MAX_ARGS 64
 #define DELIMITERS " \t\r\n\a"
+#define MAX_STAGES 64
+#define ARENA_BLOCK_SIZE 4096
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+#define KEY_PASTE_END (KEY_MAX + 2)
+#define BRACKETED_PASTE_ON "\033[?2004h"
+#define BRACKETED_PASTE_OFF "\033[?2004l"
+#define HASH_START_CAPACITY 64
+#define HISTORY_FILE ".custom_shell_history"
+#define HISTORY_INDEX_SUFFIX ".idx"
+#define HISTORY_MAGIC 0x48534843u  // "CHSH"
+#define HISTORY_VERSION 1
+#define HISTORY_MAX_ENTRIES 1000000
+#define TRIGRAM_BUCKETS 65536
+#define SEARCH_MATERIALIZE_MAX 16384
+#define PARALLEL_WINDOW_FACTOR 4    // Tasks kept in flight per worker for ordered output
+#define PARALLEL_READ_SIZE 65536
+#define PARALLEL_BUFFER_MAX (16 * PARALLEL_READ_SIZE)  // Output kept per waiting task
+#define SCROLLBACK_SIZE (8 << 20)   // Bytes of command output kept for scrolling back
+#define OUTPUT_READ_SIZE 65536
+#define OUTPUT_FRAME_NS 16000000LL  // Repaint at most this often under heavy output
+#define COMPLETION_LIST_MAX 256     // Candidates kept for listing
+#define COMPLETION_HISTORY_SCAN 2000
+#define COMPLETION_WAIT_MS 50       // Longest a Tab waits for the command index
+#define DIR_CACHE_SLOTS 4
+#define TRIE_START_CAPACITY 4096
+#define TRIE_NONE 0
+#define COPY_CHUNK_SIZE (1 << 30)   // Bytes per in-kernel copy call in cat
+#define REDIRECT_FDS 10             // Fds 0-9 can be named in a redirection
+#define REDIRECT_MAX_OPEN 16
+#define SERVER_READ_SIZE 65536
+#define PLAN_CACHE_SLOTS 64         // Compiled command lines kept for reuse
+#define FUZZY_RESULTS_MAX 64        // Ranked candidates kept per search
+#define FUZZY_ROWS 12               // Candidates shown above the prompt
+#define FUZZY_CHUNK_MIN 65536       // Lines per thread before a scan is split
+#define FUZZY_THREADS_MAX 16
+#define SUBST_MAX 16                // Process substitutions in one command
+// Marks parse_command() leaves in a word where a substitution was typed,
+// each followed by the text inside the parentheses and SUBST_END
+#define SUBST_COMMAND '\001'        // $(...)
+#define SUBST_QUOTED '\002'         // "$(...)", kept as one word
+#define SUBST_INPUT '\003'          // <(...)
+#define SUBST_OUTPUT '\004'         // >(...)
+#define SUBST_END '\005'
+// A variable's mark is followed by its name, and by SUBST_END if braced
+#define SUBST_VARIABLE '\006'       // $NAME, ${NAME}, $? or $$
+#define SUBST_VARIABLE_QUOTED '\007'
+// Unquoted *, ? and [ are replaced by marks; quoted, they stay literal
+#define GLOB_STAR '\016'
+#define GLOB_ANY '\017'
+#define GLOB_CLASS '\020'
+// A here-document delimiter that was quoted starts with HEREDOC_QUOTED and
+// its body is kept literal; any other body starts with HEREDOC_EXPAND
+// once read, and is expanded when the redirection is applied
+#define HEREDOC_QUOTED '\021'
+#define HEREDOC_EXPAND '\022'
+#define VARIABLE_START_CAPACITY 128
+#define TIMEOUT_GRACE_MS 5000       // From a timeout's signal to SIGKILL, unless -k says otherwise
+#define TIMEOUT_STATUS 124          // Status of a command its timeout stopped, as timeout(1) reports it
+#define WATCHDOG_POLL_MS 100        // How often a deadline is checked without pidfds
+#define STAT_BUCKETS 64             // Histogram bucket b counts samples under 2^b ns
+#define STATS_FILE ".custom_shell_stats.json"
 
 typedef struct {
     char* data;
@@ -39,34 +125,748 @@ typedef struct {
     size_t capacity;
 } Strings;
 
+// On-disk history is an append-only log of NUL-terminated commands plus an
+// index file of 64-bit log offsets behind a small header. Both are mapped
+// read-only at startup, so loading never parses or copies old entries.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t log_ino;   // Inode of the log this index describes
+} HistoryIndexHeader;
+
+typedef struct {
+    int log_fd;
+    int index_fd;
+    char* log_map;
+    size_t log_map_size;
+    char* index_map;
+    size_t index_map_size;
+    const uint64_t* offsets;   // Entry offsets inside log_map
+    size_t mapped_count;
+    size_t mapped_end;         // End of the last mapped entry
+    Strings recent;            // Entries added during this session
+} History;
+
+typedef struct {
+    uint32_t* ids;      // Ascending history entry numbers
+    uint32_t count;
+    uint32_t capacity;
+} Posting;
+
+// Trigram index over the history for reverse-i-search. Trigrams are
+// hashed into a fixed number of buckets; collisions only add candidates
+// that the final memmem() check rejects. The candidates for the last
+// search term are kept so a growing term narrows them instead of starting
+// over.
+typedef struct {
+    Posting* buckets;
+    size_t indexed;           // History entries added to the index so far
+    uint32_t* candidates;
+    size_t candidate_count;
+    size_t candidate_capacity;
+    String candidate_term;    // Term the candidates were computed for
+    size_t candidate_indexed; // Value of indexed when they were computed
+} SearchIndex;
+
+// A distinct history line for the fuzzy finder: the newest entry with
+// that text, how often it was run and a bitmask of the bytes it holds, so
+// most lines are rejected without reading their text
+typedef struct {
+    uint64_t mask;
+    uint32_t id;
+    uint32_t count;
+} FuzzyLine;
+
+typedef struct {
+    uint32_t line;      // Index into FuzzyIndex.lines
+    int score;
+} FuzzyResult;
+
+// Fuzzy finder over the distinct history lines. The lines matching the
+// last term are kept, so typing one more character only rescans those.
+typedef struct {
+    FuzzyLine* lines;
+    size_t count;
+    size_t capacity;
+    uint64_t* slots;          // Text hash << 32 | line index + 1, open addressed
+    size_t slot_capacity;
+    size_t indexed;           // History entries folded in so far
+    uint32_t* matches;        // Lines matching match_term, in line order
+    size_t match_count;
+    size_t match_capacity;
+    String match_term;
+    bool match_valid;
+    FuzzyResult results[FUZZY_RESULTS_MAX];
+    size_t result_count;
+} FuzzyIndex;
+
+// Edit line kept as the text before the cursor, a gap, then the text after
+// it. Inserting or deleting at the cursor only moves the gap's edges, so
+// edits are O(1) amortized; the gap is moved lazily when an edit lands
+// somewhere else.
+typedef struct {
+    char* data;
+    size_t gap_start;   // Also the length of the text before the gap
+    size_t gap_end;
+    size_t capacity;
+} GapBuffer;
+
+// What redraw_prompt() last put on the prompt line, so the next call
+// only sends the cells that changed
+typedef struct {
+    String text;                // Command text drawn after the prompt
+    int line;
+    size_t cursor;
+    int prompt_len;             // Width of the prompt and cwd before the text
+    unsigned int cwd_generation;
+    bool valid;
+} PromptView;
+
+typedef enum {
+    ESC_NONE,
+    ESC_START,      // After ESC
+    ESC_CSI,        // ESC [ parameters... final byte
+    ESC_OSC,        // ESC ] text... BEL or ESC backslash
+    ESC_OSC_ESC,
+    ESC_CHARSET     // ESC ( x and friends
+} EscapeState;
+
+// Recent output of commands and of the shell itself, with terminal
+// control sequences stripped. Memory is fixed: once full, the older half
+// is dropped. Output is appended here first and drawn on the screen in
+// frames, so a command printing faster than the terminal can show costs
+// one screenful per frame rather than one scroll per line.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t capacity;
+    size_t dropped;         // Bytes discarded from the front so far
+    size_t unrendered;      // Bytes at the end not yet drawn
+    size_t unrendered_lines;
+    bool repaint;           // Redraw the last screenful instead of appending
+    long long last_frame_ns;
+    EscapeState esc_state;
+    char csi[16];
+    size_t csi_len;
+    bool alt_screen;        // A full-screen program owns the terminal
+} Scrollback;
+
 typedef struct {
-    int cursor_pos;
+    size_t cursor_pos;
     String clipboard;
-    String current_cmd;
-    Strings history;
+    GapBuffer current_cmd;
+    History history;
+    SearchIndex search_index;
     int history_pos;
     bool searching;
+    bool pasting;           // Inside a bracketed paste
+    String paste;           // Pasted bytes not yet inserted
     String search_term;
     int current_line;
+    PromptView view;
+    bool scrolling;         // Viewing the scrollback instead of the prompt
+    size_t scroll_pos;      // End of the viewed text, counting dropped bytes
+    bool scroll_typing;     // Entering a scrollback search term
+    String scroll_term;
+    bool tab_pending;       // The last key was a Tab that could not extend the word
+    bool fuzzy;             // The fuzzy history finder owns the screen
+    bool fuzzy_dirty;       // The term changed since the last search
+    String fuzzy_term;
+    size_t fuzzy_selected;  // Rank of the highlighted candidate
+    FuzzyIndex fuzzy_index;
 } ShellState;
 
+// Bump allocator for per-command data. Resetting keeps the memory, so
+// once it has grown to fit a typical command no further heap allocation
+// happens.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+} Arena;
+
+typedef struct {
+    char* name;
+    char* path;
+    unsigned int hits;
+} HashEntry;
+
+// Resource usage of one command (all stages of a pipeline combined)
+typedef struct {
+    long long spawn_ns;   // Time spent launching the stages up to exec
+    long long wall_ns;    // First launch until the last stage is reaped
+    struct timeval utime;
+    struct timeval stime;
+    long maxrss_kb;       // Largest resident set of any stage
+    long voluntary_ctxsw;
+    long involuntary_ctxsw;
+    int stages;
+} CommandStats;
+
+// Redirection operators, in the order of redirect_tokens[]
+typedef enum {
+    REDIR_IN,           // <
+    REDIR_OUT,          // > and >|
+    REDIR_APPEND,       // >>
+    REDIR_DUP_IN,       // <&
+    REDIR_DUP_OUT,      // >&
+    REDIR_BOTH,         // &>
+    REDIR_BOTH_APPEND,  // &>>
+    REDIR_HERE_STRING,  // <<<
+    REDIR_HEREDOC,      // <<
+    REDIR_HEREDOC_TABS, // <<-
+    REDIR_KINDS
+} RedirectKind;
+
+// The fds a command starts with: fds[n] is the shell's fd that becomes
+// the child's fd n, or -1 to start with it closed. Bit n of assigned is
+// set once one of the command's redirections has set fds[n]. Every fd
+// the shell opened for the command is listed in opened and closed once
+// it launched.
+// The process substitution pipes its words name as /dev/fd/N are listed
+// in passed and kept open under the same number.
+typedef struct {
+    int fds[REDIRECT_FDS];
+    unsigned int assigned;
+    int opened[REDIRECT_MAX_OPEN];
+    int opened_count;
+    int passed[SUBST_MAX];
+    int passed_count;
+} Redirections;
+
+// A <(...) or >(...) of the command being run; the shell holds its end
+// of the pipe until the command is over
+typedef struct {
+    pid_t pid;    // 0 when the shell does not wait for it
+    int fd;
+    int output;   // In interactive mode, what it prints for the scrollback
+} Substitution;
+
+typedef enum {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} JobState;
+
+// A pipeline launched by the shell. In interactive mode every stage joins
+// the job's process group, so the terminal and signals go to it as a unit.
+typedef struct {
+    int id;
+    pid_t pgid;
+    pid_t pids[MAX_STAGES];
+    JobState proc_state[MAX_STAGES];
+    int proc_count;
+    pid_t last_pid;        // Stage whose exit status is the job's
+    int exit_status;
+    JobState state;
+    bool foreground;
+    bool notify;           // Changed state since the user was last told
+    unsigned long seq;     // Bumped when backgrounded or stopped; picks %+ and %-
+    char* command;
+    long long start_ns;
+    CommandStats stats;
+    struct termios tmodes; // Terminal modes the job had when it stopped
+    bool has_tmodes;
+    bool captured;         // Output runs through a pty into the scrollback
+    int pty_fd;            // Master side of the job's pty, -1 once drained
+    long long deadline_ns; // When the watchdog next signals the job, or 0
+    long long grace_ns;    // From the timeout signal to SIGKILL; 0 sends none
+    int timeout_signal;
+    bool timed_out;        // The watchdog has signalled it
+} Job;
+
+typedef struct {
+    Job** items;           // Ordered by job id
+    size_t count;
+    size_t capacity;
+    unsigned long seq;
+} JobTable;
+
+// One invocation of the parallel builtin's command template. Output goes
+// straight through while the task is the oldest one still listed and is
+// buffered otherwise, so every task's output appears whole and in order.
+// Once PARALLEL_BUFFER_MAX is buffered the task's pipe is left unread, so
+// it blocks writing until its turn comes.
+typedef struct {
+    pid_t pid;
+    int out_fd;            // Read end of the task's stdout/stderr pipe
+    String output;
+    const char* arg;
+    int status;
+    bool running;
+} ParallelTask;
+
+// A command run by the shell itself. Shell builtins change the shell's
+// own state; utilities stand in for programs and write to out_fd, and
+// options lists the flags they implement (NULL: they parse their own).
+typedef struct {
+    const char* name;
+    int (*handler)(char** args);
+    int (*utility)(char** args, int in_fd, int out_fd);
+    const char* options;
+    bool reads_input;       // Reads stdin when given no operands
+} Builtin;
+
+// Node of a compiled command line. Lists and conditionals refer to their
+// operands by index into the plan's node array.
+typedef enum {
+    NODE_COMMAND,   // A pipeline: tokens[start, end) with its "|"s and redirections
+    NODE_GROUP,     // "(" list ")" run by a forked shell; start is the "(" token
+    NODE_SEQUENCE,  // left ; right, or left & right
+    NODE_AND,       // left && right
+    NODE_OR         // left || right
+} NodeKind;
+
+typedef struct {
+    NodeKind kind;
+    bool background;          // A command ended by "&"
+    int left;
+    int right;
+    int start;
+    int end;
+    const Builtin* builtin;   // What a command's first word names, looked up once
+    bool expands;             // A command with a substitution in its words
+} PlanNode;
+
+// A command line compiled once and reused whenever the same text runs
+// again. Word tokens point into words; operators are the static tokens.
+typedef struct {
+    char* text;               // The line as typed, the cache key
+    char* words;              // Its tokenized copy, in the same allocation
+    size_t len;
+    size_t hash;
+    char** tokens;            // NULL-terminated
+    int token_count;
+    PlanNode* nodes;          // Same allocation as tokens
+    int node_count;
+    int root;
+    unsigned long used;       // For least-recently-used replacement
+} Plan;
+
+// One client of the command server. Commands write to two pipes, and a
+// relay thread frames whatever arrives on them onto the client socket.
+typedef struct {
+    int sock;
+    int out_fd;             // Read ends of the stdout and stderr pipes
+    int err_fd;
+    int wake_pipe[2];       // Stops the relay
+    int null_fd;
+    pthread_mutex_t lock;   // Held while pipe data is read and framed
+    bool client_gone;       // Writes failed; output is read and dropped
+} ServerSession;
+
+// Candidates for the word being completed. Only the first
+// COMPLETION_LIST_MAX are kept for listing; total and common cover all.
+typedef struct {
+    Strings matches;
+    size_t total;
+    String common;      // Longest prefix shared by every candidate
+} Completion;
+
+// Node of the command-name trie. Children form a sibling list sorted by
+// byte, so a walk yields names in order.
+typedef struct {
+    uint32_t child;
+    uint32_t sibling;
+    uint32_t count;     // Names ending at or below this node
+    uint16_t refs;      // $PATH directories holding the name ending here
+    unsigned char ch;
+} TrieNode;
+
+// A $PATH directory as the index thread last read it
+typedef struct {
+    char* path;
+    struct timespec mtime;
+    time_t scan_time;
+    String blob;
+    char** names;       // Executables, sorted, pointing into blob
+    size_t count;
+    bool scanned;
+} PathDir;
+
+// Prefix trie of the executables on $PATH for command completion. A
+// background thread builds it and, whenever a Tab asks, rereads only the
+// directories whose mtime changed, applying the difference to the trie.
+// The trie and request fields are shared under lock; dirs and
+// indexed_path belong to the thread.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool started;
+    bool stop;
+    bool dirty;             // A refresh was asked for
+    bool busy;              // A refresh is running
+    unsigned long generation;  // Refreshes finished
+    char* path_env;         // $PATH to index
+    TrieNode* nodes;
+    size_t node_count;
+    size_t node_capacity;
+    PathDir* dirs;
+    size_t dir_count;
+    char* indexed_path;
+} CommandIndex;
+
+// Sorted listing of one directory for path completion, reused until the
+// directory's mtime changes. Directory names carry a trailing '/'.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t scan_time;
+    String blob;
+    char** names;
+    size_t count;
+    unsigned long used;     // For least-recently-used replacement
+} DirListing;
+
+// Open-addressed table of command name -> resolved executable path, built
+// against a snapshot of $PATH and dropped as soon as $PATH changes.
+typedef struct {
+    HashEntry* entries;
+    size_t count;
+    size_t capacity;
+    char* path_env;
+} CommandHash;
+
+// Deadline the timeout builtin sets for the next job the shell launches
+typedef struct {
+    long long duration_ns;
+    long long grace_ns;
+    int signal;
+} Timeout;
+
+// A resource ulimit can limit for the commands the shell runs, counted
+// in units of unit bytes or seconds
+typedef struct {
+    char option;
+    int resource;
+    rlim_t unit;
+    const char* name;
+    const char* units;
+} LimitSpec;
+
+// Counts of the shell's own work, shown by shellstat
+typedef enum {
+    STAT_KEYS,
+    STAT_LINES,
+    STAT_REDRAW_PROMPT,
+    STAT_REDRAW_IDLE,       // Of those, the ones with nothing to send
+    STAT_STRING_ALLOC,      // A String's first buffer
+    STAT_STRING_REALLOC,    // A String's buffer growing
+    STAT_HISTORY_REALLOC,   // The session's history list growing
+    STAT_COUNTERS
+} StatCounter;
+
+// Latencies shellstat keeps histograms of
+typedef enum {
+    STAT_KEY_TO_PAINT,      // From a key being read to the screen showing it
+    STAT_REDRAW_TIME,       // One redraw_prompt()
+    STAT_SEARCH_SCAN,       // One reverse-i-search lookup
+    STAT_HISTOGRAMS
+} StatHistogram;
+
+// Latency histogram with power-of-two buckets: a sample of n ns lands in
+// bucket 64 - clz(n), so the bucket's samples are all under 2^bucket ns
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STAT_BUCKETS];
+} Histogram;
+
+// Shell variable, stored as the "name=value" string an environment holds
+typedef struct {
+    char* entry;
+    size_t name_len;
+    bool exported;
+} Variable;
+
+// Open-addressed table of shell variables. The exported ones make up
+// envp, a NULL-terminated array pointing at their entries that environ is
+// set to. It is rebuilt only when an exported variable changes, so a
+// spawn passes it as it is and getenv() sees what export set.
+typedef struct {
+    Variable* slots;
+    size_t count;
+    size_t capacity;
+    char** envp;
+    size_t envp_capacity;
+} VariableTable;
+
 // Function declarations
 void shell_initialize(void);
 void shell_terminate(void);
 void shell_interactive_loop(void);
 char* get_formatted_cwd(void);
-char** parse_command(char* line);
-int _command(char** args);
+void invalidate_cwd_cache(void);
+char** parse_command(char* line, Arena* arena);
+void* arena_alloc(Arena* arena, size_t size);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+int split_pipeline(char** args, char*** stages, int max_stages);
+int _command(char** args, CommandStats* stats, bool background);
+long long monotonic_ns(void);
+void print_command_stats(const CommandStats* stats);
+int handle_time(char** args);
+int handle_timing(char** args);
+int handle_timeout(char** args);
+int handle_ulimit(char** args);
+int handle_shellstat(char** args);
+bool stats_dump(const char* path);
+void stats_poll(void);
 int handle_cd(char** args);
 int handle_exit(char** args);
+int execute_command(char** args, const Builtin* builtin, bool background);
+int run_command(char** args, CommandStats* stats, bool background);
+const Builtin* builtin_find(const char* name);
+void jobs_reap(void);
+void jobs_watchdog(void);
+int jobs_watchdog_timeout(int timeout_ms);
+bool jobs_changed(void);
+int jobs_notify(void);
+int handle_jobs(char** args);
+int handle_fg(char** args);
+int handle_bg(char** args);
+int handle_wait(char** args);
+int handle_parallel(char** args);
+int run_line(char* line);
+const Plan* plan_get(const char* line);
+int plan_execute(const Plan* plan, char** tokens, int node);
+int group_find(char** argv);
+int run_lines(char* text);
+bool heredoc_pending(const char* text);
+char* heredoc_expand(const char* body);
+void set_bracketed_paste(bool enabled);
+int shell_batch_loop(FILE* input);
+void shell_print(const char* fmt, ...);
+void shell_error(const char* fmt, ...);
+void shell_flush(void);
 void execute_help_command(void);
-void handle_io_redirection(char** args, int* in_fd, int* out_fd);
+void redirections_init(Redirections* io, int in_fd, int out_fd, int err_fd);
+bool redirections_own(Redirections* io, int fd);
+void redirections_close(Redirections* io);
+int handle_io_redirection(char** args, Redirections* io);
+pid_t spawn_process(const char* path, char** argv, const Redirections* io, pid_t pgid);
+const char* hash_lookup(const char* name);
+void hash_remove(const char* name);
+void hash_reset(void);
+int handle_hash(char** args);
+const char* variable_get(const char* name);
+void variable_set(const char* name, size_t name_len, const char* value, bool exported);
+void variable_unset(const char* name);
+void variables_init(void);
+int handle_export(char** args);
+int handle_unset(char** args);
 void handle_cursor_movement(int ch, ShellState* state);
 void handle_line_editing(int ch, ShellState* state);
 void handle_history(int ch, ShellState* state);
+void history_open(History* history);
+void history_close(History* history);
+size_t history_count(const History* history);
+const char* history_entry(const History* history, size_t i, size_t* len);
+void history_add(History* history, const char* line, size_t len);
+void search_index_update(SearchIndex* index, const History* history);
+int search_index_find(SearchIndex* index, const History* history, const char* term,
+                      size_t term_len, int before);
+void search_index_free(SearchIndex* index);
+void string_reserve(String* str, size_t capacity);
+void string_set(String* str, const char* data, size_t len);
+size_t gap_length(const GapBuffer* gb);
+void gap_insert(GapBuffer* gb, size_t pos, const char* text, size_t len);
+void gap_delete(GapBuffer* gb, size_t pos, size_t len);
+void gap_copy(const GapBuffer* gb, size_t pos, size_t len, String* out);
+void gap_set(GapBuffer* gb, const char* text, size_t len);
+char* gap_text(GapBuffer* gb);
+void gap_free(GapBuffer* gb);
 void handle_search(int ch, ShellState* state);
+void fuzzy_index_update(FuzzyIndex* index, const History* history);
+void fuzzy_search(FuzzyIndex* index, const History* history, const char* term, size_t len);
+void fuzzy_index_free(FuzzyIndex* index);
+void handle_fuzzy(int ch, ShellState* state);
+void fuzzy_open(ShellState* state, const char* term, size_t len);
+void fuzzy_close(ShellState* state);
+void fuzzy_refresh(ShellState* state);
+void handle_key(int ch, ShellState* state);
 void redraw_prompt(ShellState* state);
 void clear_screen_keep_prompt(ShellState* state);
+void scrollback_append(const char* data, size_t len);
+void output_feed(const char* data, size_t len);
+void output_render(void);
+void output_repaint(ShellState* state);
+int handle_scrollback(char** args);
+bool job_read_output(Job* job);
+void handle_scrollback_key(int ch, ShellState* state);
+int shell_server(const char* path, long workers);
+void command_index_request(int wait_ms);
+void command_index_stop(void);
+size_t completion_collect(const char* line, size_t cursor, const History* history,
+                          String* word, size_t* stem, Completion* c);
+void completion_free(Completion* c);
+void handle_completion(ShellState* state, bool again);
+
+static CommandHash command_hash;
+static VariableTable variables;
+static Arena command_arena;
+static bool cwd_cache_valid = false;
+static unsigned int cwd_generation = 0;
+// Operator tokens returned by parse_command(); compared by address so a
+// quoted "|" or "&" stays an ordinary word
+static char pipe_token[] = "|";
+static char amp_token[] = "&";
+static char semi_token[] = ";";
+static char and_token[] = "&&";
+static char or_token[] = "||";
+static char lparen_token[] = "(";
+static char rparen_token[] = ")";
+static char redirect_tokens[REDIR_KINDS][4] = {
+    "<", ">", ">>", "<&", ">&", "&>", "&>>", "<<<", "<<", "<<-"
+};
+// The fd number written directly before a redirection, as in 2>file
+static char fd_tokens[REDIRECT_FDS][2] = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"};
+// Supplies the lines after a command for its here-documents; each front
+// end installs one for where its input comes from
+static bool (*heredoc_reader)(String* line) = NULL;
+// Where shell_error() writes while a utility's stderr is redirected
+static int error_fd = STDERR_FILENO;
+// Fds 3-9 that belong to commands: in a group's shell, those its
+// redirections set up. Elsewhere only 0-2 do.
+static unsigned int command_fds = 0;
+static bool report_timing = false;
+static bool interactive_mode = false;
+static bool shell_running = true;
+static int last_status = 0;
+static JobTable jobs;
+static pid_t shell_pgid = 0;
+static int sigchld_pipe[2] = {-1, -1};
+static volatile sig_atomic_t interrupted = 0;
+static Scrollback scrollback;
+static CommandIndex command_index = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+static DirListing dir_cache[DIR_CACHE_SLOTS];
+static unsigned long dir_cache_clock = 0;
+static Plan plan_cache[PLAN_CACHE_SLOTS];
+static unsigned long plan_cache_clock = 0;
+// The line being run and its tokens, where a "(" stage finds its group
+static const Plan* active_plan = NULL;
+static char** active_tokens = NULL;
+// A command whose words held substitutions runs from an expanded copy;
+// origin maps each of its words back to active_tokens, or to -1 for one
+// a substitution produced
+static char** expanded_args = NULL;
+static int* expanded_origin = NULL;
+static int expanded_count = 0;
+static Substitution substitutions[SUBST_MAX];
+static int substitution_count = 0;
+static Timeout command_timeout;
+// Whether the shell builtin being run was followed by "&"
+static bool command_background = false;
+static const LimitSpec limit_specs[] = {
+    {'n', RLIMIT_NOFILE, 1, "open files", NULL},
+    {'t', RLIMIT_CPU, 1, "cpu time", "seconds"},
+    {'v', RLIMIT_AS, 1024, "virtual memory", "kbytes"},
+};
+#define LIMIT_COUNT (sizeof(limit_specs) / sizeof(limit_specs[0]))
+// Limits ulimit set for commands, in effect where their bit in
+// command_limits_set is set. The shell itself is never limited, so it can
+// always stop what runs away.
+static struct rlimit command_limits[LIMIT_COUNT];
+static unsigned int command_limits_set = 0;
+static uint64_t stat_counters[STAT_COUNTERS];
+static Histogram stat_histograms[STAT_HISTOGRAMS];
+static long long stats_start_ns = 0;
+static const char* const stat_counter_names[STAT_COUNTERS] = {
+    "keys", "lines", "redraw_prompt", "redraw_prompt_idle",
+    "string_alloc", "string_realloc", "history_realloc"
+};
+static const char* const stat_histogram_names[STAT_HISTOGRAMS] = {
+    "key_to_paint", "redraw_prompt", "search_scan"
+};
+// Set by SIGUSR1; the stats file is written where the shell next waits
+static volatile sig_atomic_t stats_requested = 0;
+
+// Output helpers shared by the interactive and batch front ends. Under
+// ncurses messages start with a newline to step off the prompt line and
+// are kept in the scrollback; in batch mode that newline is dropped and
+// errors go to stderr.
+static void shell_vprint(const char* fmt, va_list ap) {
+    char buf[1024];
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(buf, sizeof(buf), fmt, copy);
+    va_end(copy);
+    if (n < 0) return;
+    char* text = buf;
+    if ((size_t)n >= sizeof(buf)) {
+        text = malloc(n + 1);
+        if (!text) return;
+        vsnprintf(text, n + 1, fmt, ap);
+    }
+    scrollback.esc_state = ESC_NONE;  // Never let a program's half-sent sequence eat this
+    output_feed(text, n);
+    if (text != buf) free(text);
+}
+
+void shell_print(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (interactive_mode) {
+        shell_vprint(fmt, ap);
+    } else {
+        vfprintf(stdout, fmt[0] == '\n' ? fmt + 1 : fmt, ap);
+    }
+    va_end(ap);
+}
+
+void shell_error(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (error_fd != STDERR_FILENO && !(interactive_mode && error_fd == STDOUT_FILENO)) {
+        // A utility's stderr was redirected to a file or closed
+        if (error_fd >= 0) {
+            fflush(stdout);
+            vdprintf(error_fd, fmt[0] == '\n' ? fmt + 1 : fmt, ap);
+        }
+    } else if (interactive_mode) {
+        shell_vprint(fmt, ap);
+        output_render();
+    } else {
+        vfprintf(stderr, fmt[0] == '\n' ? fmt + 1 : fmt, ap);
+    }
+    va_end(ap);
+}
+
+void shell_flush(void) {
+    if (interactive_mode) {
+        output_render();
+    } else {
+        fflush(stdout);
+    }
+}
+
+// Instrumentation. Counters are also bumped from the helper threads, so
+// they are added atomically; histograms are only fed by the main thread.
+static inline void stat_count(StatCounter counter) {
+    __atomic_fetch_add(&stat_counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+static inline void stat_record(StatHistogram which, long long ns) {
+    Histogram* h = &stat_histograms[which];
+    uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= STAT_BUCKETS) bucket = STAT_BUCKETS - 1;
+    h->count++;
+    h->sum_ns += value;
+    if (value > h->max_ns) h->max_ns = value;
+    h->buckets[bucket]++;
+}
 
 // String handling functions
 void string_init(String* str) {
@@ -77,6 +877,7 @@ void string_init(String* str) {
 
 void string_append(String* str, char ch) {
     if (str->count >= str->capacity) {
+        stat_count(str->capacity == 0 ? STAT_STRING_ALLOC : STAT_STRING_REALLOC);
         str->capacity = str->capacity == 0 ? DATA_START_CAPACITY : str->capacity * 2;
         char* new_data = realloc(str->data, str->capacity);
         if (!new_data) {
@@ -89,6 +890,31 @@ void string_append(String* str, char ch) {
     str->data[str->count++] = ch;
 }
 
+// Grows the buffer to hold at least capacity bytes
+void string_reserve(String* str, size_t capacity) {
+    if (capacity <= str->capacity) return;
+    stat_count(str->capacity == 0 ? STAT_STRING_ALLOC : STAT_STRING_REALLOC);
+    size_t new_cap = str->capacity == 0 ? DATA_START_CAPACITY : str->capacity;
+    while (new_cap < capacity) new_cap *= 2;
+    char* new_data = realloc(str->data, new_cap);
+    if (!new_data) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    str->data = new_data;
+    str->capacity = new_cap;
+}
+
+// Replaces the contents with len bytes of data, keeping a terminating NUL
+// after the last byte so the buffer can be printed directly
+void string_set(String* str, const char* data, size_t len) {
+    string_reserve(str, len + 1);
+    memcpy(str->data, data, len);
+    str->data[len] = '\0';
+    str->count = len;
+}
+
 void string_clear(String* str) {
     if (str->data) {
         free(str->data);
@@ -96,17 +922,462 @@ void string_clear(String* str) {
     }
 }
 
+// Gap buffer functions
+size_t gap_length(const GapBuffer* gb) {
+    return gb->capacity - (gb->gap_end - gb->gap_start);
+}
+
+// Moves the gap so it starts at pos
+static void gap_move(GapBuffer* gb, size_t pos) {
+    if (pos < gb->gap_start) {
+        size_t n = gb->gap_start - pos;
+        memmove(gb->data + gb->gap_end - n, gb->data + pos, n);
+        gb->gap_start -= n;
+        gb->gap_end -= n;
+    } else if (pos > gb->gap_start) {
+        size_t n = pos - gb->gap_start;
+        memmove(gb->data + gb->gap_start, gb->data + gb->gap_end, n);
+        gb->gap_start += n;
+        gb->gap_end += n;
+    }
+}
+
+// Grows the buffer until the gap holds at least `needed` bytes
+static void gap_reserve(GapBuffer* gb, size_t needed) {
+    if (gb->gap_end - gb->gap_start >= needed) return;
+    size_t tail = gb->capacity - gb->gap_end;
+    size_t new_cap = gb->capacity == 0 ? DATA_START_CAPACITY : gb->capacity * 2;
+    while (new_cap - gap_length(gb) < needed) new_cap *= 2;
+    char* new_data = realloc(gb->data, new_cap);
+    if (!new_data) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memmove(new_data + new_cap - tail, new_data + gb->gap_end, tail);
+    gb->data = new_data;
+    gb->gap_end = new_cap - tail;
+    gb->capacity = new_cap;
+}
+
+void gap_insert(GapBuffer* gb, size_t pos, const char* text, size_t len) {
+    gap_move(gb, pos);
+    gap_reserve(gb, len);
+    memcpy(gb->data + gb->gap_start, text, len);
+    gb->gap_start += len;
+}
+
+void gap_delete(GapBuffer* gb, size_t pos, size_t len) {
+    gap_move(gb, pos);
+    gb->gap_end += len;
+}
+
+// Copies len bytes starting at pos into out with at most two memcpys
+void gap_copy(const GapBuffer* gb, size_t pos, size_t len, String* out) {
+    string_reserve(out, len + 1);
+    size_t before = 0;
+    if (pos < gb->gap_start) {
+        before = gb->gap_start - pos < len ? gb->gap_start - pos : len;
+        memcpy(out->data, gb->data + pos, before);
+    }
+    if (before < len) {
+        size_t from = gb->gap_end + (pos + before - gb->gap_start);
+        memcpy(out->data + before, gb->data + from, len - before);
+    }
+    out->data[len] = '\0';
+    out->count = len;
+}
+
+// Replaces the whole line (history recall) with one bulk copy
+void gap_set(GapBuffer* gb, const char* text, size_t len) {
+    gb->gap_start = 0;
+    gb->gap_end = gb->capacity;
+    gap_reserve(gb, len + 1);
+    memcpy(gb->data, text, len);
+    gb->gap_start = len;
+}
+
+// Returns the line as one NUL-terminated string by moving the gap to the
+// end; the NUL lives in the gap, so later edits are unaffected
+char* gap_text(GapBuffer* gb) {
+    gap_move(gb, gap_length(gb));
+    gap_reserve(gb, 1);
+    gb->data[gb->gap_start] = '\0';
+    return gb->data;
+}
+
+void gap_free(GapBuffer* gb) {
+    free(gb->data);
+    memset(gb, 0, sizeof(*gb));
+}
+
+// History store
+static void history_path(char* path, size_t size, const char* suffix) {
+    const char* file = getenv("HISTFILE");
+    const char* home = getenv("HOME");
+    if (file != NULL && *file != '\0') {
+        snprintf(path, size, "%s%s", file, suffix);
+    } else if (home != NULL) {
+        snprintf(path, size, "%s/%s%s", home, HISTORY_FILE, suffix);
+    } else {
+        path[0] = '\0';
+    }
+}
+
+static size_t history_limit(void) {
+    const char* size = getenv("HISTSIZE");
+    long limit = size ? strtol(size, NULL, 10) : 0;
+    return limit > 0 ? (size_t)limit : HISTORY_MAX_ENTRIES;
+}
+
+static bool write_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Writes the index for every complete entry in log[start, size) to fd and
+// returns the end of the last complete entry.
+static size_t history_index_entries(int fd, const char* log, size_t start, size_t size) {
+    uint64_t batch[512];
+    size_t n = 0;
+    size_t pos = start;
+    const char* end;
+    while (pos < size && (end = memchr(log + pos, '\0', size - pos)) != NULL) {
+        batch[n++] = pos;
+        if (n == sizeof(batch) / sizeof(batch[0])) {
+            write_all(fd, batch, sizeof(batch));
+            n = 0;
+        }
+        pos = (size_t)(end - log) + 1;
+    }
+    if (n > 0) write_all(fd, batch, n * sizeof(uint64_t));
+    return pos;
+}
+
+// Rewrites log and index with only the newest `keep` entries. The log is
+// renamed into place first; an index left over from before the rename
+// names the old inode and is rebuilt on the next load.
+static void history_compact(const char* log, const uint64_t* offsets, size_t count,
+                            size_t end, size_t keep) {
+    char log_path[PATH_MAX], index_path[PATH_MAX], tmp_path[PATH_MAX + 8];
+    history_path(log_path, sizeof(log_path), "");
+    history_path(index_path, sizeof(index_path), HISTORY_INDEX_SUFFIX);
+
+    size_t first = count - keep;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", log_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return;
+    bool ok = write_all(fd, log + offsets[first], end - offsets[first]) && fsync(fd) == 0;
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, log_path) != 0) {
+        unlink(tmp_path);
+        return;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return;
+    HistoryIndexHeader header = { HISTORY_MAGIC, HISTORY_VERSION, (uint64_t)st.st_ino };
+    ok = write_all(fd, &header, sizeof(header));
+    for (size_t i = first; ok && i < count; i++) {
+        uint64_t off = offsets[i] - offsets[first];
+        ok = write_all(fd, &off, sizeof(off));
+    }
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, index_path) != 0) unlink(tmp_path);
+}
+
+// Brings the index in line with the log after a crash or a compaction and
+// returns false if the files could not be repaired. Called with the log
+// locked.
+static bool history_recover(int log_fd, int index_fd) {
+    struct stat log_st, index_st;
+    if (fstat(log_fd, &log_st) != 0 || fstat(index_fd, &index_st) != 0) return false;
+    size_t log_size = log_st.st_size;
+    char* log = log_size > 0 ? mmap(NULL, log_size, PROT_READ, MAP_SHARED, log_fd, 0) : NULL;
+    if (log == MAP_FAILED) return false;
+
+    HistoryIndexHeader header;
+    size_t index_size = index_st.st_size;
+    bool valid = index_size >= sizeof(header) &&
+                 pread(index_fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 header.magic == HISTORY_MAGIC && header.version == HISTORY_VERSION &&
+                 header.log_ino == (uint64_t)log_st.st_ino;
+
+    size_t indexed_end = 0;
+    if (!valid) {
+        // Rebuild the index from scratch by scanning the log
+        header = (HistoryIndexHeader){ HISTORY_MAGIC, HISTORY_VERSION, (uint64_t)log_st.st_ino };
+        if (ftruncate(index_fd, 0) != 0 || !write_all(index_fd, &header, sizeof(header))) {
+            if (log) munmap(log, log_size);
+            return false;
+        }
+    } else {
+        // Drop a torn trailing offset and any offsets past the log's end
+        size_t count = (index_size - sizeof(header)) / sizeof(uint64_t);
+        uint64_t last;
+        while (count > 0 &&
+               (pread(index_fd, &last, sizeof(last), sizeof(header) + (count - 1) * sizeof(last)) != sizeof(last) ||
+                last >= log_size || memchr(log + last, '\0', log_size - last) == NULL)) {
+            count--;
+        }
+        if (count > 0) {
+            indexed_end = (char*)memchr(log + last, '\0', log_size - last) - log + 1;
+        }
+        if (ftruncate(index_fd, sizeof(header) + count * sizeof(uint64_t)) != 0) {
+            if (log) munmap(log, log_size);
+            return false;
+        }
+    }
+
+    // Index entries that reached the log but not the index, then cut off a
+    // partially written final entry
+    size_t complete_end = history_index_entries(index_fd, log, indexed_end, log_size);
+    if (complete_end < log_size && ftruncate(log_fd, complete_end) != 0) {
+        munmap(log, log_size);
+        return false;
+    }
+    if (log) munmap(log, log_size);
+    return true;
+}
+
+static void history_unmap(History* history) {
+    if (history->log_map) munmap(history->log_map, history->log_map_size);
+    if (history->index_map) munmap(history->index_map, history->index_map_size);
+    history->log_map = NULL;
+    history->index_map = NULL;
+    history->offsets = NULL;
+    history->mapped_count = 0;
+    history->mapped_end = 0;
+}
+
+static bool history_map(History* history) {
+    struct stat log_st, index_st;
+    if (fstat(history->log_fd, &log_st) != 0 || fstat(history->index_fd, &index_st) != 0) {
+        return false;
+    }
+    size_t count = (index_st.st_size - sizeof(HistoryIndexHeader)) / sizeof(uint64_t);
+    if (log_st.st_size == 0 || count == 0) return true;
+
+    history->log_map_size = log_st.st_size;
+    history->log_map = mmap(NULL, history->log_map_size, PROT_READ, MAP_SHARED, history->log_fd, 0);
+    history->index_map_size = index_st.st_size;
+    history->index_map = mmap(NULL, history->index_map_size, PROT_READ, MAP_SHARED, history->index_fd, 0);
+    if (history->log_map == MAP_FAILED || history->index_map == MAP_FAILED) {
+        if (history->log_map == MAP_FAILED) history->log_map = NULL;
+        if (history->index_map == MAP_FAILED) history->index_map = NULL;
+        history_unmap(history);
+        return false;
+    }
+    history->offsets = (const uint64_t*)(history->index_map + sizeof(HistoryIndexHeader));
+    history->mapped_count = count;
+    history->mapped_end = log_st.st_size;
+    return true;
+}
+
+void history_open(History* history) {
+    memset(history, 0, sizeof(*history));
+    history->log_fd = -1;
+    history->index_fd = -1;
+
+    char log_path[PATH_MAX], index_path[PATH_MAX];
+    history_path(log_path, sizeof(log_path), "");
+    history_path(index_path, sizeof(index_path), HISTORY_INDEX_SUFFIX);
+    if (log_path[0] == '\0') return;
+
+    history->log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    history->index_fd = open(index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history->log_fd == -1 || history->index_fd == -1) goto fail;
+
+    flock(history->log_fd, LOCK_EX);
+    bool ok = history_recover(history->log_fd, history->index_fd) && history_map(history);
+    size_t limit = history_limit();
+    if (ok && history->mapped_count > limit + limit / 4) {
+        // Over the bound: rewrite the newest entries and map the new files
+        history_compact(history->log_map, history->offsets, history->mapped_count,
+                        history->mapped_end, limit);
+        history_unmap(history);
+        flock(history->log_fd, LOCK_UN);
+        close(history->log_fd);
+        close(history->index_fd);
+        history->log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        history->index_fd = open(index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (history->log_fd == -1 || history->index_fd == -1) goto fail;
+        flock(history->log_fd, LOCK_EX);
+        ok = history_recover(history->log_fd, history->index_fd) && history_map(history);
+    }
+    flock(history->log_fd, LOCK_UN);
+    if (ok) return;
+
+fail:
+    // Fall back to an in-memory history for this session
+    history_unmap(history);
+    if (history->log_fd != -1) close(history->log_fd);
+    if (history->index_fd != -1) close(history->index_fd);
+    history->log_fd = -1;
+    history->index_fd = -1;
+}
+
+void history_close(History* history) {
+    history_unmap(history);
+    if (history->log_fd != -1) close(history->log_fd);
+    if (history->index_fd != -1) close(history->index_fd);
+    for (size_t i = 0; i < history->recent.count; i++) {
+        string_clear(&history->recent.data[i]);
+    }
+    free(history->recent.data);
+    history->recent.data = NULL;
+    history->recent.count = 0;
+    history->recent.capacity = 0;
+}
+
+size_t history_count(const History* history) {
+    return history->mapped_count + history->recent.count;
+}
+
+// Returns entry i (oldest first) as a NUL-terminated string
+const char* history_entry(const History* history, size_t i, size_t* len) {
+    if (i < history->mapped_count) {
+        size_t start = history->offsets[i];
+        size_t end = i + 1 < history->mapped_count ? history->offsets[i + 1] : history->mapped_end;
+        if (len) *len = end - start - 1;
+        return history->log_map + start;
+    }
+    const String* entry = &history->recent.data[i - history->mapped_count];
+    if (len) *len = entry->count;
+    return entry->data;
+}
+
+// Appends a command to the session history and to the on-disk log. The
+// log record is written before its index slot, so a crash in between
+// leaves an entry that the next load re-indexes.
+void history_add(History* history, const char* line, size_t len) {
+    String entry = {
+        .data = malloc(len + 1),
+        .count = len,
+        .capacity = len + 1
+    };
+    if (!entry.data) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(entry.data, line, len);
+    entry.data[len] = '\0';
+
+    Strings* recent = &history->recent;
+    if (recent->count >= recent->capacity) {
+        stat_count(STAT_HISTORY_REALLOC);
+        size_t new_cap = recent->capacity == 0 ? DATA_START_CAPACITY : recent->capacity * 2;
+        String* new_data = realloc(recent->data, new_cap * sizeof(String));
+        if (!new_data) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        recent->data = new_data;
+        recent->capacity = new_cap;
+    }
+    recent->data[recent->count++] = entry;
+
+    if (history->log_fd == -1) return;
+    flock(history->log_fd, LOCK_EX);
+    off_t offset = lseek(history->log_fd, 0, SEEK_END);
+    uint64_t index_entry = offset;
+    if (offset >= 0 && write_all(history->log_fd, entry.data, len + 1)) {
+        write_all(history->index_fd, &index_entry, sizeof(index_entry));
+    }
+    flock(history->log_fd, LOCK_UN);
+}
+
+// Arena allocation
+static ArenaBlock* arena_new_block(size_t capacity, ArenaBlock* next) {
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + capacity);
+    if (!block) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    block->next = next;
+    block->used = 0;
+    block->capacity = capacity;
+    return block;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    ArenaBlock* block = arena->head;
+    if (block == NULL || block->capacity - block->used < size) {
+        size_t capacity = block ? block->capacity * 2 : ARENA_BLOCK_SIZE;
+        while (capacity < size) capacity *= 2;
+        block = arena->head = arena_new_block(capacity, block);
+    }
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+// Releases everything allocated since the last reset. If the command
+// overflowed into several blocks they are merged into one block big
+// enough for all of them, so the next command of that size fits.
+void arena_reset(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    if (block == NULL) return;
+    if (block->next != NULL) {
+        size_t total = 0;
+        while (block != NULL) {
+            ArenaBlock* next = block->next;
+            total += block->capacity;
+            free(block);
+            block = next;
+        }
+        arena->head = arena_new_block(total, NULL);
+        return;
+    }
+    block->used = 0;
+}
+
+void arena_free(Arena* arena) {
+    while (arena->head != NULL) {
+        ArenaBlock* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
 // Shell state initialization
 void init_shell_state(ShellState* state) {
-    string_init(&state->current_cmd);
+    memset(&state->current_cmd, 0, sizeof(state->current_cmd));
     string_init(&state->clipboard);
     state->cursor_pos = 0;
     state->history_pos = -1;
     state->searching = false;
     string_init(&state->search_term);
-    state->history.data = NULL;
-    state->history.count = 0;
-    state->history.capacity = 0;
+    state->pasting = false;
+    string_init(&state->paste);
+    state->current_line = 0;
+    memset(&state->view, 0, sizeof(state->view));
+    state->scrolling = false;
+    state->scroll_typing = false;
+    string_init(&state->scroll_term);
+    state->tab_pending = false;
+    state->fuzzy = false;
+    state->fuzzy_dirty = false;
+    string_init(&state->fuzzy_term);
+    state->fuzzy_selected = 0;
+    memset(&state->fuzzy_index, 0, sizeof(state->fuzzy_index));
+    history_open(&state->history);
+    memset(&state->search_index, 0, sizeof(state->search_index));
 }
 
 char* get_timestamp() {
@@ -120,591 +1391,7198 @@ char* get_timestamp() {
     return buffer;
 }
 
-// Main shell loop
-void shell_interactive_loop(void) {
-    shell_initialize();
-    ShellState state;
-    init_shell_state(&state);
-    
-    int ch;
-    bool running = true;
-    
-    while (running) {
-        redraw_prompt(&state);
-        ch = getch();
-        
-        if (ch == ctrl('d') && state.current_cmd.count == 0) {
-            running = false;
-            continue;
+// Scrollback and command output
+void scrollback_append(const char* data, size_t len) {
+    Scrollback* sb = &scrollback;
+    if (sb->capacity == 0) {
+        sb->data = malloc(SCROLLBACK_SIZE);
+        if (!sb->data) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
-        
-        if (state.searching) {
-            handle_search(ch, &state);
-            continue;
+        sb->capacity = SCROLLBACK_SIZE;
+    }
+    if (len > sb->capacity / 2) {
+        sb->repaint = true;
+        data += len - sb->capacity / 2;
+        len = sb->capacity / 2;
+    }
+    if (sb->len + len > sb->capacity) {
+        // Keep the newest half, starting at a line boundary
+        size_t drop = sb->len + len - sb->capacity / 2;
+        if (drop > sb->len) drop = sb->len;
+        const char* newline = memchr(sb->data + drop, '\n', sb->len - drop);
+        if (newline) drop = newline + 1 - sb->data;
+        memmove(sb->data, sb->data + drop, sb->len - drop);
+        sb->len -= drop;
+        sb->dropped += drop;
+        if (sb->unrendered > sb->len) {
+            sb->unrendered = sb->len;
+            sb->repaint = true;
         }
-        
-        switch (ch) {
-            case ctrl('a'): // Move to beginning
-                state.cursor_pos = 0;
-                break;
-                
-            case ctrl('e'): // Move to end
-                state.cursor_pos = state.current_cmd.count;
-                break;
-                
-            case ctrl('b'): // Move backward
-                if (state.cursor_pos > 0) state.cursor_pos--;
-                break;
-                
-            case ctrl('f'): // Move forward
-                if (state.cursor_pos < state.current_cmd.count) state.cursor_pos++;
-                break;
-                
-            case ctrl('k'): // Cut after cursor
-                if (state.cursor_pos < state.current_cmd.count) {
-                    string_clear(&state.clipboard);
-                    for (size_t i = state.cursor_pos; i < state.current_cmd.count; i++) {
-                        string_append(&state.clipboard, state.current_cmd.data[i]);
-                    }
-                    state.current_cmd.count = state.cursor_pos;
+    }
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+}
+
+// Strips terminal control sequences from program output into out and
+// returns its length. Stops early, with *consumed short of len, right
+// after a request for the alternate screen.
+static size_t output_filter(const char* in, size_t len, char* out, size_t* consumed) {
+    Scrollback* sb = &scrollback;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = in[i];
+        switch (sb->esc_state) {
+            case ESC_NONE:
+                if (c == 0x1b) {
+                    sb->esc_state = ESC_START;
+                } else if (c >= 0x20 ? c != 0x7f : c == '\n' || c == '\r' || c == '\t' || c == '\b') {
+                    out[n++] = c;
                 }
                 break;
-                
-            case ctrl('u'): // Cut before cursor
-                if (state.cursor_pos > 0) {
-                    string_clear(&state.clipboard);
-                    for (size_t i = 0; i < state.cursor_pos; i++) {
-                        string_append(&state.clipboard, state.current_cmd.data[i]);
-                    }
-                    memmove(state.current_cmd.data, 
-                           state.current_cmd.data + state.cursor_pos,
-                           state.current_cmd.count - state.cursor_pos);
-                    state.current_cmd.count -= state.cursor_pos;
-                    state.cursor_pos = 0;
-                }
+            case ESC_START:
+                sb->esc_state = c == '[' ? ESC_CSI : c == ']' ? ESC_OSC :
+                                (c == '(' || c == ')' || c == '#' || c == '%') ? ESC_CHARSET : ESC_NONE;
+                sb->csi_len = 0;
                 break;
-                
-            case ctrl('y'): // Paste
-                if (state.clipboard.count > 0) {
-                    // Make space for paste
-                    if (state.current_cmd.count + state.clipboard.count >= state.current_cmd.capacity) {
-                        size_t new_cap = (state.current_cmd.count + state.clipboard.count) * 2;
-                        char* new_data = realloc(state.current_cmd.data, new_cap);
-                        if (!new_data) {
-                            endwin();
-                            fprintf(stderr, "Memory allocation failed\n");
-                            exit(1);
-                        }
-                        state.current_cmd.data = new_data;
-                        state.current_cmd.capacity = new_cap;
+            case ESC_CSI:
+                if (c >= 0x40 && c <= 0x7e) {
+                    sb->esc_state = ESC_NONE;
+                    sb->csi[sb->csi_len] = '\0';
+                    if (c == 'h' && (strcmp(sb->csi, "?1049") == 0 || strcmp(sb->csi, "?1047") == 0 ||
+                                     strcmp(sb->csi, "?47") == 0)) {
+                        sb->alt_screen = true;
+                        *consumed = i + 1;
+                        return n;
                     }
-                    
-                    // Move existing content
-                    memmove(state.current_cmd.data + state.cursor_pos + state.clipboard.count,
-                           state.current_cmd.data + state.cursor_pos,
-                           state.current_cmd.count - state.cursor_pos);
-                    
-                    // Insert clipboard content
-                    memcpy(state.current_cmd.data + state.cursor_pos,
-                           state.clipboard.data,
-                           state.clipboard.count);
-                    
-                    state.cursor_pos += state.clipboard.count;
-                    state.current_cmd.count += state.clipboard.count;
+                } else if (sb->csi_len < sizeof(sb->csi) - 1) {
+                    sb->csi[sb->csi_len++] = c;
                 }
                 break;
-                
-            case ctrl('l'): // Clear screen
-                clear_screen_keep_prompt(&state);
+            case ESC_OSC:
+                if (c == 0x07) sb->esc_state = ESC_NONE;
+                else if (c == 0x1b) sb->esc_state = ESC_OSC_ESC;
                 break;
-                
-            case ctrl('r'): // Reverse search
-                state.searching = true;
-                string_clear(&state.search_term);
+            case ESC_OSC_ESC:
+            case ESC_CHARSET:
+                sb->esc_state = ESC_NONE;
                 break;
+        }
+    }
+    *consumed = len;
+    return n;
+}
 
-            case KEY_UP:
-                if (state.history.count > 0) {
-                    if (state.history_pos == -1) {
-                        state.history_pos = state.history.count - 1;
-                    } else if (state.history_pos > 0) {
-                        state.history_pos--;
-                    }
-                    string_clear(&state.current_cmd);
-                    for (size_t i = 0; i < state.history.data[state.history_pos].count; i++) {
-                        string_append(&state.current_cmd, state.history.data[state.history_pos].data[i]);
-                    }
-                    state.cursor_pos = state.current_cmd.count;
-                }
-                break;
-                
-            case KEY_DOWN:
-                if (state.history_pos != -1) {
-                    if (state.history_pos < state.history.count - 1) {
-                        state.history_pos++;
-                        string_clear(&state.current_cmd);
-                        for (size_t i = 0; i < state.history.data[state.history_pos].count; i++) {
-                            string_append(&state.current_cmd, state.history.data[state.history_pos].data[i]);
-                        }
-                    } else {
-                        state.history_pos = -1;
-                        string_clear(&state.current_cmd);
-                    }
-                    state.cursor_pos = state.current_cmd.count;
-                }
-                break;
-
-            case ENTER:
-                if (state.current_cmd.count > 0) {
-                    string_append(&state.current_cmd, '\0');
-                    char** args = parse_command(state.current_cmd.data);
-                    if (args != NULL) {
-                        if (strcmp(args[0], "exit") == 0) {
-                            running = false;
-                        } else if (strcmp(args[0], "cd") == 0) {
-                            handle_cd(args);
-                        } else if (strcmp(args[0], "help") == 0) {
-                            execute_help_command();
-                        } else {
-                            printw("\n");  // New line before command output
-                            _command(args);
-                        }
-                        free(args);
-                    }
-                    
-                    // Add to history
-                    String hist_cmd = {
-                        .data = strdup(state.current_cmd.data),
-                        .count = state.current_cmd.count,
-                        .capacity = state.current_cmd.count
-                    };
-                    if (state.history.count >= state.history.capacity) {
-                        size_t new_cap = state.history.capacity == 0 ? 
-                            DATA_START_CAPACITY : state.history.capacity * 2;
-                        String* new_data = realloc(state.history.data, 
-                                                 new_cap * sizeof(String));
-                        if (!new_data) {
-                            endwin();
-                            fprintf(stderr, "Memory allocation failed\n");
-                            exit(1);
-                        }
-                        state.history.data = new_data;
-                        state.history.capacity = new_cap;
-                    }
-                    state.history.data[state.history.count++] = hist_cmd;
-                    
-                    string_clear(&state.current_cmd);
-                    state.cursor_pos = 0;
-                    state.history_pos = -1;
-                    state.current_line += 1;  // Move down one lines after command
-                    if (state.current_line >= LINES - 1) {
-                        scroll(stdscr);
-                        state.current_line = LINES - 2;
-                    }
-                }
-                break;
-                
-            case KEY_BACKSPACE:
-            case 127:
-                if (state.cursor_pos > 0) {
-                    memmove(state.current_cmd.data + state.cursor_pos - 1,
-                           state.current_cmd.data + state.cursor_pos,
-                           state.current_cmd.count - state.cursor_pos);
-                    state.current_cmd.count--;
-                    state.cursor_pos--;
-                    redraw_prompt(&state);
-                }
-                break;
-                
-            default:
-                if (isprint(ch)) {
-                    if (state.current_cmd.count >= state.current_cmd.capacity) {
-                        size_t new_cap = state.current_cmd.capacity == 0 ? 
-                            DATA_START_CAPACITY : state.current_cmd.capacity * 2;
-                        char* new_data = realloc(state.current_cmd.data, new_cap);
-                        if (!new_data) {
-                            endwin();
-                            fprintf(stderr, "Memory allocation failed\n");
-                            exit(1);
-                        }
-                        state.current_cmd.data = new_data;
-                        state.current_cmd.capacity = new_cap;
-                    }
-                    memmove(state.current_cmd.data + state.cursor_pos + 1,
-                           state.current_cmd.data + state.cursor_pos,
-                           state.current_cmd.count - state.cursor_pos);
-                    state.current_cmd.data[state.cursor_pos] = ch;
-                    state.current_cmd.count++;
-                    state.cursor_pos++;
-                }
-                break;
+// Queues output for the screen. Full-screen programs bypass the
+// scrollback: once one asks for the alternate screen, its output goes to
+// the terminal untouched until the command ends.
+void output_feed(const char* data, size_t len) {
+    static char filtered[OUTPUT_READ_SIZE];
+    Scrollback* sb = &scrollback;
+    while (len > 0 && !sb->alt_screen) {
+        size_t chunk = len < sizeof(filtered) ? len : sizeof(filtered);
+        size_t consumed;
+        size_t n = output_filter(data, chunk, filtered, &consumed);
+        scrollback_append(filtered, n);
+        sb->unrendered += n;
+        for (const char* p = filtered; (p = memchr(p, '\n', filtered + n - p)) != NULL; p++) {
+            sb->unrendered_lines++;
+        }
+        if (sb->unrendered_lines >= (size_t)LINES) sb->repaint = true;
+        data += consumed;
+        len -= consumed;
+        if (sb->alt_screen) {
+            output_render();
+            char seq[sizeof(sb->csi) + 4];
+            int seq_len = snprintf(seq, sizeof(seq), "\033[%sh", sb->csi);
+            write_all(STDOUT_FILENO, seq, seq_len);
         }
     }
-    
-    // Cleanup
-    string_clear(&state.current_cmd);
-    string_clear(&state.clipboard);
-    string_clear(&state.search_term);
-    for (size_t i = 0; i < state.history.count; i++) {
-        string_clear(&state.history.data[i]);
-    }
-    free(state.history.data);
-    
-    shell_terminate();
+    if (len > 0) write_all(STDOUT_FILENO, data, len);
 }
 
-void execute_help_command(void) {
-    printw("\n\nAvailable Commands:\n");
-    printw("------------------\n");
-    printw("cd [directory]     : Change current directory\n");
-    printw("help              : Display this help message\n");
-    printw("exit              : Exit the shell\n");
-    printw("ls [directory]    : List directory contents\n");
-    printw("[cmd] < [input]   : Redirect input from file\n");
-    printw("[cmd] > [output]  : Redirect output to file\n");
-    printw("\nKeyboard Shortcuts:\n");
-    printw("-----------------\n");
-    printw("CTRL+A : Move to beginning of line\n");
-    printw("CTRL+E : Move to end of line\n");
-    printw("CTRL+K : Cut text after cursor\n");
-    printw("CTRL+U : Cut text before cursor\n");
-    printw("CTRL+Y : Paste cut text\n");
-    printw("CTRL+R : Search command history\n");
-    printw("UP     : Previous command\n");
-    printw("DOWN   : Next command\n");
-    printw("\n");
-    refresh();
+// Draws output text at the cursor: carriage returns and backspaces move
+// within the line, so progress bars redraw in place
+static void render_text(const char* text, size_t len) {
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+        if (c != '\r' && c != '\b') continue;
+        if (i > start) addnstr(text + start, i - start);
+        int y, x;
+        getyx(stdscr, y, x);
+        move(y, c == '\r' ? 0 : (x > 0 ? x - 1 : 0));
+        start = i + 1;
+    }
+    if (len > start) addnstr(text + start, len - start);
 }
 
-void handle_io_redirection(char** args, int* in_fd, int* out_fd) {
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0 && args[i + 1] != NULL) {
-            *in_fd = open(args[i + 1], O_RDONLY);
-            if (*in_fd == -1) {
-                printw("\nError opening input file: %s\n", strerror(errno));
-                refresh();
-            }
-            args[i] = NULL;  // Remove redirection from arguments
-        }
-        else if (strcmp(args[i], ">") == 0 && args[i + 1] != NULL) {
-            *out_fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (*out_fd == -1) {
-                printw("\nError opening output file: %s\n", strerror(errno));
-                refresh();
-            }
-            args[i] = NULL;  // Remove redirection from arguments
-        }
+// Start of the text that fills rows screen rows and ends at end
+static size_t scrollback_rows_before(size_t end, int rows) {
+    const char* data = scrollback.data;
+    size_t pos = end;
+    while (pos > 0 && rows > 0) {
+        size_t line_end = pos;
+        if (data[line_end - 1] == '\n') line_end--;
+        size_t line_start = line_end;
+        while (line_start > 0 && data[line_start - 1] != '\n') line_start--;
+        // Only the text after the last carriage return stays visible
+        const char* cr = line_start < line_end ? memrchr(data + line_start, '\r', line_end - line_start) : NULL;
+        size_t width = cr ? (size_t)(data + line_end - cr - 1) : line_end - line_start;
+        rows -= width == 0 ? 1 : (int)((width + COLS - 1) / COLS);
+        if (rows < 0) break;
+        pos = line_start;
     }
+    return pos;
 }
 
-void redraw_prompt(ShellState* state) {
-    move(state->current_line, 0);
-    clrtoeol();
-    char* cwd = get_formatted_cwd();
-    int prompt_len = strlen(SHELL);
-    int cwd_len = strlen(cwd);
-    
-    // Print prompt and current directory with fixed spacing
-    printw("%s%s  ", SHELL, cwd);  // Two spaces after cwd
-    
-    // Print user input
-    if (state->current_cmd.count > 0) {
-        printw("%.*s", (int)state->current_cmd.count, state->current_cmd.data);
+// Draws what arrived since the last frame. When more than a screenful
+// arrived, only the newest screenful is drawn.
+void output_render(void) {
+    Scrollback* sb = &scrollback;
+    if (sb->repaint) {
+        erase();
+        move(0, 0);
+        size_t start = scrollback_rows_before(sb->len, LINES - 1);
+        render_text(sb->data + start, sb->len - start);
+    } else if (sb->unrendered > 0) {
+        render_text(sb->data + sb->len - sb->unrendered, sb->unrendered);
     }
-    
-    // Calculate cursor position including the fixed spaces
-    int base_pos = prompt_len + cwd_len + 2;  // +2 for the two spaces after cwd
-    move(state->current_line, base_pos + state->cursor_pos);
+    sb->repaint = false;
+    sb->unrendered = 0;
+    sb->unrendered_lines = 0;
+    sb->last_frame_ns = monotonic_ns();
     refresh();
 }
 
+// Redraws the whole screen from the scrollback and puts the prompt below
+// it, after a full-screen program or the scrollback viewer
+void output_repaint(ShellState* state) {
+    clearok(curscr, TRUE);
+    scrollback.repaint = true;
+    output_render();
+    if (getcurx(stdscr) != 0) addch('\n');
+    state->current_line = getcury(stdscr);
+    state->view.valid = false;
+}
 
-void clear_screen_keep_prompt(ShellState* state) {
-    clear();
+// Milliseconds until the next frame is due, or -1 when nothing is queued
+static int output_frame_timeout(void) {
+    if (scrollback.unrendered == 0 && !scrollback.repaint) return -1;
+    long long wait_ns = scrollback.last_frame_ns + OUTPUT_FRAME_NS - monotonic_ns();
+    return wait_ns > 0 ? (int)(wait_ns / 1000000) + 1 : 0;
+}
+
+// Scrollback viewer
+static void scrollback_view_draw(ShellState* state) {
+    Scrollback* sb = &scrollback;
+    size_t end = state->scroll_pos > sb->dropped ? state->scroll_pos - sb->dropped : 0;
+    if (end > sb->len) end = sb->len;
+    size_t start = scrollback_rows_before(end, LINES - 1);
+
+    erase();
     move(0, 0);
-    redraw_prompt(state);
+    scrollok(stdscr, FALSE);
+    render_text(sb->data + start, end - start);
+    scrollok(stdscr, TRUE);
+    move(LINES - 1, 0);
+    clrtoeol();
+    attron(A_REVERSE);
+    if (state->scroll_typing) {
+        printw("/%.*s", (int)state->scroll_term.count, state->scroll_term.data);
+    } else {
+        printw("-- scrollback %zu%% -- PgUp/PgDn/arrows scroll, / search, n next, q quit --",
+               sb->len > 0 ? end * 100 / sb->len : 100);
+    }
+    attroff(A_REVERSE);
+    refresh();
 }
 
-char* get_formatted_cwd(void) {
-    static char formatted[PATH_MAX];
-    char cwd[PATH_MAX];
-    char* home = getenv("HOME");
-    
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
-        return "[ERROR]";
+// Moves the view up (negative) or down by whole lines
+static void scrollback_scroll(ShellState* state, int lines) {
+    Scrollback* sb = &scrollback;
+    size_t end = state->scroll_pos > sb->dropped ? state->scroll_pos - sb->dropped : 0;
+    if (end > sb->len) end = sb->len;
+    for (; lines < 0 && end > 0; lines++) {
+        end--;
+        while (end > 0 && sb->data[end - 1] != '\n') end--;
     }
-    
-    if (home && strncmp(cwd, home, strlen(home)) == 0) {
-        snprintf(formatted, sizeof(formatted), "~%s", cwd + strlen(home));
-    } else {
-        strncpy(formatted, cwd, sizeof(formatted) - 1);
+    for (; lines > 0 && end < sb->len; lines--) {
+        const char* newline = memchr(sb->data + end, '\n', sb->len - end);
+        end = newline ? (size_t)(newline - sb->data) + 1 : sb->len;
     }
-    
-    return formatted;
+    state->scroll_pos = sb->dropped + end;
 }
 
-int _command(char** args) {
-    pid_t parent_pid = getpid();
-    pid_t pid = fork();
-    int in_fd = STDIN_FILENO;
-    int out_fd = STDOUT_FILENO;
-    
-    handle_io_redirection(args, &in_fd, &out_fd);
-    
-    if (pid == 0) {
-        // Child process
-        pid_t child_pid = getpid();
-        printw("\n[%s] Child process created - Parent PID: %d, Child PID: %d, Command: %s\n", 
-               get_timestamp(), parent_pid, child_pid, args[0]);
-
-        refresh();
-        
-        // Add sleep to give time to check process tree
-        sleep(700);  // Sleep for 700 seconds before executing command
-       
-        if (in_fd != STDIN_FILENO) {
-            dup2(in_fd, STDIN_FILENO);
-            close(in_fd);
-        }
-        if (out_fd != STDOUT_FILENO) {
-            dup2(out_fd, STDOUT_FILENO);
-            close(out_fd);
-        }
-        
-        if (execvp(args[0], args) == -1) {
-            printw("\nCommand execution failed: %s\n", strerror(errno));
-            refresh();
-            exit(EXIT_FAILURE);
+// Puts the newest line that contains the search term and lies above the
+// bottom of the view at the bottom
+static bool scrollback_search(ShellState* state) {
+    Scrollback* sb = &scrollback;
+    size_t term_len = state->scroll_term.count;
+    size_t end = state->scroll_pos > sb->dropped ? state->scroll_pos - sb->dropped : 0;
+    if (term_len == 0 || end > sb->len) return false;
+    // Skip the line now at the bottom so "n" moves on to older matches
+    if (end > 0) end--;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && sb->data[start - 1] != '\n') start--;
+        if (memmem(sb->data + start, end - start, state->scroll_term.data, term_len)) {
+            state->scroll_pos = sb->dropped + end + 1;
+            return true;
         }
-    } else if (pid < 0) {
-        printw("\nFork failed: %s\n", strerror(errno));
-        refresh();
-        return 0;
-    } else {
-        // Parent process
-        printw("\n[%s] Parent process waiting - PID: %d, Child PID: %d\n", 
-               get_timestamp(), parent_pid, pid);
-        refresh();
-
-        if (in_fd != STDIN_FILENO) close(in_fd);
-        if (out_fd != STDOUT_FILENO) close(out_fd);
-        
-        int status;
-        do {
-            waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
-        printw("\n[%s] Child process completed - PID: %d\n", get_timestamp(), pid);
-        refresh();
-   
+        end = start > 0 ? start - 1 : 0;
     }
-    
-    return 1;
+    return false;
 }
 
-int handle_cd(char** args) {
-    char* dir = args[1];
-    if (dir == NULL) {
-        dir = getenv("HOME");
+// Keys while viewing the scrollback. Anything unbound returns to the prompt.
+void handle_scrollback_key(int ch, ShellState* state) {
+    if (state->scroll_typing) {
+        if (ch == ENTER || ch == KEY_ENTER) {
+            state->scroll_typing = false;
+            if (!scrollback_search(state)) beep();
+        } else if (ch == 27 || ch == ctrl('g')) {
+            state->scroll_typing = false;
+        } else if (ch == KEY_BACKSPACE || ch == 127) {
+            if (state->scroll_term.count > 0) state->scroll_term.count--;
+        } else if (ch < 256 && isprint(ch)) {
+            string_append(&state->scroll_term, ch);
+        }
+        scrollback_view_draw(state);
+        return;
     }
-    
-    if (chdir(dir) != 0) {
-        printw("\ncd: %s: %s\n", dir, strerror(errno));
-        refresh();
-        return 1;
+
+    switch (ch) {
+        case KEY_PPAGE:
+            scrollback_scroll(state, -(LINES - 2));
+            break;
+        case KEY_NPAGE:
+        case ' ':
+            scrollback_scroll(state, LINES - 2);
+            break;
+        case KEY_UP:
+        case 'k':
+            scrollback_scroll(state, -1);
+            break;
+        case KEY_DOWN:
+        case 'j':
+            scrollback_scroll(state, 1);
+            break;
+        case '/':
+            state->scroll_typing = true;
+            state->scroll_term.count = 0;
+            break;
+        case 'n':
+            if (!scrollback_search(state)) beep();
+            break;
+        case KEY_RESIZE:
+            break;
+        default:
+            state->scrolling = false;
+            output_repaint(state);
+            return;
     }
-    
-    return 1;
+    scrollback_view_draw(state);
 }
 
-void shell_initialize(void) {
-    setlocale(LC_ALL, "");
-    initscr();
-    cbreak();
-    noecho();
-    keypad(stdscr, TRUE);
-    scrollok(stdscr, TRUE);
+// scrollback [-c | pattern]: shows how much output is kept, clears it or
+// prints the kept lines that contain pattern
+int handle_scrollback(char** args) {
+    Scrollback* sb = &scrollback;
+    if (args[1] == NULL) {
+        size_t lines = 0;
+        for (const char* p = sb->data; p && (p = memchr(p, '\n', sb->data + sb->len - p)) != NULL; p++) {
+            lines++;
+        }
+        shell_print("\nscrollback: %zu lines, %zu of %zu bytes, %zu bytes dropped\n",
+                    lines, sb->len, (size_t)SCROLLBACK_SIZE, sb->dropped);
+        shell_flush();
+        return 0;
+    }
+    if (strcmp(args[1], "-c") == 0) {
+        sb->dropped += sb->len;
+        sb->len = 0;
+        sb->unrendered = 0;
+        return 0;
+    }
 
-    // Add initial PID information
-    pid_t shell_pid = getpid();
-    printw("Custom Shell started - PID: %d\n", shell_pid);
-    refresh();
+    // Collect first: printing appends to the buffer being searched
+    String matches;
+    string_init(&matches);
+    size_t term_len = strlen(args[1]);
+    for (size_t start = 0; start < sb->len;) {
+        const char* newline = memchr(sb->data + start, '\n', sb->len - start);
+        size_t end = newline ? (size_t)(newline - sb->data) : sb->len;
+        if (memmem(sb->data + start, end - start, args[1], term_len)) {
+            string_reserve(&matches, matches.count + end - start + 1);
+            memcpy(matches.data + matches.count, sb->data + start, end - start);
+            matches.count += end - start;
+            matches.data[matches.count++] = '\n';
+        }
+        start = end + 1;
+    }
+    bool found = matches.count > 0;
+    if (found) {
+        shell_print("\n");
+        output_feed(matches.data, matches.count);
+        shell_flush();
+    }
+    string_clear(&matches);
+    return found ? 0 : 1;
 }
 
-void shell_terminate(void) {
-    endwin();
+// Inserts the pasted text collected so far at the cursor in one go
+static void flush_paste(ShellState* state) {
+    if (state->paste.count == 0) return;
+    gap_insert(&state->current_cmd, state->cursor_pos, state->paste.data, state->paste.count);
+    state->cursor_pos += state->paste.count;
+    state->paste.count = 0;
 }
 
-char** parse_command(char* line) {
-    int bufsize = MAX_ARGS;
-    char** tokens = malloc(bufsize * sizeof(char*));
-    int position = 0;
-    char* token_start = line;
-    bool in_quotes = false;
-    char quote_char = '\0';
-
-    if (!tokens) {
-        printw("\nAllocation error\n");
-        refresh();
-        return NULL;
+// Starts an empty edit line below the previous one, or below whatever the
+// shell itself has printed since
+static void start_new_prompt(ShellState* state) {
+    if (getcurx(stdscr) != 0) addch('\n');  // Output ended mid-line
+    gap_set(&state->current_cmd, "", 0);
+    state->cursor_pos = 0;
+    state->history_pos = -1;
+    state->view.valid = false;  // Command output may have covered the line
+    int line = getcury(stdscr);
+    state->current_line = line > state->current_line ? line : state->current_line + 1;
+    if (state->current_line >= LINES - 1) {
+        scroll(stdscr);
+        state->current_line = LINES - 2;
     }
+}
 
-    while (*token_start != '\0') {
-        // Skip leading whitespace
-        while (isspace(*token_start)) token_start++;
-        if (*token_start == '\0') break;
-
-        // Handle quoted strings
-        if (*token_start == '"' || *token_start == '\'') {
-            quote_char = *token_start;
-            token_start++;
-            char* quote_end = strchr(token_start, quote_char);
-            if (quote_end) {
-                *quote_end = '\0';
-                tokens[position++] = strdup(token_start);
-                token_start = quote_end + 1;
-                continue;
-            }
-        }
+// Applies one key to the edit line. Runs the line on ENTER.
+void handle_key(int ch, ShellState* state) {
+    size_t length = gap_length(&state->current_cmd);
 
-        // Handle unquoted tokens
-        char* token_end = token_start;
-        while (*token_end && !isspace(*token_end)) token_end++;
-        
-        if (*token_end != '\0') {
-            *token_end = '\0';
-            tokens[position++] = strdup(token_start);
-            token_start = token_end + 1;
-        } else {
-            tokens[position++] = strdup(token_start);
-            break;
+    if (state->pasting) {
+        // Pasted text is inserted literally; a newline in it must not
+        // run the partial line
+        if (ch == KEY_PASTE_END) {
+            state->pasting = false;
+            flush_paste(state);
+        } else if (ch == '\r' || ch == '\n') {
+            string_append(&state->paste, '\n');
+        } else if (ch == '\t' || (ch < 256 && isprint(ch))) {
+            string_append(&state->paste, ch);
         }
+        return;
+    }
 
-        if (position >= bufsize) {
-            bufsize += MAX_ARGS;
-            char** new_tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!new_tokens) {
-                for (int i = 0; i < position; i++) {
-                    free(tokens[i]);
-                }
-                free(tokens);
-                printw("\nAllocation error\n");
-                refresh();
-                return NULL;
-            }
-            tokens = new_tokens;
-        }
+    if (ch == ctrl('d') && length == 0) {
+        shell_running = false;
+        return;
     }
 
-    tokens[position] = NULL;
-    return tokens;
-}
+    bool tab_again = state->tab_pending;
+    state->tab_pending = false;
+    
+    if (state->searching) {
+        handle_search(ch, state);
+        return;
+    }
 
-void handle_search(int ch, ShellState* state) {
-    static int matched_pos = -1;
+    if (state->fuzzy) {
+        handle_fuzzy(ch, state);
+        return;
+    }
+
+    if (state->scrolling) {
+        handle_scrollback_key(ch, state);
+        return;
+    }
     
     switch (ch) {
-        case ctrl('r'):  // Another ctrl-r press
-            // If we have a current match, look for the next one
-            if (matched_pos >= 0) {
-                int found = 0;
-                for (int i = matched_pos - 1; i >= 0; i--) {
-                    if (strstr(state->history.data[i].data, state->search_term.data) != NULL) {
-                        matched_pos = i;
-                        string_clear(&state->current_cmd);
-                        for (size_t j = 0; j < state->history.data[i].count; j++) {
-                            string_append(&state->current_cmd, state->history.data[i].data[j]);
-                        }
-                        state->cursor_pos = state->current_cmd.count;
-                        found = 1;
-                        break;
-                    }
-                }
-                if (!found) {
-                    flash();  // Visual feedback that no more matches were found
-                }
+        case ctrl('a'): // Move to beginning
+            state->cursor_pos = 0;
+            break;
+            
+        case ctrl('e'): // Move to end
+            state->cursor_pos = length;
+            break;
+            
+        case ctrl('b'): // Move backward
+            if (state->cursor_pos > 0) state->cursor_pos--;
+            break;
+            
+        case ctrl('f'): // Move forward
+            if (state->cursor_pos < length) state->cursor_pos++;
+            break;
+            
+        case ctrl('k'): // Cut after cursor
+            if (state->cursor_pos < length) {
+                gap_copy(&state->current_cmd, state->cursor_pos, length - state->cursor_pos, &state->clipboard);
+                gap_delete(&state->current_cmd, state->cursor_pos, length - state->cursor_pos);
             }
             break;
             
-        case ctrl('c'):  // Cancel search
-        case 27:         // ESC key
-            state->searching = false;
-            string_clear(&state->search_term);
-            matched_pos = -1;
+        case ctrl('u'): // Cut before cursor
+            if (state->cursor_pos > 0) {
+                gap_copy(&state->current_cmd, 0, state->cursor_pos, &state->clipboard);
+                gap_delete(&state->current_cmd, 0, state->cursor_pos);
+                state->cursor_pos = 0;
+            }
             break;
             
-        case ENTER:      // Accept the current selection
-            state->searching = false;
+        case ctrl('y'): // Paste
+            if (state->clipboard.count > 0) {
+                gap_insert(&state->current_cmd, state->cursor_pos, state->clipboard.data, state->clipboard.count);
+                state->cursor_pos += state->clipboard.count;
+            }
+            break;
+            
+        case KEY_PASTE_BEGIN:
+            state->pasting = true;
+            break;
+
+        case KEY_RESIZE:
+            state->view.valid = false;
+            break;
+
+        case ctrl('l'): // Clear screen
+            clear_screen_keep_prompt(state);
+            break;
+            
+        case KEY_PPAGE: // Scroll back through output
+            if (scrollback.len == 0) {
+                beep();
+                break;
+            }
+            state->scrolling = true;
+            state->scroll_typing = false;
+            state->scroll_pos = scrollback.dropped + scrollback.len;
+            scrollback_scroll(state, -(LINES - 2));
+            scrollback_view_draw(state);
+            break;
+
+        case '\t': // Complete the word before the cursor
+            handle_completion(state, tab_again);
+            break;
+
+        case ctrl('r'): // Reverse search
+            state->searching = true;
             string_clear(&state->search_term);
-            matched_pos = -1;
+            break;
+
+        case ctrl('t'): // Fuzzy history finder
+            fuzzy_open(state, "", 0);
+            break;
+
+        case KEY_UP:
+            if (history_count(&state->history) > 0) {
+                if (state->history_pos == -1) {
+                    state->history_pos = history_count(&state->history) - 1;
+                } else if (state->history_pos > 0) {
+                    state->history_pos--;
+                }
+                size_t len;
+                const char* entry = history_entry(&state->history, state->history_pos, &len);
+                gap_set(&state->current_cmd, entry, len);
+                state->cursor_pos = len;
+            }
+            break;
+            
+        case KEY_DOWN:
+            if (state->history_pos != -1) {
+                if ((size_t)state->history_pos + 1 < history_count(&state->history)) {
+                    state->history_pos++;
+                    size_t len;
+                    const char* entry = history_entry(&state->history, state->history_pos, &len);
+                    gap_set(&state->current_cmd, entry, len);
+                } else {
+                    state->history_pos = -1;
+                    gap_set(&state->current_cmd, "", 0);
+                }
+                state->cursor_pos = gap_length(&state->current_cmd);
+            }
+            break;
+
+        case ENTER:
+            // An unfinished here-document keeps the line open for its body
+            if (length > 0 && heredoc_pending(gap_text(&state->current_cmd))) {
+                gap_insert(&state->current_cmd, length, "\n", 1);
+                state->cursor_pos = length + 1;
+                break;
+            }
+            if (length > 0) {
+                char* line = gap_text(&state->current_cmd);
+
+                // Add to history before parsing splits the buffer in place
+                history_add(&state->history, line, length);
+                if (state->search_index.buckets != NULL) {
+                    search_index_update(&state->search_index, &state->history);
+                }
+
+                // The screen already shows the command; the scrollback
+                // needs its own copy
+                char* cwd = get_formatted_cwd();
+                scrollback_append(SHELL, strlen(SHELL));
+                scrollback_append(cwd, strlen(cwd));
+                scrollback_append("  ", 2);
+                scrollback_append(line, length);
+                scrollback_append("\n", 1);
+
+                printw("\n");  // New line before command output
+                set_bracketed_paste(false);
+                last_status = run_lines(line);
+                set_bracketed_paste(true);
+                
+                start_new_prompt(state);
+            }
             break;
             
         case KEY_BACKSPACE:
         case 127:
-            if (state->search_term.count > 0) {
-                state->search_term.count--;
-                state->search_term.data[state->search_term.count] = '\0';
-                
-                // Reset match position
-                matched_pos = -1;
-                
-                // Try to find a match with the updated search term
-                if (state->search_term.count > 0) {
-                    for (int i = state->history.count - 1; i >= 0; i--) {
-                        if (strstr(state->history.data[i].data, state->search_term.data) != NULL) {
-                            matched_pos = i;
-                            string_clear(&state->current_cmd);
-                            for (size_t j = 0; j < state->history.data[i].count; j++) {
-                                string_append(&state->current_cmd, state->history.data[i].data[j]);
-                            }
-                            state->cursor_pos = state->current_cmd.count;
-                            break;
-                        }
-                    }
-                }
+            if (state->cursor_pos > 0) {
+                gap_delete(&state->current_cmd, state->cursor_pos - 1, 1);
+                state->cursor_pos--;
             }
             break;
             
         default:
             if (isprint(ch)) {
-                string_append(&state->search_term, ch);
-                state->search_term.data[state->search_term.count] = '\0';
-                
-                // Look for a match
-                matched_pos = -1;
-                for (int i = state->history.count - 1; i >= 0; i--) {
-                    if (strstr(state->history.data[i].data, state->search_term.data) != NULL) {
-                        matched_pos = i;
-                        string_clear(&state->current_cmd);
-                        for (size_t j = 0; j < state->history.data[i].count; j++) {
-                            string_append(&state->current_cmd, state->history.data[i].data[j]);
-                        }
-                        state->cursor_pos = state->current_cmd.count;
-                        break;
-                    }
-                }
-                
-                if (matched_pos == -1) {
-                    flash();  // Visual feedback that no match was found
-                }
+                char c = ch;
+                gap_insert(&state->current_cmd, state->cursor_pos, &c, 1);
+                state->cursor_pos++;
             }
             break;
     }
-    
-    // Update display
-    move(getcury(stdscr), 0);
-    clrtoeol();
-    if (state->searching) {
-        printw("(reverse-i-search)`%s': %s", 
-               state->search_term.data ? state->search_term.data : "", 
-               state->current_cmd.data ? state->current_cmd.data : "");
-    } else {
-        redraw_prompt(state);
+}
+
+// Sleeps until a key arrives, a child changes state, a background job
+// writes output or timeout_ms passes. Children are reaped here, between
+// keystrokes, so finished background jobs never linger as zombies while
+// the user is typing.
+static void wait_for_input(int timeout_ms) {
+    size_t max_fds = jobs.count + 2;
+    struct pollfd* fds = malloc(max_fds * sizeof(struct pollfd));
+    Job** owners = malloc(max_fds * sizeof(Job*));
+    if (!fds || !owners) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
-    refresh();
+    int nfds = 0;
+    fds[nfds++] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+    fds[nfds++] = (struct pollfd){.fd = sigchld_pipe[0], .events = POLLIN};
+    for (size_t i = 0; i < jobs.count; i++) {
+        if (jobs.items[i]->pty_fd == -1) continue;
+        owners[nfds] = jobs.items[i];
+        fds[nfds++] = (struct pollfd){.fd = jobs.items[i]->pty_fd, .events = POLLIN};
+    }
+
+    int ready = poll(fds, nfds, jobs_watchdog_timeout(timeout_ms));
+    jobs_watchdog();
+    stats_poll();
+    if (ready > 0) {  // -1 is a signal: SIGWINCH, SIGINT or SIGUSR1
+        for (int i = 2; i < nfds; i++) {
+            if (fds[i].revents) job_read_output(owners[i]);
+        }
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {}
+            jobs_reap();
+        }
+    }
+    free(fds);
+    free(owners);
 }
 
-int main(void) {
-    shell_interactive_loop();
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+// Main shell loop
+void shell_interactive_loop(void) {
+    shell_initialize();
+    ShellState state;
+    init_shell_state(&state);
+    command_index_request(0);  // Index $PATH in the background for Tab
+    
+    int ch;
+    // When the first key of the burst being handled was read, and how
+    // many lines had run by then
+    long long key_ns = 0;
+    uint64_t key_lines = 0;
+    
+    while (shell_running) {
+        bool output_due = output_frame_timeout() == 0;
+        if (!state.scrolling && !state.fuzzy && (output_due || jobs_changed())) {
+            // Show background output and job notices above the line
+            // being edited
+            move(state.current_line, 0);
+            clrtoeol();
+            output_render();
+            if (getcurx(stdscr) != 0) addch('\n');
+            jobs_notify();
+            state.current_line = getcury(stdscr);
+            state.view.valid = false;
+        }
+
+        // Reverse search, the fuzzy finder and the scrollback viewer own
+        // the screen while they are active
+        if (state.fuzzy) {
+            fuzzy_refresh(&state);
+        } else if (!state.searching && !state.scrolling) {
+            redraw_prompt(&state);
+        }
+        if (key_ns != 0) {
+            // A key that ran a command waited for the command, not for us
+            if (stat_counters[STAT_LINES] == key_lines) {
+                stat_record(STAT_KEY_TO_PAINT, monotonic_ns() - key_ns);
+            }
+            key_ns = 0;
+        }
+        wait_for_input(state.scrolling || state.fuzzy ? -1 : output_frame_timeout());
+
+        if (interrupted) {
+            // ^C abandons the line being edited
+            interrupted = 0;
+            state.searching = false;
+            state.pasting = false;
+            if (state.fuzzy) fuzzy_close(&state);
+            if (state.scrolling) {
+                state.scrolling = false;
+                output_repaint(&state);
+            }
+            state.paste.count = 0;
+            start_new_prompt(&state);
+            continue;
+        }
+
+        // Apply everything the terminal has already delivered (typeahead,
+        // a paste) before painting again, so a burst costs one repaint
+        while (shell_running && (ch = getch()) != ERR) {
+            if (key_ns == 0) {
+                key_ns = monotonic_ns();
+                key_lines = stat_counters[STAT_LINES];
+            }
+            stat_count(STAT_KEYS);
+            handle_key(ch, &state);
+        }
+        flush_paste(&state);
+    }
+    
+    // Cleanup
+    gap_free(&state.current_cmd);
+    string_clear(&state.clipboard);
+    string_clear(&state.paste);
+    string_clear(&state.search_term);
+    string_clear(&state.view.text);
+    string_clear(&state.scroll_term);
+    search_index_free(&state.search_index);
+    string_clear(&state.fuzzy_term);
+    fuzzy_index_free(&state.fuzzy_index);
+    history_close(&state.history);
+    
+    shell_terminate();
+}
+
+void execute_help_command(void) {
+    shell_print("\n\nAvailable Commands:\n");
+    shell_print("------------------\n");
+    shell_print("cd [directory]     : Change current directory\n");
+    shell_print("help              : Display this help message\n");
+    shell_print("exit              : Exit the shell\n");
+    shell_print("export [name[=value]] : Pass variables to commands, or list them\n");
+    shell_print("unset [name]      : Remove a variable\n");
+    shell_print("hash [-r] [name]  : Show, reset or prime the command path cache\n");
+    shell_print("time [cmd]        : Run a command and report its resource usage\n");
+    shell_print("timeout [-k grace] duration [cmd] : Stop a command that runs too long\n");
+    shell_print("ulimit [-SHa] [-ntv [limit]] : Limit open files, CPU time and memory of commands\n");
+    shell_print("timing [on|off]   : Report resource usage after every command\n");
+    shell_print("shellstat [-jr] [-w [file]] : Show or save the shell's own counters and latencies\n");
+    shell_print("jobs              : List background jobs\n");
+    shell_print("fg [%%job]         : Continue a job in the foreground\n");
+    shell_print("bg [%%job]         : Continue a stopped job in the background\n");
+    shell_print("wait [%%job|pid]   : Wait for background jobs to finish\n");
+    shell_print("parallel [-j N] cmd [{}] [::: args] : Run cmd for each argument, N at a time\n");
+    shell_print("scrollback [-c|pattern] : Show, clear or search kept output\n");
+    shell_print("echo [-neE] [args] : Print arguments\n");
+    shell_print("pwd               : Print the current directory\n");
+    shell_print("cat [file...]     : Copy files to the output\n");
+    shell_print("ls [-1aA] [dir]   : List directory contents\n");
+    shell_print("true, false       : Return success or failure\n");
+    shell_print("test expr, [ expr ] : Evaluate a condition\n");
+    shell_print("[cmd] < [input]   : Redirect input from file\n");
+    shell_print("[cmd] > [output]  : Redirect output to file\n");
+    shell_print("[cmd] >> [output] : Append output to file\n");
+    shell_print("[cmd] 2> [file]   : Redirect errors (n> and n< for any fd 0-9)\n");
+    shell_print("[cmd] &> [file]   : Redirect output and errors\n");
+    shell_print("[cmd] 2>&1        : Send errors where output goes (n>&m, n>&-)\n");
+    shell_print("[cmd] <<< [text]  : Feed text as input\n");
+    shell_print("[cmd] << [word]   : Feed the lines up to word as input\n");
+    shell_print("[cmd] | [cmd]     : Pipe output into the next command\n");
+    shell_print("[cmd] &           : Run a command in the background\n");
+    shell_print("[cmd] ; [cmd]     : Run one command after the other\n");
+    shell_print("[cmd] && [cmd]    : Run the second if the first succeeds (|| if it fails)\n");
+    shell_print("( [cmd] ; [cmd] ) : Run a list in a subshell\n");
+    shell_print("$( [cmd] )        : Use the output of a command as arguments\n");
+    shell_print("<( [cmd] ), >( [cmd] ) : Use a command's output or input as a file\n");
+    shell_print("name=value        : Set a variable, or pass it to the command that follows\n");
+    shell_print("$name, ${name}    : Use a variable's value ($? last status, $$ shell pid)\n");
+    shell_print("*, ?, [abc]       : Match file names\n");
+    shell_print("\nKeyboard Shortcuts:\n");
+    shell_print("-----------------\n");
+    shell_print("CTRL+A : Move to beginning of line\n");
+    shell_print("CTRL+E : Move to end of line\n");
+    shell_print("CTRL+K : Cut text after cursor\n");
+    shell_print("CTRL+U : Cut text before cursor\n");
+    shell_print("CTRL+Y : Paste cut text\n");
+    shell_print("CTRL+R : Search command history (TAB: fuzzy)\n");
+    shell_print("CTRL+T : Fuzzy-find in command history\n");
+    shell_print("TAB    : Complete a command, path or history word\n");
+    shell_print("PGUP   : Scroll back through output (/ searches)\n");
+    shell_print("UP     : Previous command\n");
+    shell_print("DOWN   : Next command\n");
+    shell_print("\n");
+    shell_flush();
+}
+
+// Returns the RedirectKind of a token from parse_command(), or -1 if it
+// is not a redirection operator
+static int redirect_kind(const char* token) {
+    for (int kind = 0; kind < REDIR_KINDS; kind++) {
+        if (token == redirect_tokens[kind]) return kind;
+    }
+    return -1;
+}
+
+// Returns n for the io-number token of fd n, or -1
+static int fd_token_number(const char* token) {
+    for (int n = 0; n < REDIRECT_FDS; n++) {
+        if (token == fd_tokens[n]) return n;
+    }
+    return -1;
+}
+
+// The tokens that end a command: "|", lists, conditionals and groups
+static bool is_control_token(const char* token) {
+    return token == pipe_token || token == amp_token || token == semi_token || token == and_token ||
+           token == or_token || token == lparen_token || token == rparen_token;
+}
+
+static bool is_operator_token(const char* token) {
+    return is_control_token(token) || redirect_kind(token) >= 0 || fd_token_number(token) >= 0;
+}
+
+// Returns the index of the ")" closing the group that args starts with
+static int group_close(char** args) {
+    int depth = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (args[i] == lparen_token) depth++;
+        if (args[i] == rparen_token && --depth == 0) return i;
+    }
+    return -1;
+}
+
+// Starts io with the child's stdin, stdout and stderr taken from the given
+// fds and every other low fd left as it is
+void redirections_init(Redirections* io, int in_fd, int out_fd, int err_fd) {
+    for (int n = 0; n < REDIRECT_FDS; n++) io->fds[n] = n;
+    io->fds[STDIN_FILENO] = in_fd;
+    io->fds[STDOUT_FILENO] = out_fd;
+    io->fds[STDERR_FILENO] = err_fd;
+    io->assigned = 0;
+    io->opened_count = 0;
+    io->passed_count = 0;
+}
+
+// Records fd as opened for the command; closes it and fails when io is full
+bool redirections_own(Redirections* io, int fd) {
+    if (io->opened_count == REDIRECT_MAX_OPEN) {
+        close(fd);
+        errno = EMFILE;
+        return false;
+    }
+    io->opened[io->opened_count++] = fd;
+    return true;
+}
+
+// Closes the shell's copies of the fds opened for the command
+void redirections_close(Redirections* io) {
+    for (int i = 0; i < io->opened_count; i++) close(io->opened[i]);
+    io->opened_count = 0;
+}
+
+// Records the process substitution pipe that word names, if any, so the
+// command inherits it under the same number
+static void redirections_pass(Redirections* io, const char* word) {
+    const char* path = strstr(word, "/dev/fd/");
+    if (path == NULL) return;
+    int fd = atoi(path + strlen("/dev/fd/"));
+    for (int i = 0; i < substitution_count && io->passed_count < SUBST_MAX; i++) {
+        if (substitutions[i].fd == fd) {
+            io->passed[io->passed_count++] = fd;
+            return;
+        }
+    }
+}
+
+// Returns a readable fd holding the text of a here-document or
+// here-string. A memfd is a file in memory, so even a body larger than a
+// pipe buffer needs no temporary file and no writer running alongside the
+// command; a pipe is used where memfd_create is missing and the body fits.
+static int heredoc_fd(const char* text, size_t len) {
+    int fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd != -1) {
+        if (!write_all(fd, text, len) || lseek(fd, 0, SEEK_SET) == -1) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    int pipe_fds[2];
+    if (len > PIPE_BUF || pipe2(pipe_fds, O_CLOEXEC) == -1) return -1;
+    if (!write_all(pipe_fds[1], text, len)) {
+        close(pipe_fds[0]);
+        pipe_fds[0] = -1;
+    }
+    close(pipe_fds[1]);
+    return pipe_fds[0];
+}
+
+// Applies one redirection of the given kind to fd (-1: the operator's
+// default fd). Returns -1 after reporting an error.
+static int redirect_apply(Redirections* io, int kind, int fd, const char* target) {
+    bool input = kind == REDIR_IN || kind == REDIR_DUP_IN || kind == REDIR_HERE_STRING ||
+                 kind == REDIR_HEREDOC || kind == REDIR_HEREDOC_TABS;
+    if (fd == -1) fd = input ? STDIN_FILENO : STDOUT_FILENO;
+
+    // n>&m and n<&m copy whatever fd m is at this point; >&file is &>file
+    if (kind == REDIR_DUP_IN || kind == REDIR_DUP_OUT) {
+        if (strcmp(target, "-") == 0) {
+            io->fds[fd] = -1;
+            return 0;
+        }
+        bool numeric = target[0] != '\0' && strspn(target, "0123456789") == strlen(target);
+        if (!numeric && kind == REDIR_DUP_OUT && fd == STDOUT_FILENO) {
+            kind = REDIR_BOTH;
+        } else if (!numeric) {
+            shell_error("\n%s: ambiguous redirect\n", target);
+            return -1;
+        } else {
+            // Only 0-2 of the shell's own fds belong to commands, and in a
+            // group the ones it was given; the rest are the shell's files
+            // and pipes, unless this command's redirections set them
+            long source = strtol(target, NULL, 10);
+            int source_fd = source < REDIRECT_FDS ? io->fds[source] : -1;
+            bool owned = source <= STDERR_FILENO || (io->assigned & (1u << source)) ||
+                         (command_fds & (1u << source));
+            if (source_fd == -1 || (source_fd == source && !owned)) {
+                shell_error("\n%s: Bad file descriptor\n", target);
+                return -1;
+            }
+            io->fds[fd] = source_fd;
+            io->assigned |= 1u << fd;
+            return 0;
+        }
+    }
+
+    int opened;
+    switch (kind) {
+    case REDIR_IN:
+        opened = open(target, O_RDONLY | O_CLOEXEC);
+        break;
+    case REDIR_OUT:
+    case REDIR_BOTH:
+        opened = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        break;
+    case REDIR_APPEND:
+    case REDIR_BOTH_APPEND:
+        opened = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        break;
+    case REDIR_HERE_STRING: {
+        size_t len = strlen(target);
+        char* text = arena_alloc(&command_arena, len + 1);
+        memcpy(text, target, len);
+        text[len] = '\n';
+        opened = heredoc_fd(text, len + 1);
+        break;
+    }
+    default:  // The delimiter was replaced by the body when the line was read
+        if (target[0] == HEREDOC_EXPAND) target = heredoc_expand(target + 1);
+        opened = heredoc_fd(target, strlen(target));
+        break;
+    }
+    if (opened == -1) {
+        shell_error("\nError opening %s: %s\n", target, strerror(errno));
+        return -1;
+    }
+    if (!redirections_own(io, opened)) {
+        shell_error("\nToo many redirections\n");
+        return -1;
+    }
+    io->fds[fd] = opened;
+    io->assigned |= 1u << fd;
+    if (kind == REDIR_BOTH || kind == REDIR_BOTH_APPEND) {
+        io->fds[STDERR_FILENO] = opened;
+        io->assigned |= 1u << STDERR_FILENO;
+    }
+    return 0;
+}
+
+// Applies the redirections in args from left to right, so 2>&1 >file
+// leaves stderr where stdout was before, and removes them from args.
+// Every file is opened once, here in the parent with O_CLOEXEC; the child
+// only receives dup2 actions and inherits nothing else. Returns -1 after
+// reporting an error; fds opened so far stay in io for the caller to close.
+// A group's own redirections belong to the commands inside it, so only
+// those after its ")" are applied.
+int handle_io_redirection(char** args, Redirections* io) {
+    int dst = args[0] == lparen_token ? group_close(args) + 1 : 0;
+    for (int i = dst; args[i] != NULL; i++) {
+        int fd = fd_token_number(args[i]);
+        int kind = redirect_kind(fd >= 0 ? args[i + 1] : args[i]);
+        if (kind < 0) {
+            if (substitution_count > 0) redirections_pass(io, args[i]);
+            args[dst++] = args[i];
+            continue;
+        }
+        if (fd >= 0) i++;
+        const char* target = args[i + 1];
+        if (target == NULL || is_operator_token(target)) {
+            shell_error("\nSyntax error: missing file after `%s'\n", args[i]);
+            args[dst] = NULL;
+            return -1;
+        }
+        i++;  // Skip the target
+        if (redirect_apply(io, kind, fd, target) == -1) {
+            args[dst] = NULL;
+            return -1;
+        }
+    }
+    args[dst] = NULL;
+
+    // The child's fds are set up in ascending order, so a source that is
+    // itself a low fd being replaced is moved out of the way first. A file
+    // opened straight onto its target fd is moved too: it would be left
+    // alone and closed on exec.
+    for (int n = 0; n < REDIRECT_FDS; n++) {
+        int source = io->fds[n];
+        if (source < 0 || source >= REDIRECT_FDS) continue;
+        bool in_place = false;
+        for (int i = 0; i < io->opened_count && source == n && !in_place; i++) in_place = io->opened[i] == n;
+        if (!in_place && (source == n || io->fds[source] == source)) continue;
+        int moved = fcntl(source, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+        if (moved == -1 || !redirections_own(io, moved)) {
+            shell_error("\nRedirection failed: %s\n", strerror(errno));
+            return -1;
+        }
+        io->fds[n] = moved;
+    }
+    return 0;
+}
+
+// Draws edit-line text one cell per byte; pasted newlines and tabs show
+// as blanks so the cursor arithmetic stays one column per byte
+static void draw_text(const char* text, size_t len) {
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\n' || text[i] == '\t') {
+            if (i > start) addnstr(text + start, i - start);
+            addch(' ');
+            start = i + 1;
+        }
+    }
+    if (len > start) addnstr(text + start, len - start);
+}
+
+// Brings the prompt line up to date with the least screen work: the
+// prompt itself is only reprinted when the line or directory changed, and
+// of the command text only the cells from the first difference onwards
+// are rewritten. Nothing is sent when neither text nor cursor moved, and
+// false is returned.
+static bool prompt_update(ShellState* state) {
+    PromptView* view = &state->view;
+    const GapBuffer* gb = &state->current_cmd;
+    size_t len = gap_length(gb);
+    // The line is the text before the gap followed by the text after it
+    const char* before = gb->data;
+    size_t before_len = gb->gap_start;
+    const char* after = gb->data + gb->gap_end;
+    size_t after_len = len - before_len;
+    char* cwd = get_formatted_cwd();
+    size_t common = 0;
+
+    if (!view->valid || view->line != state->current_line || view->cwd_generation != cwd_generation) {
+        move(state->current_line, 0);
+        clrtoeol();
+        // Print prompt and current directory with fixed spacing
+        printw("%s%s  ", SHELL, cwd);  // Two spaces after cwd
+        view->prompt_len = strlen(SHELL) + strlen(cwd) + 2;
+        view->line = state->current_line;
+        view->cwd_generation = cwd_generation;
+        view->valid = true;
+        view->text.count = 0;
+    } else {
+        // Length of the prefix the screen already shows
+        size_t old_len = view->text.count;
+        while (common < before_len && common < old_len && before[common] == view->text.data[common]) {
+            common++;
+        }
+        if (common == before_len) {
+            while (common < len && common < old_len &&
+                   after[common - before_len] == view->text.data[common]) {
+                common++;
+            }
+        }
+        if (common == len && common == old_len) {
+            if (view->cursor == state->cursor_pos) return false;
+            move(view->line, view->prompt_len + (int)state->cursor_pos);
+            view->cursor = state->cursor_pos;
+            refresh();
+            return true;
+        }
+        move(view->line, view->prompt_len + (int)common);
+    }
+
+    // Write everything from the first changed cell
+    if (common < before_len) draw_text(before + common, before_len - common);
+    size_t after_from = common > before_len ? common - before_len : 0;
+    if (after_from < after_len) draw_text(after + after_from, after_len - after_from);
+    if (view->text.count > len) clrtoeol();
+
+    gap_copy(gb, 0, len, &view->text);
+    view->cursor = state->cursor_pos;
+    move(view->line, view->prompt_len + (int)state->cursor_pos);
+    refresh();
+    return true;
+}
+
+void redraw_prompt(ShellState* state) {
+    long long start = monotonic_ns();
+    stat_count(STAT_REDRAW_PROMPT);
+    if (!prompt_update(state)) stat_count(STAT_REDRAW_IDLE);
+    stat_record(STAT_REDRAW_TIME, monotonic_ns() - start);
+}
+
+
+void clear_screen_keep_prompt(ShellState* state) {
+    clear();
+    move(0, 0);
+    state->current_line = 0;
+    state->view.valid = false;
+    redraw_prompt(state);
+}
+
+// The formatted directory is cached until handle_cd() or a change to HOME
+// invalidates it, so the prompt costs no getcwd() or getenv() per keystroke
+char* get_formatted_cwd(void) {
+    static char formatted[PATH_MAX];
+    char cwd[PATH_MAX];
+    if (cwd_cache_valid) return formatted;
+
+    char* home = getenv("HOME");
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return "[ERROR]";
+    }
+    
+    if (home && strncmp(cwd, home, strlen(home)) == 0) {
+        snprintf(formatted, sizeof(formatted), "~%s", cwd + strlen(home));
+    } else {
+        snprintf(formatted, sizeof(formatted), "%s", cwd);
+    }
+    
+    cwd_cache_valid = true;
+    cwd_generation++;
+    return formatted;
+}
+
+void invalidate_cwd_cache(void) {
+    cwd_cache_valid = false;
+}
+
+// Splits args in place at each "|" token outside a group. Returns the
+// number of stages and stores the start of each stage's argv in stages,
+// or -1 on a syntax error.
+int split_pipeline(char** args, char*** stages, int max_stages) {
+    int count = 0;
+    int depth = 0;
+    stages[count++] = args;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (args[i] == lparen_token) depth++;
+        if (args[i] == rparen_token) depth--;
+        if (args[i] == pipe_token && depth == 0) {
+            args[i] = NULL;
+            if (stages[count - 1][0] == NULL || args[i + 1] == NULL || count >= max_stages) {
+                return -1;
+            }
+            stages[count++] = &args[i + 1];
+        }
+    }
+    return stages[0][0] == NULL ? -1 : count;
+}
+
+
+static size_t hash_string(const char* str) {
+    size_t h = 14695981039346656037ULL;  // FNV-1a
+    while (*str) {
+        h = (h ^ (unsigned char)*str++) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t hash_bytes(const char* data, size_t len) {
+    size_t h = 14695981039346656037ULL;  // FNV-1a
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Returns the slot holding name, or the empty slot where it belongs
+static HashEntry* hash_slot(const char* name) {
+    size_t mask = command_hash.capacity - 1;
+    size_t i = hash_string(name) & mask;
+    while (command_hash.entries[i].name != NULL &&
+           strcmp(command_hash.entries[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &command_hash.entries[i];
+}
+
+static void hash_insert(char* name, char* path, unsigned int hits) {
+    if ((command_hash.count + 1) * 2 > command_hash.capacity) {
+        HashEntry* old = command_hash.entries;
+        size_t old_cap = command_hash.capacity;
+        command_hash.capacity = old_cap == 0 ? HASH_START_CAPACITY : old_cap * 2;
+        command_hash.entries = calloc(command_hash.capacity, sizeof(HashEntry));
+        if (!command_hash.entries) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        command_hash.count = 0;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].name) hash_insert(old[i].name, old[i].path, old[i].hits);
+        }
+        free(old);
+    }
+    HashEntry* slot = hash_slot(name);
+    slot->name = name;
+    slot->path = path;
+    slot->hits = hits;
+    command_hash.count++;
+}
+
+void hash_reset(void) {
+    for (size_t i = 0; i < command_hash.capacity; i++) {
+        free(command_hash.entries[i].name);
+        free(command_hash.entries[i].path);
+    }
+    free(command_hash.entries);
+    free(command_hash.path_env);
+    command_hash.entries = NULL;
+    command_hash.count = 0;
+    command_hash.capacity = 0;
+    command_hash.path_env = NULL;
+}
+
+void hash_remove(const char* name) {
+    if (command_hash.count == 0) return;
+    HashEntry* slot = hash_slot(name);
+    if (slot->name == NULL) return;
+
+    free(slot->name);
+    free(slot->path);
+    slot->name = NULL;
+    command_hash.count--;
+
+    // Re-seat the rest of the probe run so later lookups still find it
+    size_t mask = command_hash.capacity - 1;
+    size_t i = ((size_t)(slot - command_hash.entries) + 1) & mask;
+    while (command_hash.entries[i].name != NULL) {
+        HashEntry moved = command_hash.entries[i];
+        command_hash.entries[i].name = NULL;
+        command_hash.count--;
+        hash_insert(moved.name, moved.path, moved.hits);
+        i = (i + 1) & mask;
+    }
+}
+
+// Scans $PATH for an executable regular file called name
+static char* path_search(const char* name, const char* path_env) {
+    char candidate[PATH_MAX];
+    const char* dir = path_env;
+    while (dir != NULL) {
+        const char* end = strchr(dir, ':');
+        int dir_len = end ? (int)(end - dir) : (int)strlen(dir);
+        // An empty PATH entry means the current directory
+        int n = dir_len == 0 ? snprintf(candidate, sizeof(candidate), "./%s", name)
+                             : snprintf(candidate, sizeof(candidate), "%.*s/%s", dir_len, dir, name);
+        struct stat st;
+        if (n > 0 && (size_t)n < sizeof(candidate) && stat(candidate, &st) == 0 &&
+            S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return strdup(candidate);
+        }
+        dir = end ? end + 1 : NULL;
+    }
+    return NULL;
+}
+
+// Resolves a command name to an executable path, consulting the cache
+// first. Names containing a slash are used as-is. Returns NULL when the
+// command is not found on $PATH.
+const char* hash_lookup(const char* name) {
+    if (strchr(name, '/') != NULL) return name;
+
+    const char* path_env = getenv("PATH");
+    if (path_env == NULL) path_env = "/usr/local/bin:/usr/bin:/bin";
+    if (command_hash.path_env == NULL || strcmp(command_hash.path_env, path_env) != 0) {
+        hash_reset();
+        command_hash.path_env = strdup(path_env);
+    }
+
+    if (command_hash.count > 0) {
+        HashEntry* slot = hash_slot(name);
+        if (slot->name != NULL) {
+            slot->hits++;
+            return slot->path;
+        }
+    }
+
+    char* path = path_search(name, path_env);
+    if (path == NULL) return NULL;
+    hash_insert(strdup(name), path, 1);
+    return path;
+}
+
+int handle_hash(char** args) {
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        hash_reset();
+        return 0;
+    }
+    if (args[1] != NULL && strcmp(args[1], "-d") == 0) {
+        for (int i = 2; args[i] != NULL; i++) hash_remove(args[i]);
+        return 0;
+    }
+    if (args[1] != NULL) {
+        // Resolve and remember the named commands without running them
+        int status = 0;
+        for (int i = 1; args[i] != NULL; i++) {
+            hash_remove(args[i]);
+            if (hash_lookup(args[i]) == NULL) {
+                shell_error("\nhash: %s: not found\n", args[i]);
+                status = 1;
+            } else if (strchr(args[i], '/') == NULL) {
+                hash_slot(args[i])->hits = 0;
+            }
+        }
+        return status;
+    }
+
+    if (command_hash.count == 0) {
+        shell_print("\nhash: hash table empty\n");
+    } else {
+        shell_print("\nhits\tcommand\n");
+        for (size_t i = 0; i < command_hash.capacity; i++) {
+            HashEntry* e = &command_hash.entries[i];
+            if (e->name) shell_print("%4u\t%s\n", e->hits, e->path);
+        }
+    }
+    shell_flush();
+    return 0;
+}
+
+// Shell variables
+
+static pid_t shell_pid = 0;
+
+// Returns the slot holding the variable name[0, len), or the empty slot
+// where it belongs
+static Variable* variable_slot(const char* name, size_t len) {
+    size_t mask = variables.capacity - 1;
+    size_t i = hash_bytes(name, len) & mask;
+    while (variables.slots[i].entry != NULL &&
+           (variables.slots[i].name_len != len || memcmp(variables.slots[i].entry, name, len) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &variables.slots[i];
+}
+
+static void variables_grow(void) {
+    Variable* old = variables.slots;
+    size_t old_cap = variables.capacity;
+    variables.capacity = old_cap == 0 ? VARIABLE_START_CAPACITY : old_cap * 2;
+    variables.slots = calloc(variables.capacity, sizeof(Variable));
+    if (!variables.slots) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].entry) *variable_slot(old[i].entry, old[i].name_len) = old[i];
+    }
+    free(old);
+}
+
+// Rebuilds envp from the exported variables and points environ at it
+static void variables_publish(void) {
+    size_t needed = 1;
+    for (size_t i = 0; i < variables.capacity; i++) {
+        if (variables.slots[i].entry && variables.slots[i].exported) needed++;
+    }
+    if (needed > variables.envp_capacity) {
+        char** grown = realloc(variables.envp, needed * 2 * sizeof(char*));
+        if (!grown) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        variables.envp = grown;
+        variables.envp_capacity = needed * 2;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < variables.capacity; i++) {
+        if (variables.slots[i].entry && variables.slots[i].exported) variables.envp[n++] = variables.slots[i].entry;
+    }
+    variables.envp[n] = NULL;
+    environ = variables.envp;
+}
+
+// Loads the environment the shell started with as exported variables.
+// Does nothing once the table exists.
+void variables_init(void) {
+    if (variables.capacity != 0) return;
+    shell_pid = getpid();
+    variables_grow();
+    for (char** env = environ; *env != NULL; env++) {
+        const char* eq = strchr(*env, '=');
+        if (eq == NULL || eq == *env) continue;
+        if ((variables.count + 1) * 2 > variables.capacity) variables_grow();
+        // The first of duplicate entries wins, as it does for getenv()
+        Variable* slot = variable_slot(*env, eq - *env);
+        if (slot->entry != NULL) continue;
+        slot->entry = strdup(*env);
+        if (!slot->entry) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        slot->name_len = eq - *env;
+        slot->exported = true;
+        variables.count++;
+    }
+    variables_publish();
+}
+
+// Returns the length of the variable name text starts with, or 0
+static size_t variable_name_length(const char* text) {
+    if (!isalpha((unsigned char)text[0]) && text[0] != '_') return 0;
+    size_t len = 1;
+    while (isalnum((unsigned char)text[len]) || text[len] == '_') len++;
+    return len;
+}
+
+// Whether word has the form name=value
+static bool is_assignment(const char* word) {
+    size_t len = variable_name_length(word);
+    return len > 0 && word[len] == '=';
+}
+
+const char* variable_get(const char* name) {
+    if (variables.capacity == 0) return getenv(name);
+    size_t len = strlen(name);
+    Variable* slot = variable_slot(name, len);
+    return slot->entry != NULL ? slot->entry + len + 1 : NULL;
+}
+
+// Sets the variable name[0, name_len) to value, exporting it if exported
+// is set; a variable already exported stays exported
+void variable_set(const char* name, size_t name_len, const char* value, bool exported) {
+    variables_init();
+    if ((variables.count + 1) * 2 > variables.capacity) variables_grow();
+    size_t value_len = strlen(value);
+    char* entry = malloc(name_len + value_len + 2);
+    if (!entry) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+
+    Variable* slot = variable_slot(name, name_len);
+    char* old = slot->entry;
+    if (old == NULL) {
+        slot->name_len = name_len;
+        slot->exported = false;
+        variables.count++;
+    }
+    slot->entry = entry;
+    slot->exported |= exported;
+    // environ must never point at a freed entry
+    if (slot->exported) variables_publish();
+    free(old);
+    // The prompt shows the directory relative to HOME
+    if (name_len == 4 && memcmp(name, "HOME", 4) == 0) invalidate_cwd_cache();
+}
+
+void variable_unset(const char* name) {
+    if (variables.count == 0) return;
+    size_t len = strlen(name);
+    Variable* slot = variable_slot(name, len);
+    if (slot->entry == NULL) return;
+    char* entry = slot->entry;
+    bool exported = slot->exported;
+    slot->entry = NULL;
+    variables.count--;
+
+    // Re-seat the rest of the probe run so later lookups still find it
+    size_t mask = variables.capacity - 1;
+    size_t i = ((size_t)(slot - variables.slots) + 1) & mask;
+    while (variables.slots[i].entry != NULL) {
+        Variable moved = variables.slots[i];
+        variables.slots[i].entry = NULL;
+        *variable_slot(moved.entry, moved.name_len) = moved;
+        i = (i + 1) & mask;
+    }
+    if (exported) variables_publish();
+    free(entry);
+    if (strcmp(name, "HOME") == 0) invalidate_cwd_cache();
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const char* x = *(char* const*)a;
+    const char* y = *(char* const*)b;
+    size_t x_len = strcspn(x, "="), y_len = strcspn(y, "=");
+    int order = strncmp(x, y, x_len < y_len ? x_len : y_len);
+    return order != 0 ? order : (x_len > y_len) - (x_len < y_len);
+}
+
+// export [name[=value]...]: exports variables, setting the ones given a
+// value. Without names, lists the exported variables.
+int handle_export(char** args) {
+    variables_init();
+    int first = args[1] != NULL && strcmp(args[1], "-p") == 0 ? 2 : 1;
+    if (args[first] == NULL) {
+        char** envp = variables.envp;
+        size_t count = 0;
+        while (envp[count] != NULL) count++;
+        char** sorted = malloc((count + 1) * sizeof(char*));
+        if (!sorted) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        memcpy(sorted, envp, count * sizeof(char*));
+        qsort(sorted, count, sizeof(char*), compare_entries);
+        for (size_t i = 0; i < count; i++) {
+            size_t len = strcspn(sorted[i], "=");
+            shell_print(i == 0 ? "\ndeclare -x %.*s=\"%s\"\n" : "declare -x %.*s=\"%s\"\n",
+                        (int)len, sorted[i], sorted[i] + len + 1);
+        }
+        free(sorted);
+        shell_flush();
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = first; args[i] != NULL; i++) {
+        size_t len = variable_name_length(args[i]);
+        if (len == 0 || (args[i][len] != '\0' && args[i][len] != '=')) {
+            shell_error("\nexport: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+        } else if (args[i][len] == '=') {
+            variable_set(args[i], len, args[i] + len + 1, true);
+        } else if (variable_get(args[i]) != NULL) {
+            variable_set(args[i], len, variable_get(args[i]), true);
+        }
+    }
+    return status;
+}
+
+int handle_unset(char** args) {
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t len = variable_name_length(args[i]);
+        if (len == 0 || args[i][len] != '\0') {
+            shell_error("\nunset: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        variable_unset(args[i]);
+    }
+    return status;
+}
+
+// In a forked child: joins the process group, restores the default
+// action of every signal the shell catches or ignores, wires fds 0-9 and
+// keeps the substitution pipes passed to it
+static void child_prepare(const Redirections* io, pid_t pgid) {
+    static const int reset[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE, SIGTERM, SIGWINCH};
+    if (pgid >= 0) setpgid(0, pgid);
+    for (size_t i = 0; i < sizeof(reset) / sizeof(reset[0]); i++) signal(reset[i], SIG_DFL);
+    for (int n = 0; n < REDIRECT_FDS; n++) {
+        if (io->fds[n] == n) continue;
+        if (io->fds[n] >= 0) {
+            dup2(io->fds[n], n);
+        } else if (n <= STDERR_FILENO) {
+            close(n);
+        }
+    }
+    for (int i = 0; i < io->passed_count; i++) fcntl(io->passed[i], F_SETFD, 0);
+}
+
+// In a forked child about to exec: applies the limits ulimit set
+static void limits_apply(void) {
+    for (size_t i = 0; i < LIMIT_COUNT; i++) {
+        if (command_limits_set & (1u << i)) setrlimit(limit_specs[i].resource, &command_limits[i]);
+    }
+}
+
+// spawn_process() through fork(), with the limits ulimit set applied
+// before exec
+static pid_t fork_process(const char* path, char** argv, const Redirections* io, pid_t pgid) {
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) == -1) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Out of the way of the fds the command gets
+        int report_fd = fcntl(report[1], F_DUPFD_CLOEXEC, REDIRECT_FDS);
+        child_prepare(io, pgid);
+        limits_apply();
+        execv(path, argv);
+        int err = errno;
+        ssize_t ignored = write(report_fd, &err, sizeof(err));
+        (void)ignored;
+        _exit(127);
+    }
+    int err = errno;
+    close(report[1]);
+    if (pid == -1) {
+        close(report[0]);
+        errno = err;
+        return -1;
+    }
+    // Set the group from both sides so neither can act before it exists
+    if (pgid >= 0) setpgid(pid, pgid ? pgid : pid);
+
+    // The pipe closes at exec; an errno arrives only if exec failed
+    ssize_t n;
+    while ((n = read(report[0], &err, sizeof(err))) == -1 && errno == EINTR) {}
+    close(report[0]);
+    if (n == sizeof(err)) {
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {}
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Launches the executable at path with its fds 0-9 wired as in fds (see
+// Redirections) and returns the child's pid, or -1 with errno set.
+// posix_spawn is implemented by glibc with clone(CLONE_VM|CLONE_VFORK), so
+// the shell's page tables are never copied and launch cost does not grow
+// with the history buffer. It cannot set resource limits, so fork() is
+// used under ulimit and where posix_spawn is unavailable; the child then
+// reports a failed exec through a close-on-exec pipe.
+// A pgid of 0 starts a new process group, a positive pgid joins that group
+// and -1 stays in the shell's group. Children always start with the
+// job-control signals the shell ignores or catches set back to default.
+pid_t spawn_process(const char* path, char** argv, const Redirections* io, pid_t pgid) {
+#ifdef _POSIX_SPAWN
+    if (command_limits_set != 0) return fork_process(path, argv, io, pgid);
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    pid_t pid;
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    posix_spawn_file_actions_init(&actions);
+    // dup2 clears O_CLOEXEC on the target, so only the fds set up here
+    // and the standard ones survive exec. A passed pipe is dup2'd onto
+    // itself, which only clears the flag.
+    for (int n = 0; n < REDIRECT_FDS; n++) {
+        if (io->fds[n] == n) continue;
+        if (io->fds[n] >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, io->fds[n], n);
+        } else if (n <= STDERR_FILENO) {
+            posix_spawn_file_actions_addclose(&actions, n);
+        }
+    }
+    for (int i = 0; i < io->passed_count; i++) {
+        posix_spawn_file_actions_adddup2(&actions, io->passed[i], io->passed[i]);
+    }
+
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+#else
+    return fork_process(path, argv, io, pgid);
+#endif
+}
+
+// Closes what exec would have: every inherited fd with FD_CLOEXEC set,
+// such as the pipe ends meant for other stages and the ptys of other
+// jobs. A forked shell that kept them would hold pipes open, so a reader
+// would never see EOF and a writer would never get SIGPIPE.
+static void close_exec_fds(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int fd = atoi(entry->d_name);
+        if (fd <= STDERR_FILENO || fd == dirfd(dir)) continue;
+        int flags = fcntl(fd, F_GETFD);
+        if (flags != -1 && (flags & FD_CLOEXEC)) close(fd);
+    }
+    closedir(dir);
+}
+
+// Makes a forked child a shell of its own, for a group or a substitution:
+// it keeps no fd exec would have closed and has no terminal, no jobs and
+// no here-document input
+static void subshell_enter(void) {
+    close_exec_fds();
+    interactive_mode = false;
+    jobs.count = 0;
+    heredoc_reader = NULL;
+    error_fd = STDERR_FILENO;
+    command_fds = 0;
+    substitution_count = 0;
+    command_timeout.duration_ns = 0;
+}
+
+// Runs the "(" list ")" stage at argv in a forked copy of the shell. The
+// child already holds the compiled line and its here-document bodies, so
+// it runs the group's nodes directly, without a terminal of its own or
+// the parent's jobs, and exits with the list's status.
+static pid_t launch_group(char** argv, const Redirections* io, pid_t pgid) {
+    int group = group_find(argv);
+    if (group < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        child_prepare(io, pgid);
+        subshell_enter();
+        for (int n = STDERR_FILENO + 1; n < REDIRECT_FDS; n++) {
+            if (io->fds[n] >= 0 && io->fds[n] != n) command_fds |= 1u << n;
+        }
+        int status = plan_execute(active_plan, active_tokens, active_plan->nodes[group].left);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    }
+    // Set the group from both sides so neither can act before it exists
+    if (pid > 0 && pgid >= 0) setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+// Resolves argv[0] through the command hash and spawns it. A cached path
+// that has since disappeared is dropped and $PATH is searched again.
+static pid_t launch_stage(char** argv, const Redirections* io, pid_t pgid) {
+    if (argv[0] == lparen_token) return launch_group(argv, io, pgid);
+    const char* path = hash_lookup(argv[0]);
+    if (path == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    pid_t pid = spawn_process(path, argv, io, pgid);
+    if (pid == -1 && errno == ENOENT && path != argv[0]) {
+        hash_remove(argv[0]);
+        if ((path = hash_lookup(argv[0])) == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+        pid = spawn_process(path, argv, io, pgid);
+    }
+    return pid;
+}
+
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void accumulate_rusage(CommandStats* stats, const struct rusage* ru) {
+    timeradd(&stats->utime, &ru->ru_utime, &stats->utime);
+    timeradd(&stats->stime, &ru->ru_stime, &stats->stime);
+    if (ru->ru_maxrss > stats->maxrss_kb) stats->maxrss_kb = ru->ru_maxrss;
+    stats->voluntary_ctxsw += ru->ru_nvcsw;
+    stats->involuntary_ctxsw += ru->ru_nivcsw;
+}
+
+// Reports on stderr, as time(1) does, so it stays out of the output
+void print_command_stats(const CommandStats* stats) {
+    shell_flush();
+    shell_error("\nreal %.6fs  user %ld.%06lds  sys %ld.%06lds  spawn %.6fs\n",
+           stats->wall_ns / 1e9,
+           (long)stats->utime.tv_sec, (long)stats->utime.tv_usec,
+           (long)stats->stime.tv_sec, (long)stats->stime.tv_usec,
+           stats->spawn_ns / 1e9);
+    shell_error("maxrss %ld KB  ctxsw %ld voluntary / %ld involuntary  stages %d\n",
+           stats->maxrss_kb, stats->voluntary_ctxsw, stats->involuntary_ctxsw, stats->stages);
+}
+
+// Maps a wait status to the shell's exit status convention
+static int exit_status_of(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+static Job* job_create(char** args) {
+    Job* job = calloc(1, sizeof(Job));
+    if (!job) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    if (jobs.count >= jobs.capacity) {
+        size_t capacity = jobs.capacity == 0 ? 8 : jobs.capacity * 2;
+        Job** items = realloc(jobs.items, capacity * sizeof(Job*));
+        if (!items) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        jobs.items = items;
+        jobs.capacity = capacity;
+    }
+    // As in bash, a new job is numbered one past the highest job in use
+    job->id = jobs.count > 0 ? jobs.items[jobs.count - 1]->id + 1 : 1;
+    job->last_pid = -1;
+    job->pty_fd = -1;
+    job->exit_status = 127;
+    job->state = JOB_RUNNING;
+    job->start_ns = monotonic_ns();
+
+    // Launching rewrites argv, so keep the text for job listings
+    String text;
+    string_init(&text);
+    for (int i = 0; args[i] != NULL; i++) {
+        size_t len = strlen(args[i]);
+        string_reserve(&text, text.count + len + 2);
+        if (i > 0) text.data[text.count++] = ' ';
+        memcpy(text.data + text.count, args[i], len);
+        text.count += len;
+    }
+    string_reserve(&text, text.count + 1);
+    text.data[text.count] = '\0';
+    job->command = text.data;
+
+    jobs.items[jobs.count++] = job;
+    return job;
+}
+
+// Opens a pty for a job's terminal output and returns its master side,
+// non-blocking, or -1. The slave keeps output post-processing off so a
+// newline arrives as a plain newline, and gets the window's size.
+static int job_open_pty(int* slave_fd) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    char name[64];
+    if (master == -1) return -1;
+    if (grantpt(master) == -1 || unlockpt(master) == -1 || ptsname_r(master, name, sizeof(name)) != 0 ||
+        (*slave_fd = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) {
+        close(master);
+        return -1;
+    }
+    struct termios tio;
+    if (tcgetattr(*slave_fd, &tio) == 0) {
+        tio.c_oflag &= ~ONLCR;
+        tcsetattr(*slave_fd, TCSANOW, &tio);
+    }
+    struct winsize ws = {.ws_row = LINES, .ws_col = COLS};
+    ioctl(master, TIOCSWINSZ, &ws);
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    return master;
+}
+
+// Moves one read's worth of a job's output into the scrollback. Returns
+// false once every process holding the pty has closed it.
+bool job_read_output(Job* job) {
+    static char buf[OUTPUT_READ_SIZE];
+    ssize_t n = read(job->pty_fd, buf, sizeof(buf));
+    if (n > 0) {
+        output_feed(buf, n);
+        return true;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return true;
+    close(job->pty_fd);  // EIO: the last writer is gone
+    job->pty_fd = -1;
+    return false;
+}
+
+// Collects whatever output a job has left in its pty
+static void job_drain_output(Job* job) {
+    while (job->pty_fd != -1 && job_read_output(job)) {
+        if (!(poll(&(struct pollfd){.fd = job->pty_fd, .events = POLLIN}, 1, 0) > 0)) break;
+    }
+}
+
+static void job_remove(Job* job) {
+    if (job->pty_fd != -1) {
+        job_drain_output(job);
+        if (job->pty_fd != -1) close(job->pty_fd);
+    }
+    for (size_t i = 0; i < jobs.count; i++) {
+        if (jobs.items[i] == job) {
+            memmove(&jobs.items[i], &jobs.items[i + 1], (jobs.count - i - 1) * sizeof(Job*));
+            jobs.count--;
+            break;
+        }
+    }
+    free(job->command);
+    free(job);
+}
+
+static Job* job_by_pid(pid_t pid, int* proc) {
+    for (size_t i = 0; i < jobs.count; i++) {
+        for (int p = 0; p < jobs.items[i]->proc_count; p++) {
+            if (jobs.items[i]->pids[p] == pid) {
+                if (proc) *proc = p;
+                return jobs.items[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+// The current job (%+, rank 0) or the previous one (%-, rank 1): the
+// background jobs most recently started, stopped or resumed
+static Job* job_current(int rank) {
+    Job* best[2] = {NULL, NULL};
+    for (size_t i = 0; i < jobs.count; i++) {
+        Job* job = jobs.items[i];
+        if (job->foreground || job->state == JOB_DONE) continue;
+        if (best[0] == NULL || job->seq > best[0]->seq) {
+            best[1] = best[0];
+            best[0] = job;
+        } else if (best[1] == NULL || job->seq > best[1]->seq) {
+            best[1] = job;
+        }
+    }
+    return best[rank];
+}
+
+// A job is running while any of its processes runs, stopped while the
+// rest are stopped and done once all of them have been reaped
+static void job_update_state(Job* job) {
+    JobState state = JOB_DONE;
+    for (int p = 0; p < job->proc_count; p++) {
+        if (job->proc_state[p] == JOB_RUNNING) {
+            state = JOB_RUNNING;
+            break;
+        }
+        if (job->proc_state[p] == JOB_STOPPED) state = JOB_STOPPED;
+    }
+    if (state == job->state) return;
+    if (state == JOB_STOPPED) job->seq = ++jobs.seq;
+    if (state == JOB_DONE) {
+        job->stats.wall_ns = monotonic_ns() - job->start_ns;
+        job->stats.stages = job->proc_count;
+    }
+    job->state = state;
+    if (!job->foreground) job->notify = true;
+}
+
+// Applies one wait status to the job that owns pid
+static void job_record(pid_t pid, int status, const struct rusage* ru) {
+    int p;
+    Job* job = job_by_pid(pid, &p);
+    if (job == NULL) return;
+
+    if (WIFSTOPPED(status)) {
+        job->proc_state[p] = JOB_STOPPED;
+    } else if (WIFCONTINUED(status)) {
+        job->proc_state[p] = JOB_RUNNING;
+    } else {
+        job->proc_state[p] = JOB_DONE;
+        accumulate_rusage(&job->stats, ru);
+        if (pid == job->last_pid) job->exit_status = exit_status_of(status);
+        // As timeout(1) reports it, unless it took SIGKILL
+        if (pid == job->last_pid && job->timed_out && job->exit_status != 128 + SIGKILL) {
+            job->exit_status = TIMEOUT_STATUS;
+        }
+        if (interactive_mode && job->foreground) {
+            shell_print("\n[%s] Child process completed - PID: %d\n", get_timestamp(), pid);
+            shell_flush();
+        }
+    }
+    job_update_state(job);
+}
+
+// Sends sig to every process of job that is still running, and SIGCONT
+// after it so a stopped one can act on it
+static void job_signal(Job* job, int sig) {
+    if (job->pgid > 0) {
+        kill(-job->pgid, sig);
+        if (sig != SIGKILL) kill(-job->pgid, SIGCONT);
+        return;
+    }
+    for (int p = 0; p < job->proc_count; p++) {
+        if (job->proc_state[p] == JOB_DONE) continue;
+        kill(job->pids[p], sig);
+        if (sig != SIGKILL) kill(job->pids[p], SIGCONT);
+    }
+}
+
+// Signals every job whose timeout has passed: with its timeout signal
+// first, then with SIGKILL once the grace period is over too
+void jobs_watchdog(void) {
+    long long now = 0;
+    for (size_t i = 0; i < jobs.count; i++) {
+        Job* job = jobs.items[i];
+        if (job->deadline_ns == 0 || job->state == JOB_DONE) continue;
+        if (now == 0) now = monotonic_ns();
+        if (now < job->deadline_ns) continue;
+        bool escalate = job->timed_out || job->timeout_signal == SIGKILL;
+        job_signal(job, escalate ? SIGKILL : job->timeout_signal);
+        job->deadline_ns = !escalate && job->grace_ns > 0 ? now + job->grace_ns : 0;
+        job->timed_out = true;
+    }
+}
+
+// Shortens timeout_ms, a poll() timeout, to end at the next job deadline
+int jobs_watchdog_timeout(int timeout_ms) {
+    long long now = 0;
+    for (size_t i = 0; i < jobs.count; i++) {
+        const Job* job = jobs.items[i];
+        if (job->deadline_ns == 0 || job->state == JOB_DONE) continue;
+        if (now == 0) now = monotonic_ns();
+        long long wait_ms = job->deadline_ns > now ? (job->deadline_ns - now) / 1000000 + 1 : 0;
+        if (timeout_ms < 0 || wait_ms < timeout_ms) timeout_ms = (int)wait_ms;
+    }
+    return timeout_ms;
+}
+
+static int pidfd_open_pid(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Sleeps until a process of job exits or the next job deadline, and
+// signals the jobs whose deadline passed. A pidfd per running process
+// makes its exit wake the poll; without pidfds the wait is cut into
+// WATCHDOG_POLL_MS steps. Returns false if SIGINT cut the sleep short.
+static bool watchdog_poll(Job* job) {
+    struct pollfd fds[MAX_STAGES + 1];
+    int nfds = 0;
+    bool pidfds = true;
+    // Also wakes for a stop in interactive mode; -1 otherwise, and skipped
+    fds[nfds++] = (struct pollfd){.fd = sigchld_pipe[0], .events = POLLIN};
+    for (int p = 0; p < job->proc_count; p++) {
+        if (job->proc_state[p] != JOB_RUNNING) continue;
+        int fd = pidfd_open_pid(job->pids[p]);
+        if (fd == -1) {
+            pidfds = false;
+            continue;
+        }
+        fds[nfds++] = (struct pollfd){.fd = fd, .events = POLLIN};
+    }
+    int ready = poll(fds, nfds, jobs_watchdog_timeout(pidfds ? -1 : WATCHDOG_POLL_MS));
+    bool cut = ready == -1 && errno == EINTR && interrupted;
+    if (ready > 0 && (fds[0].revents & POLLIN)) {
+        char buf[64];
+        while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {}
+    }
+    for (int i = 1; i < nfds; i++) close(fds[i].fd);
+    jobs_watchdog();
+    return !cut;
+}
+
+// Collects every child that has changed state without blocking
+void jobs_reap(void) {
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    if (jobs.count == 0) return;
+    jobs_watchdog();
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+        job_record(pid, status, &ru);
+    }
+}
+
+// Blocks until job stops or finishes, recording any other child that
+// changes state meanwhile. While a job has a timeout the wait goes
+// through watchdog_poll(), so the deadline can end it. Returns false if
+// SIGINT cut the wait short.
+static bool wait_for_job(Job* job) {
+    while (job->state == JOB_RUNNING) {
+        bool watched = jobs_watchdog_timeout(-1) >= 0;
+        if (watched && !watchdog_poll(job)) return false;
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, (watched ? WNOHANG : 0) | WUNTRACED | WCONTINUED, &ru);
+        if (pid == 0) continue;
+        if (pid == -1) {
+            if (errno == EINTR) {
+                if (interrupted) return false;
+                continue;
+            }
+            // ECHILD: nothing left to wait for
+            for (int p = 0; p < job->proc_count; p++) job->proc_state[p] = JOB_DONE;
+            job_update_state(job);
+            break;
+        }
+        // posix_spawn cannot hand the terminal to the child, so a stage may
+        // touch it a moment before the shell does; it now owns the
+        // terminal and only needs to go on
+        if (interactive_mode && WIFSTOPPED(status) &&
+            (WSTOPSIG(status) == SIGTTIN || WSTOPSIG(status) == SIGTTOU) &&
+            job->foreground && job_by_pid(pid, NULL) == job) {
+            kill(pid, SIGCONT);
+            continue;
+        }
+        job_record(pid, status, &ru);
+    }
+    return true;
+}
+
+static void job_continue(Job* job) {
+    for (int p = 0; p < job->proc_count; p++) {
+        if (job->proc_state[p] == JOB_STOPPED) job->proc_state[p] = JOB_RUNNING;
+    }
+    job->state = JOB_RUNNING;
+    if (job->pgid > 0) {
+        kill(-job->pgid, SIGCONT);
+    } else {
+        for (int p = 0; p < job->proc_count; p++) kill(job->pids[p], SIGCONT);
+    }
+}
+
+// Sends keys typed at the terminal to a foreground job's pty. While the
+// pty has ISIG on, its interrupt, quit and suspend characters become
+// signals for the job's process group, as the line discipline would send
+// them if the job were in the pty's session.
+static void job_forward_keys(Job* job, const char* keys, size_t len) {
+    struct termios tio;
+    bool isig = true;
+    cc_t intr = ctrl('c'), quit = ctrl('\\'), susp = ctrl('z');
+    if (job->pty_fd != -1 && tcgetattr(job->pty_fd, &tio) == 0) {
+        isig = (tio.c_lflag & ISIG) != 0;
+        intr = tio.c_cc[VINTR];
+        quit = tio.c_cc[VQUIT];
+        susp = tio.c_cc[VSUSP];
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        cc_t c = keys[i];
+        int sig = !isig ? 0 : c == intr ? SIGINT : c == quit ? SIGQUIT : c == susp ? SIGTSTP : 0;
+        if (sig == 0) continue;
+        if (i > start && job->pty_fd != -1) write_all(job->pty_fd, keys + start, i - start);
+        kill(-job->pgid, sig);
+        start = i + 1;
+    }
+    if (len > start && job->pty_fd != -1) write_all(job->pty_fd, keys + start, len - start);
+}
+
+// Interactive counterpart of wait_for_job(): until job stops or finishes,
+// relays the output of every job's pty into the scrollback, drawn at most
+// once per frame, and reaps children as SIGCHLD reports them. With
+// forward set, the terminal is in raw mode and keys go to the job;
+// otherwise keys are dropped and ^C ends the wait, returning false.
+static bool job_pump(Job* job, bool forward) {
+    size_t max_fds = jobs.count + 2;
+    struct pollfd* fds = malloc(max_fds * sizeof(struct pollfd));
+    Job** owners = malloc(max_fds * sizeof(Job*));
+    if (!fds || !owners) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    interrupted = 0;
+    if (forward) raw();
+
+    while (job->state == JOB_RUNNING && !interrupted) {
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+        fds[nfds++] = (struct pollfd){.fd = sigchld_pipe[0], .events = POLLIN};
+        for (size_t i = 0; i < jobs.count; i++) {
+            if (jobs.items[i]->pty_fd == -1) continue;
+            owners[nfds] = jobs.items[i];
+            fds[nfds++] = (struct pollfd){.fd = jobs.items[i]->pty_fd, .events = POLLIN};
+        }
+        int ready = poll(fds, nfds, jobs_watchdog_timeout(output_frame_timeout()));
+        jobs_watchdog();
+        stats_poll();
+        if (ready == -1) continue;
+
+        if (fds[0].revents & POLLIN) {
+            char keys[256];
+            ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+            if (n > 0 && forward) job_forward_keys(job, keys, n);
+        }
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {}
+            jobs_reap();
+        }
+        for (int i = 2; i < nfds; i++) {
+            if (fds[i].revents) job_read_output(owners[i]);
+        }
+        if (output_frame_timeout() == 0) output_render();
+    }
+
+    job_drain_output(job);
+    output_render();
+    if (forward) {
+        noraw();
+        cbreak();
+    }
+    free(fds);
+    free(owners);
+    return !interrupted;
+}
+
+// Waits for job: through job_pump() in interactive mode so output keeps
+// flowing, with a plain wait4() otherwise
+static bool job_wait(Job* job) {
+    return interactive_mode ? job_pump(job, false) : wait_for_job(job);
+}
+
+// Runs job in the foreground until it finishes or stops. A captured job's
+// output is relayed from its pty while the shell keeps the terminal;
+// otherwise, in interactive mode, the job gets the terminal for the
+// duration and the shell restores its own terminal modes afterwards. A
+// finished job is removed and its statistics are copied to stats.
+static int job_run_foreground(Job* job, bool resume, CommandStats* stats) {
+    job->foreground = true;
+    job->notify = false;
+    if (job->captured) {
+        if (resume) job_continue(job);
+        job_pump(job, true);
+        if (scrollback.alt_screen) {
+            // A full-screen program drew behind ncurses' back
+            scrollback.alt_screen = false;
+            scrollback.esc_state = ESC_NONE;
+            clearok(curscr, TRUE);
+            scrollback.repaint = true;
+            output_render();
+        }
+    } else {
+        if (interactive_mode) {
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+            if (resume && job->has_tmodes) tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+        }
+        if (resume) job_continue(job);
+
+        wait_for_job(job);
+
+        if (interactive_mode) {
+            tcsetpgrp(STDIN_FILENO, shell_pgid);
+            if (job->state == JOB_STOPPED) {
+                job->has_tmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+            }
+            reset_prog_mode();
+        }
+    }
+    if (stats) *stats = job->stats;
+
+    if (job->state == JOB_STOPPED) {
+        job->foreground = false;
+        shell_print("\n[%d]+  Stopped                 %s\n", job->id, job->command);
+        shell_flush();
+        return 128 + SIGTSTP;
+    }
+    int status = job->exit_status;
+    job_remove(job);
+    return status;
+}
+
+// Runs a pipeline of external commands and returns the exit status of the
+// last stage. Fills stats (when non-NULL) with the launch latency, wall
+// time and the rusage of every stage collected through wait4(). A
+// background pipeline is left running in the job table and returns 0.
+int _command(char** args, CommandStats* stats, bool background) {
+    CommandStats local_stats;
+    if (stats == NULL) stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+
+    pid_t parent_pid = getpid();
+    char** stages[MAX_STAGES];
+    Job* job = job_create(args);
+    int stage_count = split_pipeline(args, stages, MAX_STAGES);
+
+    if (stage_count < 0) {
+        shell_error("\nSyntax error near unexpected token `|'\n");
+        job_remove(job);
+        return 2;
+    }
+
+    // Under ncurses the job's terminal is a pty the shell reads from, so
+    // its output lands in the scrollback instead of under the screen
+    int pty_slave = -1;
+    if (interactive_mode) {
+        job->pty_fd = job_open_pty(&pty_slave);
+        job->captured = job->pty_fd != -1;
+    }
+    int tty_in = job->captured ? pty_slave : STDIN_FILENO;
+    int tty_out = job->captured ? pty_slave : STDOUT_FILENO;
+    int tty_err = job->captured ? pty_slave : STDERR_FILENO;
+
+    // Children inherit stdout, so anything still buffered must go first
+    shell_flush();
+
+    // Launch every stage up front so they all run concurrently, each one
+    // reading from the previous stage's pipe and writing into the next.
+    int prev_read = -1;
+    for (int s = 0; s < stage_count; s++) {
+        int pipe_fds[2] = {-1, -1};
+        if (s < stage_count - 1 && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            shell_error("\nPipe failed: %s\n", strerror(errno));
+            break;
+        }
+
+        Redirections io;
+        redirections_init(&io, prev_read != -1 ? prev_read : tty_in,
+                          pipe_fds[1] != -1 ? pipe_fds[1] : tty_out, tty_err);
+        // Without job control a background job must not compete with
+        // the shell for its input
+        if (background && !interactive_mode && io.fds[STDIN_FILENO] == STDIN_FILENO) {
+            int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (null_fd != -1 && redirections_own(&io, null_fd)) io.fds[STDIN_FILENO] = null_fd;
+        }
+        pid_t pid = -1;
+        if (handle_io_redirection(stages[s], &io) == 0) {
+            long long launch_ns = monotonic_ns();
+            if (stages[s][0] == NULL) {
+                shell_error("\nMissing command\n");
+            } else if ((pid = launch_stage(stages[s], &io,
+                                           interactive_mode ? job->pgid : -1)) == -1) {
+                shell_error("\nCommand execution failed: %s: %s\n", stages[s][0], strerror(errno));
+            } else {
+                // posix_spawn returns once the child has exec'd
+                job->stats.spawn_ns += monotonic_ns() - launch_ns;
+                if (interactive_mode && job->pgid == 0) {
+                    // The first stage leads the job's process group
+                    job->pgid = pid;
+                    if (!background && !job->captured) tcsetpgrp(STDIN_FILENO, pid);
+                }
+                if (interactive_mode) {
+                    shell_print("\n[%s] Child process created - Parent PID: %d, Child PID: %d, Command: %s\n", 
+                                get_timestamp(), parent_pid, pid, stages[s][0]);
+                    shell_flush();
+                }
+            }
+        }
+
+        // Drop the parent's copies of every fd the stage now owns
+        redirections_close(&io);
+        if (prev_read != -1) close(prev_read);
+        if (pipe_fds[1] != -1) close(pipe_fds[1]);
+        prev_read = pipe_fds[0];
+
+        if (pid != -1) {
+            job->pids[job->proc_count] = pid;
+            job->proc_state[job->proc_count++] = JOB_RUNNING;
+            if (s == stage_count - 1) job->last_pid = pid;
+        }
+    }
+    if (prev_read != -1) close(prev_read);
+    // Only the children hold the slave now, so the master sees EOF once
+    // they have all exited
+    if (pty_slave != -1) close(pty_slave);
+
+    if (job->proc_count == 0) {
+        job_remove(job);
+        return 127;
+    }
+    // A timeout covers the first job launched after it is set
+    if (command_timeout.duration_ns > 0) {
+        job->deadline_ns = job->start_ns + command_timeout.duration_ns;
+        job->grace_ns = command_timeout.grace_ns;
+        job->timeout_signal = command_timeout.signal;
+    }
+    command_timeout.duration_ns = 0;
+
+    if (background) {
+        job->seq = ++jobs.seq;
+        shell_print("\n[%d] %d\n", job->id, job->pids[job->proc_count - 1]);
+        shell_flush();
+        return 0;
+    }
+
+    if (interactive_mode) {
+        shell_print("\n[%s] Parent process waiting - PID: %d, Child PID: %d, Stages: %d\n", 
+                    get_timestamp(), parent_pid, job->pids[0], job->proc_count);
+        shell_flush();
+    }
+    return job_run_foreground(job, false, stats);
+}
+
+// Describes a job's state the way the jobs builtin lists it
+static const char* job_state_text(const Job* job, char* buf, size_t size) {
+    if (job->state == JOB_RUNNING) return "Running";
+    if (job->state == JOB_STOPPED) return "Stopped";
+    if (job->exit_status == 0) return "Done";
+    if (job->exit_status > 128) return strsignal(job->exit_status - 128);
+    snprintf(buf, size, "Exit %d", job->exit_status);
+    return buf;
+}
+
+static void job_print(const Job* job, bool first) {
+    char buf[32];
+    char mark = job == job_current(0) ? '+' : job == job_current(1) ? '-' : ' ';
+    shell_print(first ? "\n[%d]%c  %-24s%s%s\n" : "[%d]%c  %-24s%s%s\n",
+                job->id, mark, job_state_text(job, buf, sizeof(buf)), job->command,
+                job->state == JOB_RUNNING ? " &" : "");
+}
+
+// Forgets finished background jobs once the user has seen them
+static void jobs_forget_done(void) {
+    size_t i = 0;
+    while (i < jobs.count) {
+        Job* job = jobs.items[i];
+        job->notify = false;
+        if (job->state == JOB_DONE && !job->foreground) {
+            job_remove(job);
+        } else {
+            i++;
+        }
+    }
+}
+
+// True when a background job has changed state since it was last reported
+bool jobs_changed(void) {
+    for (size_t i = 0; i < jobs.count; i++) {
+        if (jobs.items[i]->notify) return true;
+    }
+    return false;
+}
+
+// Prints a notice for every background job that stopped, resumed or
+// finished since the last call. Batch mode only drops finished jobs.
+// Returns the number of notices printed.
+int jobs_notify(void) {
+    int printed = 0;
+    for (size_t i = 0; i < jobs.count; i++) {
+        if (jobs.items[i]->notify && interactive_mode) {
+            job_print(jobs.items[i], false);
+            printed++;
+        }
+    }
+    jobs_forget_done();
+    shell_flush();
+    return printed;
+}
+
+// Resolves a job spec: %n or n, %+ / %% / none for the current job and %-
+// for the previous one
+static Job* job_from_spec(const char* builtin, const char* spec) {
+    Job* job = NULL;
+    if (spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        job = job_current(0);
+    } else if (strcmp(spec, "%-") == 0) {
+        job = job_current(1);
+    } else {
+        const char* digits = spec[0] == '%' ? spec + 1 : spec;
+        char* end;
+        long id = strtol(digits, &end, 10);
+        for (size_t i = 0; *digits != '\0' && *end == '\0' && i < jobs.count; i++) {
+            if (jobs.items[i]->id == id && !jobs.items[i]->foreground) job = jobs.items[i];
+        }
+    }
+    if (job == NULL) shell_error("\n%s: %s: no such job\n", builtin, spec ? spec : "current");
+    return job;
+}
+
+// jobs: lists background jobs with their state
+int handle_jobs(char** args) {
+    (void)args;
+    jobs_reap();
+    for (size_t i = 0; i < jobs.count; i++) job_print(jobs.items[i], i == 0);
+    jobs_forget_done();
+    shell_flush();
+    return 0;
+}
+
+// fg [job]: continues a job in the foreground and waits for it
+int handle_fg(char** args) {
+    Job* job = job_from_spec("fg", args[1]);
+    if (job == NULL) return 1;
+    shell_print("\n%s\n", job->command);
+    shell_flush();
+    return job_run_foreground(job, job->state == JOB_STOPPED, NULL);
+}
+
+// bg [job...]: continues stopped jobs in the background
+int handle_bg(char** args) {
+    int status = 0;
+    int i = 1;
+    do {
+        Job* job = job_from_spec("bg", args[i]);
+        if (job == NULL) {
+            status = 1;
+        } else if (job->state != JOB_STOPPED) {
+            shell_error("\nbg: job %d already in background\n", job->id);
+        } else {
+            job_continue(job);
+            job->seq = ++jobs.seq;
+            job->notify = false;
+            shell_print("\n[%d]+ %s &\n", job->id, job->command);
+            shell_flush();
+        }
+    } while (args[i] != NULL && args[++i] != NULL);
+    return status;
+}
+
+// wait [job|pid...]: waits for the given jobs, or for every running
+// background job, and returns the status of the last one
+int handle_wait(char** args) {
+    int status = 0;
+    interrupted = 0;
+    if (args[1] == NULL) {
+        while (true) {
+            Job* job = NULL;
+            for (size_t i = 0; i < jobs.count && job == NULL; i++) {
+                if (jobs.items[i]->state == JOB_RUNNING) job = jobs.items[i];
+            }
+            if (job == NULL) break;
+            if (!job_wait(job)) return 128 + SIGINT;
+        }
+        jobs_forget_done();
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        Job* job;
+        if (args[i][0] == '%') {
+            job = job_from_spec("wait", args[i]);
+        } else if ((job = job_by_pid(atoi(args[i]), NULL)) == NULL) {
+            shell_error("\nwait: pid %s is not a child of this shell\n", args[i]);
+        }
+        if (job == NULL) {
+            status = 127;
+            continue;
+        }
+        if (!job_wait(job)) return 128 + SIGINT;
+        if (job->state == JOB_STOPPED) {
+            status = 128 + SIGTSTP;
+        } else {
+            status = job->exit_status;
+            job_remove(job);
+        }
+    }
+    return status;
+}
+
+// Builds the argv of one parallel task: every "{}" in the template is
+// replaced by arg, or arg is appended when the template has none
+static char** parallel_argv(char** template, const char* arg, Arena* arena) {
+    int count = 0;
+    bool placeholder = false;
+    while (template[count] != NULL) {
+        if (strstr(template[count], "{}") != NULL) placeholder = true;
+        count++;
+    }
+    char** argv = arena_alloc(arena, (count + 2) * sizeof(char*));
+    size_t arg_len = strlen(arg);
+    for (int i = 0; i < count; i++) {
+        const char* word = template[i];
+        const char* hole = strstr(word, "{}");
+        if (hole == NULL) {
+            argv[i] = template[i];
+            continue;
+        }
+        size_t holes = 0;
+        for (const char* h = hole; h != NULL; h = strstr(h + 2, "{}")) holes++;
+        char* out = arena_alloc(arena, strlen(word) + holes * arg_len + 1);
+        char* w = out;
+        while (hole != NULL) {
+            memcpy(w, word, hole - word);
+            w += hole - word;
+            memcpy(w, arg, arg_len);
+            w += arg_len;
+            word = hole + 2;
+            hole = strstr(word, "{}");
+        }
+        strcpy(w, word);
+        argv[i] = out;
+    }
+    if (!placeholder) argv[count++] = (char*)arg;
+    argv[count] = NULL;
+    return argv;
+}
+
+// Reads the argument list for parallel, one argument per non-empty line.
+// The arguments point into input.
+static const char** parallel_read_args(int fd, String* input, size_t* count) {
+    char buf[PARALLEL_READ_SIZE];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        string_reserve(input, input->count + n + 1);
+        memcpy(input->data + input->count, buf, n);
+        input->count += n;
+    }
+    size_t lines = 0;
+    for (size_t i = 0; i < input->count; i++) lines += input->data[i] == '\n';
+    const char** args = malloc((lines + 1) * sizeof(char*));
+    if (!args) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    *count = 0;
+    if (input->count == 0) return args;
+    input->data[input->count] = '\0';
+    for (char* line = input->data; line != NULL && *line != '\0';) {
+        char* newline = strchr(line, '\n');
+        if (newline) *newline = '\0';
+        if (*line != '\0') args[(*count)++] = line;
+        line = newline ? newline + 1 : NULL;
+    }
+    return args;
+}
+
+// Whether output to fd belongs on the ncurses screen: the shell's own
+// stdout and stderr are the terminal ncurses draws on
+static bool fd_is_screen(int fd) {
+    return interactive_mode && (fd == STDOUT_FILENO || fd == STDERR_FILENO);
+}
+
+// Writes a builtin's output to its destination. Under ncurses the
+// terminal's share goes through the scrollback; in batch mode whatever
+// stdio still holds for stdout goes out first.
+static void emit_output(int out_fd, const char* data, size_t len) {
+    if (fd_is_screen(out_fd)) {
+        output_feed(data, len);
+        if (output_frame_timeout() == 0) output_render();
+    } else {
+        if (out_fd == STDOUT_FILENO) fflush(stdout);
+        write_all(out_fd, data, len);
+    }
+}
+
+// Runs template once per item with at most workers children at a time
+// and writes each task's output to out_fd, whole and in item order
+static int parallel_run(char** template, const char** items, size_t item_count,
+                        long workers, int out_fd) {
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    size_t window = workers * PARALLEL_WINDOW_FACTOR;
+    ParallelTask* tasks = calloc(window, sizeof(ParallelTask));
+    struct pollfd* fds = malloc(workers * sizeof(struct pollfd));
+    size_t* fd_task = malloc(workers * sizeof(size_t));
+    if (!tasks || !fds || !fd_task) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    Arena task_arena = {0};
+    CommandStats stats;
+    memset(&stats, 0, sizeof(stats));
+    long long start_ns = monotonic_ns();
+    size_t next = 0;        // Next item to launch
+    size_t head = 0;        // Oldest task not yet emitted, as a ring index
+    size_t in_flight = 0;   // Tasks launched but not yet emitted
+    long running = 0;
+    size_t failed = 0;
+    char buf[PARALLEL_READ_SIZE];
+    interrupted = 0;
+
+    shell_flush();
+    while (next < item_count || in_flight > 0) {
+        // Keep every worker busy while the ordered window has room
+        while (running < workers && in_flight < window && next < item_count && !interrupted) {
+            ParallelTask* task = &tasks[(head + in_flight++) % window];
+            int pipe_fds[2];
+            task->arg = items[next++];
+            task->status = 127;
+            task->out_fd = -1;
+            char** argv = parallel_argv(template, task->arg, &task_arena);
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                shell_error("\nparallel: pipe: %s\n", strerror(errno));
+            } else {
+                Redirections task_io;
+                redirections_init(&task_io, null_fd, pipe_fds[1], pipe_fds[1]);
+                task->pid = launch_stage(argv, &task_io, -1);
+                if (task->pid == -1) {
+                    shell_error("\nparallel: %s: %s\n", argv[0], strerror(errno));
+                    close(pipe_fds[0]);
+                } else {
+                    task->out_fd = pipe_fds[0];
+                    task->running = true;
+                    running++;
+                }
+                close(pipe_fds[1]);
+            }
+            arena_reset(&task_arena);
+        }
+
+        int nfds = 0;
+        for (size_t i = 0; i < in_flight; i++) {
+            size_t index = (head + i) % window;
+            if (tasks[index].out_fd == -1) continue;
+            // The head is always read, so a full buffer waits for its turn
+            if (index != head && tasks[index].output.count >= PARALLEL_BUFFER_MAX) continue;
+            fds[nfds].fd = tasks[index].out_fd;
+            fds[nfds].events = POLLIN;
+            fd_task[nfds++] = index;
+        }
+        if (nfds > 0 && poll(fds, nfds, -1) == -1) {
+            if (errno != EINTR) {
+                shell_error("\nparallel: poll: %s\n", strerror(errno));
+                break;
+            }
+            nfds = 0;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0) continue;
+            ParallelTask* task = &tasks[fd_task[i]];
+            ssize_t n = read(task->out_fd, buf, sizeof(buf));
+            if (n > 0) {
+                if (task == &tasks[head]) {
+                    emit_output(out_fd, buf, n);
+                } else {
+                    string_reserve(&task->output, task->output.count + n);
+                    memcpy(task->output.data + task->output.count, buf, n);
+                    task->output.count += n;
+                }
+                continue;
+            }
+            if (n == -1 && errno == EINTR) continue;
+
+            // End of output: the task has exited or is about to
+            int wstatus = 0;
+            struct rusage ru;
+            close(task->out_fd);
+            task->out_fd = -1;
+            while (wait4(task->pid, &wstatus, 0, &ru) == -1 && errno == EINTR) {}
+            accumulate_rusage(&stats, &ru);
+            task->status = exit_status_of(wstatus);
+            task->running = false;
+            running--;
+        }
+
+        // Emit finished tasks in order. The new head's buffered output
+        // goes out now and the rest of it streams as it arrives.
+        while (in_flight > 0) {
+            ParallelTask* task = &tasks[head];
+            if (task->output.count > 0) {
+                emit_output(out_fd, task->output.data, task->output.count);
+                task->output.count = 0;
+            }
+            if (task->running) break;
+            if (task->status != 0) {
+                failed++;
+                shell_error("\nparallel: exit %d: %s\n", task->status, task->arg);
+            }
+            head = (head + 1) % window;
+            in_flight--;
+        }
+        // After ^C only the tasks already started are waited for
+        if (interrupted) item_count = next;
+    }
+
+    stats.wall_ns = monotonic_ns() - start_ns;
+    // The report goes to stderr so it never mixes with the tasks' output
+    shell_error("\nparallel: %zu tasks, %zu failed, %ld workers, %.3fs, %.1f tasks/s, user %ld.%06lds sys %ld.%06lds\n",
+                next, failed, workers, stats.wall_ns / 1e9,
+                stats.wall_ns > 0 ? next / (stats.wall_ns / 1e9) : 0.0,
+                (long)stats.utime.tv_sec, (long)stats.utime.tv_usec,
+                (long)stats.stime.tv_sec, (long)stats.stime.tv_usec);
+
+    for (size_t i = 0; i < window; i++) string_clear(&tasks[i].output);
+    free(tasks);
+    free(fds);
+    free(fd_task);
+    arena_free(&task_arena);
+    if (null_fd != -1) close(null_fd);
+    if (interrupted) return 128 + SIGINT;
+    return failed > 0 ? 1 : 0;
+}
+
+// parallel [-j N] command [args...] [::: arg...]: runs the command once
+// per argument with at most N children at a time (default: online CPUs).
+// Arguments follow ":::" or are read one per line from a redirected
+// stdin. Each child's stdout and stderr share a pipe read by the shell,
+// so the output of every task appears whole and in argument order.
+// Returns 0 if every task succeeded.
+int handle_parallel(char** args) {
+    Redirections io;
+    redirections_init(&io, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    int status = 2;
+
+    if (handle_io_redirection(args, &io) == -1) {
+        status = 1;
+    } else {
+        long workers = sysconf(_SC_NPROCESSORS_ONLN);
+        int t = 1;
+        bool usage_ok = true;
+        if (args[t] != NULL && strncmp(args[t], "-j", 2) == 0) {
+            const char* value = args[t][2] != '\0' ? args[t] + 2 : args[++t];
+            char* end = NULL;
+            workers = value ? strtol(value, &end, 10) : 0;
+            if (value == NULL || *end != '\0' || workers <= 0) {
+                shell_error("\nparallel: -j needs a positive number\n");
+                usage_ok = false;
+            }
+            if (value != NULL) t++;
+        }
+        if (workers <= 0) workers = 1;
+        in_fd = io.fds[STDIN_FILENO];
+        out_fd = io.fds[STDOUT_FILENO];
+
+        char** template = &args[t];
+        const char** items = NULL;
+        size_t item_count = 0;
+        for (int i = t; args[i] != NULL; i++) {
+            if (strcmp(args[i], ":::") == 0) {
+                args[i] = NULL;
+                items = (const char**)&args[i + 1];
+                while (items[item_count] != NULL) item_count++;
+                break;
+            }
+        }
+
+        if (usage_ok && template[0] == NULL) {
+            shell_error("\nparallel: usage: parallel [-j N] command [args...] [::: arg...]\n");
+        } else if (usage_ok && items == NULL && in_fd == STDIN_FILENO && interactive_mode) {
+            shell_error("\nparallel: no arguments: use ::: or < file\n");
+        } else if (usage_ok && items != NULL) {
+            status = parallel_run(template, items, item_count, workers, out_fd);
+        } else if (usage_ok) {
+            String input;
+            string_init(&input);
+            items = parallel_read_args(in_fd, &input, &item_count);
+            status = parallel_run(template, items, item_count, workers, out_fd);
+            free(items);
+            string_clear(&input);
+        }
+    }
+
+    redirections_close(&io);
+    return status;
+}
+
+// time cmd [args...]: runs the command and reports its resource usage
+int handle_time(char** args) {
+    if (args[1] == NULL) {
+        shell_error("\ntime: usage: time command [args...]\n");
+        return 2;
+    }
+    CommandStats stats;
+    int status = run_command(args + 1, &stats, false);
+    print_command_stats(&stats);
+    return status;
+}
+
+// Parses a duration such as 10, 1.5 or 2m (suffixes s, m, h, d) into
+// *ns. Returns false if text is not one.
+static bool parse_duration(const char* text, long long* ns) {
+    char* end;
+    errno = 0;
+    double value = strtod(text, &end);
+    if (end == text || errno != 0 || value < 0 || !isdigit((unsigned char)text[0])) return false;
+    double scale = 1;
+    switch (*end) {
+    case '\0':
+    case 's': scale = 1; break;
+    case 'm': scale = 60; break;
+    case 'h': scale = 3600; break;
+    case 'd': scale = 86400; break;
+    default: return false;
+    }
+    if (*end != '\0' && end[1] != '\0') return false;
+    value *= scale * 1e9;
+    if (value > (double)LLONG_MAX / 2) return false;
+    *ns = (long long)value;
+    return true;
+}
+
+// Parses a signal given by number or by name, with or without "SIG"
+static int parse_signal(const char* text) {
+    static const struct {
+        const char* name;
+        int number;
+    } names[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+    };
+    if (isdigit((unsigned char)text[0])) {
+        char* end;
+        long number = strtol(text, &end, 10);
+        return *end == '\0' && number > 0 && number < NSIG ? (int)number : -1;
+    }
+    if (strncmp(text, "SIG", 3) == 0) text += 3;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(text, names[i].name) == 0) return names[i].number;
+    }
+    return -1;
+}
+
+// timeout [-s signal] [-k grace] duration cmd [args...]: runs the command
+// and sends it SIGTERM, or the signal given, once duration has passed;
+// SIGKILL follows if it is still running after the grace period. A
+// command stopped this way returns 124.
+int handle_timeout(char** args) {
+    Timeout timeout = {.grace_ns = TIMEOUT_GRACE_MS * 1000000LL, .signal = SIGTERM};
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+        if (strcmp(args[i], "-s") == 0 && (timeout.signal = parse_signal(args[i + 1])) != -1) continue;
+        if (strcmp(args[i], "-k") == 0 && parse_duration(args[i + 1], &timeout.grace_ns)) continue;
+        shell_error("\ntimeout: invalid argument `%s %s'\n", args[i], args[i + 1]);
+        return 125;
+    }
+    if (args[i] == NULL || args[i + 1] == NULL) {
+        shell_error("\ntimeout: usage: timeout [-s signal] [-k duration] duration command [args...]\n");
+        return 125;
+    }
+    if (!parse_duration(args[i], &timeout.duration_ns)) {
+        shell_error("\ntimeout: invalid time interval `%s'\n", args[i]);
+        return 125;
+    }
+    // _command() hands the timeout to the job it launches
+    CommandStats stats;
+    command_timeout = timeout;
+    int status = run_command(args + i + 1, &stats, command_background);
+    command_timeout.duration_ns = 0;
+    return status;
+}
+
+// The limit commands get for spec i: what ulimit set, or else the
+// shell's own, which they would inherit
+static struct rlimit limit_current(size_t i) {
+    struct rlimit limit = {RLIM_INFINITY, RLIM_INFINITY};
+    if (command_limits_set & (1u << i)) return command_limits[i];
+    getrlimit(limit_specs[i].resource, &limit);
+    return limit;
+}
+
+static void limit_print(size_t i, bool hard, bool labelled) {
+    struct rlimit limit = limit_current(i);
+    rlim_t value = hard ? limit.rlim_max : limit.rlim_cur;
+    char number[32];
+    if (value == RLIM_INFINITY) {
+        snprintf(number, sizeof(number), "unlimited");
+    } else {
+        snprintf(number, sizeof(number), "%llu", (unsigned long long)(value / limit_specs[i].unit));
+    }
+    if (!labelled) {
+        shell_print("%s\n", number);
+        return;
+    }
+    char units[32];
+    if (limit_specs[i].units) {
+        snprintf(units, sizeof(units), "(%s, -%c)", limit_specs[i].units, limit_specs[i].option);
+    } else {
+        snprintf(units, sizeof(units), "(-%c)", limit_specs[i].option);
+    }
+    shell_print("%-20s%20s %s\n", limit_specs[i].name, units, number);
+}
+
+// Sets the soft limit, the hard one or both for spec i from text, a
+// number of units or "unlimited". Returns 1 after reporting an error.
+static int limit_set(size_t i, const char* text, bool soft, bool hard) {
+    const LimitSpec* spec = &limit_specs[i];
+    rlim_t value = RLIM_INFINITY;
+    if (strcmp(text, "unlimited") != 0) {
+        char* end;
+        errno = 0;
+        unsigned long long number = strtoull(text, &end, 10);
+        if (!isdigit((unsigned char)text[0]) || *end != '\0' || errno != 0 ||
+            number > (unsigned long long)(RLIM_INFINITY - 1) / spec->unit) {
+            shell_error("\nulimit: %s: invalid number\n", text);
+            return 1;
+        }
+        value = (rlim_t)number * spec->unit;
+    }
+    if (!soft && !hard) soft = hard = true;
+
+    struct rlimit limit = limit_current(i);
+    if (soft) limit.rlim_cur = value;
+    if (hard) limit.rlim_max = value;
+    // Checked here, as the child applying it could not report it
+    struct rlimit own;
+    getrlimit(spec->resource, &own);
+    int err = 0;
+    if (limit.rlim_cur > limit.rlim_max) {
+        err = EINVAL;
+    } else if (limit.rlim_max > own.rlim_max && geteuid() != 0) {
+        err = EPERM;
+    }
+    if (err != 0) {
+        shell_error("\nulimit: %s: cannot modify limit: %s\n", spec->name, strerror(err));
+        return 1;
+    }
+    command_limits[i] = limit;
+    command_limits_set |= 1u << i;
+    return 0;
+}
+
+// ulimit [-SH] [-a] [-ntv [limit]]...: shows or sets the open files (-n),
+// CPU seconds (-t) and address space in KB (-v) commands may use. Without
+// -S or -H a new value sets both the soft and hard limit; soft limits are
+// shown unless -H is given. The limits apply to the commands the shell
+// runs, not to the shell itself.
+int handle_ulimit(char** args) {
+    bool soft = false, hard = false, all = args[1] == NULL;
+    int status = 0;
+    size_t shown[LIMIT_COUNT * 4];
+    size_t shown_count = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] != '-' || args[i][1] == '\0') {
+            shell_error("\nulimit: usage: ulimit [-SHa] [-ntv [limit]]\n");
+            return 2;
+        }
+        for (const char* o = args[i] + 1; *o != '\0'; o++) {
+            size_t spec = 0;
+            while (spec < LIMIT_COUNT && limit_specs[spec].option != *o) spec++;
+            if (*o == 'S') {
+                soft = true;
+            } else if (*o == 'H') {
+                hard = true;
+            } else if (*o == 'a') {
+                all = true;
+            } else if (spec == LIMIT_COUNT) {
+                shell_error("\nulimit: -%c: invalid option\nulimit: usage: ulimit [-SHa] [-ntv [limit]]\n", *o);
+                return 2;
+            } else if (o[1] == '\0' && args[i + 1] != NULL && args[i + 1][0] != '-') {
+                status |= limit_set(spec, args[++i], soft, hard);
+                break;
+            } else if (shown_count < sizeof(shown) / sizeof(shown[0])) {
+                shown[shown_count++] = spec;
+            }
+        }
+    }
+    if (all) {
+        shown_count = LIMIT_COUNT;
+        for (size_t i = 0; i < LIMIT_COUNT; i++) shown[i] = i;
+    }
+    for (size_t i = 0; i < shown_count; i++) {
+        if (i == 0) shell_print("\n");
+        limit_print(shown[i], hard && !soft, all || shown_count > 1);
+    }
+    shell_flush();
+    return status;
+}
+
+// timing [on|off]: toggles reporting resource usage after every command
+int handle_timing(char** args) {
+    if (args[1] != NULL && strcmp(args[1], "on") == 0) {
+        report_timing = true;
+    } else if (args[1] != NULL && strcmp(args[1], "off") == 0) {
+        report_timing = false;
+    } else if (args[1] != NULL) {
+        shell_error("\ntiming: usage: timing [on|off]\n");
+        return 2;
+    }
+    shell_print("\ntiming is %s\n", report_timing ? "on" : "off");
+    shell_flush();
+    return 0;
+}
+
+// Instrumentation reports
+
+// Upper bound of the bucket holding the percent'th percentile sample,
+// capped at the largest sample
+static uint64_t histogram_percentile(const Histogram* h, int percent) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (h->count - 1) * percent / 100 + 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) return b < 63 && (1ULL << b) < h->max_ns ? 1ULL << b : h->max_ns;
+    }
+    return h->max_ns;
+}
+
+static void format_duration(char* buf, size_t size, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    }
+}
+
+// Writes every counter and histogram as one JSON object. A histogram's
+// buckets are listed as [bound_ns, count] pairs, the non-empty ones only,
+// each counting the samples below its bound and at or above the one before.
+static void stats_write_json(FILE* out) {
+    fprintf(out, "{\"pid\":%d,\"uptime_ns\":%lld,\"counters\":{", (int)getpid(),
+            monotonic_ns() - stats_start_ns);
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        fprintf(out, "%s\"%s\":%llu", c > 0 ? "," : "", stat_counter_names[c],
+                (unsigned long long)__atomic_load_n(&stat_counters[c], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "},\"histograms\":{");
+    for (int i = 0; i < STAT_HISTOGRAMS; i++) {
+        const Histogram* h = &stat_histograms[i];
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"max_ns\":%llu,"
+                "\"p50_ns\":%llu,\"p99_ns\":%llu,\"buckets\":[",
+                i > 0 ? "," : "", stat_histogram_names[i], (unsigned long long)h->count,
+                (unsigned long long)h->sum_ns, (unsigned long long)h->max_ns,
+                (unsigned long long)histogram_percentile(h, 50),
+                (unsigned long long)histogram_percentile(h, 99));
+        bool first = true;
+        for (int b = 0; b < STAT_BUCKETS; b++) {
+            if (h->buckets[b] == 0) continue;
+            fprintf(out, "%s[%llu,%llu]", first ? "" : ",", 1ULL << b, (unsigned long long)h->buckets[b]);
+            first = false;
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}}\n");
+}
+
+// Writes the stats to path, or to $SHELLSTAT_FILE or ~/STATS_FILE when
+// path is NULL. The file is replaced whole, so a reader never sees half
+// of it.
+bool stats_dump(const char* path) {
+    char file[PATH_MAX];
+    const char* home = getenv("HOME");
+    if (path == NULL) path = variable_get("SHELLSTAT_FILE");
+    if (path != NULL && *path != '\0') {
+        snprintf(file, sizeof(file), "%s", path);
+    } else if (home != NULL) {
+        snprintf(file, sizeof(file), "%s/%s", home, STATS_FILE);
+    } else {
+        shell_error("\nshellstat: HOME not set\n");
+        return false;
+    }
+    char temp[PATH_MAX + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", file);
+    FILE* out = fopen(temp, "w");
+    if (out == NULL) {
+        shell_error("\nshellstat: %s: %s\n", temp, strerror(errno));
+        return false;
+    }
+    stats_write_json(out);
+    if (fclose(out) != 0 || rename(temp, file) != 0) {
+        shell_error("\nshellstat: %s: %s\n", file, strerror(errno));
+        unlink(temp);
+        return false;
+    }
+    return true;
+}
+
+// Writes the stats file if SIGUSR1 asked for it since the last call
+void stats_poll(void) {
+    if (!stats_requested) return;
+    stats_requested = 0;
+    stats_dump(NULL);
+}
+
+static void sigusr1_handler(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+
+// SIGUSR1 asks for the stats file, written where the shell next waits.
+// Reads and waits it interrupts carry on.
+static void stats_signal_init(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sigusr1_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void stats_reset(void) {
+    for (int c = 0; c < STAT_COUNTERS; c++) __atomic_store_n(&stat_counters[c], 0, __ATOMIC_RELAXED);
+    memset(stat_histograms, 0, sizeof(stat_histograms));
+    stats_start_ns = monotonic_ns();
+}
+
+// shellstat [-j] [-r] [-w [file]]: shows the shell's counters and latency
+// histograms, as a table or as JSON (-j), or writes the JSON to file or
+// the stats file (-w). -r then starts them all over from zero.
+int handle_shellstat(char** args) {
+    bool json = false, reset = false, write = false;
+    const char* path = NULL;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-j") == 0) {
+            json = true;
+        } else if (strcmp(args[i], "-r") == 0) {
+            reset = true;
+        } else if (strcmp(args[i], "-w") == 0) {
+            write = true;
+            if (args[i + 1] != NULL && args[i + 1][0] != '-') path = args[++i];
+        } else {
+            shell_error("\nshellstat: usage: shellstat [-j] [-r] [-w [file]]\n");
+            return 2;
+        }
+    }
+
+    int status = 0;
+    if (write && !stats_dump(path)) status = 1;
+    if (json) {
+        char* text = NULL;
+        size_t len = 0;
+        FILE* out = open_memstream(&text, &len);
+        if (out == NULL) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        stats_write_json(out);
+        fclose(out);
+        shell_print("\n%s", text);
+        free(text);
+    } else if (!write && !reset) {
+        shell_print("\n%-20s %10s\n", "counter", "count");
+        for (int c = 0; c < STAT_COUNTERS; c++) {
+            shell_print("%-20s %10llu\n", stat_counter_names[c],
+                        (unsigned long long)__atomic_load_n(&stat_counters[c], __ATOMIC_RELAXED));
+        }
+        shell_print("\n%-20s %10s %10s %10s %10s %10s\n", "latency", "count", "mean", "p50", "p99", "max");
+        for (int i = 0; i < STAT_HISTOGRAMS; i++) {
+            const Histogram* h = &stat_histograms[i];
+            char mean[32], p50[32], p99[32], max[32];
+            format_duration(mean, sizeof(mean), h->count ? h->sum_ns / h->count : 0);
+            format_duration(p50, sizeof(p50), histogram_percentile(h, 50));
+            format_duration(p99, sizeof(p99), histogram_percentile(h, 99));
+            format_duration(max, sizeof(max), h->max_ns);
+            shell_print("%-20s %10llu %10s %10s %10s %10s\n", stat_histogram_names[i],
+                        (unsigned long long)h->count, mean, p50, p99, max);
+        }
+    }
+    if (reset) stats_reset();
+    shell_flush();
+    return status;
+}
+
+// Whether path names the current directory
+static bool path_is_cwd(const char* path) {
+    struct stat a, b;
+    return stat(path, &a) == 0 && stat(".", &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// $PWD when it is an absolute name for the current directory without
+// . or .. components, as pwd -L requires; NULL otherwise
+static const char* logical_cwd(void) {
+    const char* pwd = variable_get("PWD");
+    if (pwd == NULL || pwd[0] != '/') return NULL;
+    for (const char* p = pwd; (p = strstr(p, "/.")) != NULL; p++) {
+        const char* rest = p[2] == '.' ? p + 3 : p + 2;
+        if (*rest == '\0' || *rest == '/') return NULL;
+    }
+    return path_is_cwd(pwd) ? pwd : NULL;
+}
+
+// Removes empty, . and .. components from an absolute path in place,
+// by name only: a .. drops the component before it even if that is a
+// symbolic link
+static void path_clean(char* path) {
+    char* write = path;
+    const char* read = path;
+    while (*read != '\0') {
+        while (*read == '/') read++;
+        const char* name = read;
+        while (*read != '\0' && *read != '/') read++;
+        size_t len = read - name;
+        if (len == 0 || (len == 1 && name[0] == '.')) continue;
+        if (len == 2 && name[0] == '.' && name[1] == '.') {
+            while (write > path && *--write != '/') {}
+            continue;
+        }
+        *write++ = '/';
+        memmove(write, name, len);
+        write += len;
+    }
+    if (write == path) *write++ = '/';
+    *write = '\0';
+}
+
+// cd [dir]: changes directory and keeps $PWD as the path the user went
+// through, symbolic links included, as sh does. When that path no
+// longer names the directory (a .. out of a link), $PWD is the
+// physical path instead.
+int handle_cd(char** args) {
+    char* dir = args[1];
+    if (dir == NULL) {
+        dir = getenv("HOME");
+    }
+    
+    if (dir == NULL) {
+        shell_error("\ncd: HOME not set\n");
+        return 1;
+    }
+    // Relative paths are joined to the logical directory, so it has to
+    // be taken before the change
+    char cwd[PATH_MAX];
+    const char* base = dir[0] == '/' ? "" : logical_cwd();
+    if (base == NULL) base = getcwd(cwd, sizeof(cwd));
+    if (chdir(dir) != 0) {
+        shell_error("\ncd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    invalidate_cwd_cache();
+
+    String path = {0};
+    if (base != NULL) {
+        size_t base_len = strlen(base), dir_len = strlen(dir);
+        string_reserve(&path, base_len + dir_len + 2);
+        memcpy(path.data, base, base_len);
+        path.data[base_len] = '/';
+        memcpy(path.data + base_len + 1, dir, dir_len + 1);
+        path_clean(path.data);
+        path.count = strlen(path.data);
+    }
+    if (base == NULL || !path_is_cwd(path.data)) {
+        const char* physical = getcwd(cwd, sizeof(cwd));
+        string_set(&path, physical ? physical : "", physical ? strlen(physical) : 0);
+    }
+    if (path.count > 0) variable_set("PWD", 3, path.data, true);
+    string_clear(&path);
+
+    return 0;
+}
+
+// exit [status]: leaves the shell with the given or the last exit status
+int handle_exit(char** args) {
+    shell_running = false;
+    if (args[1] == NULL) return last_status;
+    char* end;
+    errno = 0;
+    long status = strtol(args[1], &end, 10);
+    if (end == args[1] || *end != '\0' || errno == ERANGE) {
+        // Like sh, a bad status still exits, with 2
+        shell_error("\nexit: %s: numeric argument required\n", args[1]);
+        return 2;
+    }
+    return status & 0xff;
+}
+
+// In-process utilities. They take their input and output as fds, so
+// redirections work without forking.
+
+// Whether the utility can run in-process with these arguments: every
+// option must be one it implements, and under ncurses it must not need
+// to read the terminal
+static bool utility_runs_inline(const Builtin* builtin, char** args) {
+    bool operand = false;
+    bool redirected_input = false;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (fd_token_number(args[i]) >= 0) continue;
+        int kind = redirect_kind(args[i]);
+        if (kind >= 0) {
+            bool input = kind == REDIR_IN || kind == REDIR_DUP_IN || kind == REDIR_HERE_STRING ||
+                         kind == REDIR_HEREDOC || kind == REDIR_HEREDOC_TABS;
+            if (input && fd_token_number(args[i - 1]) <= 0) redirected_input = true;
+            if (args[i + 1] != NULL) i++;
+            continue;
+        }
+        if (builtin->options != NULL && args[i][0] == '-' && args[i][1] != '\0') {
+            if (strspn(args[i] + 1, builtin->options) != strlen(args[i] + 1)) return false;
+        } else {
+            operand = true;
+        }
+    }
+    return !(builtin->reads_input && interactive_mode && !operand && !redirected_input);
+}
+
+static int utility_echo(char** args, int in_fd, int out_fd) {
+    (void)in_fd;
+    bool newline = true;
+    bool escapes = false;
+    int i = 1;
+    // Like GNU echo, only words made entirely of known flags are options
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0' &&
+           strspn(args[i] + 1, "neE") == strlen(args[i] + 1); i++) {
+        for (const char* flag = args[i] + 1; *flag; flag++) {
+            if (*flag == 'n') newline = false;
+            else escapes = *flag == 'e';
+        }
+    }
+
+    String out = {0};
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first) string_append(&out, ' ');
+        for (const char* p = args[i]; *p != '\0'; p++) {
+            if (!escapes || *p != '\\' || p[1] == '\0') {
+                string_append(&out, *p);
+                continue;
+            }
+            char c = *++p;
+            switch (c) {
+                case 'a': string_append(&out, '\a'); break;
+                case 'b': string_append(&out, '\b'); break;
+                case 'e': string_append(&out, 033); break;
+                case 'f': string_append(&out, '\f'); break;
+                case 'n': string_append(&out, '\n'); break;
+                case 'r': string_append(&out, '\r'); break;
+                case 't': string_append(&out, '\t'); break;
+                case 'v': string_append(&out, '\v'); break;
+                case '\\': string_append(&out, '\\'); break;
+                case 'c':  // Stop output here
+                    emit_output(out_fd, out.data, out.count);
+                    string_clear(&out);
+                    return 0;
+                case '0':
+                case 'x': {
+                    int value = 0, digits = 0;
+                    int max_digits = c == '0' ? 3 : 2;
+                    while (digits < max_digits &&
+                           (c == '0' ? (p[1] >= '0' && p[1] <= '7') : isxdigit((unsigned char)p[1]))) {
+                        char d = *++p;
+                        value = value * (c == '0' ? 8 : 16) +
+                                (isdigit((unsigned char)d) ? d - '0' : tolower((unsigned char)d) - 'a' + 10);
+                        digits++;
+                    }
+                    if (c == 'x' && digits == 0) {
+                        string_append(&out, '\\');
+                        string_append(&out, 'x');
+                    } else {
+                        string_append(&out, (char)value);
+                    }
+                    break;
+                }
+                default:
+                    string_append(&out, '\\');
+                    string_append(&out, c);
+                    break;
+            }
+        }
+    }
+    if (newline) string_append(&out, '\n');
+    emit_output(out_fd, out.data, out.count);
+    string_clear(&out);
+    return 0;
+}
+
+// pwd [-L|-P]: prints $PWD when it names the current directory (-L, the
+// default) or the path with symbolic links resolved (-P)
+static int utility_pwd(char** args, int in_fd, int out_fd) {
+    (void)in_fd;
+    bool logical = true;
+    for (int i = 1; args[i] != NULL; i++) {
+        for (const char* flag = args[i] + 1; args[i][0] == '-' && *flag; flag++) logical = *flag == 'L';
+    }
+    char cwd[PATH_MAX + 1];
+    const char* pwd = logical ? logical_cwd() : NULL;
+    if (pwd != NULL && strlen(pwd) < PATH_MAX) {
+        strcpy(cwd, pwd);
+    } else if (getcwd(cwd, PATH_MAX) == NULL) {
+        shell_error("\npwd: %s\n", strerror(errno));
+        return 1;
+    }
+    size_t len = strlen(cwd);
+    cwd[len++] = '\n';
+    emit_output(out_fd, cwd, len);
+    return 0;
+}
+
+static int utility_true(char** args, int in_fd, int out_fd) {
+    (void)args;
+    (void)in_fd;
+    (void)out_fd;
+    return 0;
+}
+
+static int utility_false(char** args, int in_fd, int out_fd) {
+    (void)args;
+    (void)in_fd;
+    (void)out_fd;
+    return 1;
+}
+
+// Copies in_fd to out_fd. The data stays in the kernel where the fd types
+// allow: copy_file_range() between regular files, sendfile() from a
+// regular file and splice() when a pipe is involved, falling back in that
+// order when a call is refused. The terminal under ncurses is fed through
+// the scrollback instead. Returns 0 or an errno value.
+static int copy_fd(int in_fd, int out_fd) {
+    static char buf[OUTPUT_READ_SIZE];
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) return errno;
+    // Files in /proc and /sys claim a size of 0 and only work with read()
+    bool in_file = S_ISREG(in_st.st_mode) && in_st.st_size > 0;
+    int method = in_file && S_ISREG(out_st.st_mode) ? 0
+               : in_file ? 1
+               : S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode) ? 2 : 3;
+    if (fd_is_screen(out_fd)) method = 3;
+
+    while (true) {
+        ssize_t n;
+        if (method == 0) {
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+        } else if (method == 1) {
+            n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+        } else if (method == 2) {
+            n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE);
+        } else {
+            n = read(in_fd, buf, sizeof(buf));
+            if (n > 0) emit_output(out_fd, buf, n);
+        }
+        if (n > 0) continue;
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        if (method < 3 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                           errno == EBADF || errno == EOPNOTSUPP)) {
+            method = method == 0 ? 1 : 3;  // splice() needs a pipe, which a refused sendfile() lacks
+            if (method == 1 && !in_file) method = 3;
+            continue;
+        }
+        return errno;
+    }
+}
+
+static int utility_cat(char** args, int in_fd, int out_fd) {
+    // Anything buffered for stdout must land before the copied data
+    if (out_fd == STDOUT_FILENO && !interactive_mode) fflush(stdout);
+    int status = 0;
+    int files = 0;
+    for (int i = 1; args[i] != NULL || files == 0; i++) {
+        // No operands means standard input; -u changes nothing, since
+        // nothing is buffered
+        const char* name = args[i] != NULL ? args[i] : "-";
+        if (args[i] != NULL && name[0] == '-' && name[1] != '\0') continue;
+        files++;
+        bool from_stdin = strcmp(name, "-") == 0;
+        int fd = from_stdin ? in_fd : open(name, O_RDONLY | O_CLOEXEC);
+        int err = fd == -1 ? errno : copy_fd(fd, out_fd);
+        if (!from_stdin && fd != -1) close(fd);
+        if (err == EPIPE) return 1;  // The reader is gone; stop quietly
+        if (err != 0) {
+            shell_error("\ncat: %s: %s\n", name, strerror(err));
+            status = 1;
+        }
+        if (args[i] == NULL) break;
+    }
+    return status;
+}
+
+static int compare_collated(const void* a, const void* b) {
+    return strcoll(*(char* const*)a, *(char* const*)b);
+}
+
+// Appends names to out in columns that fit the screen, ordered down each
+// column as ls does
+static void append_columns(String* out, char* const* names, size_t count) {
+    size_t width = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(names[i]);
+        if (len > width) width = len;
+    }
+    width += 2;
+    size_t columns = (size_t)COLS > width ? (size_t)COLS / width : 1;
+    size_t rows = (count + columns - 1) / columns;
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t col = 0; col < columns; col++) {
+            size_t i = col * rows + r;
+            if (i >= count) break;
+            size_t len = strlen(names[i]);
+            string_reserve(out, out->count + width + 1);
+            memcpy(out->data + out->count, names[i], len);
+            out->count += len;
+            if (col + 1 < columns && i + rows < count) {
+                memset(out->data + out->count, ' ', width - len);
+                out->count += width - len;
+            }
+        }
+        string_append(out, '\n');
+    }
+}
+
+// Lists one directory into out, sorted by the locale's collation like ls
+static int ls_directory(const char* path, bool all, bool almost_all, bool columns, String* out) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        shell_error("\nls: cannot open directory '%s': %s\n", path, strerror(errno));
+        return 2;
+    }
+    String blob = {0};
+    size_t* offsets = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        bool dots = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+        if (name[0] == '.' && !all && !(almost_all && !dots)) continue;
+        if (count == capacity) {
+            capacity = capacity == 0 ? DATA_START_CAPACITY : capacity * 2;
+            size_t* grown = realloc(offsets, capacity * sizeof(size_t));
+            if (!grown) {
+                endwin();
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+            offsets = grown;
+        }
+        size_t len = strlen(name) + 1;
+        string_reserve(&blob, blob.count + len);
+        offsets[count++] = blob.count;
+        memcpy(blob.data + blob.count, name, len);
+        blob.count += len;
+    }
+    closedir(dir);
+
+    char** names = malloc((count + 1) * sizeof(char*));
+    if (!names) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) names[i] = blob.data + offsets[i];
+    qsort(names, count, sizeof(char*), compare_collated);
+    if (columns) {
+        append_columns(out, names, count);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            size_t len = strlen(names[i]);
+            string_reserve(out, out->count + len + 1);
+            memcpy(out->data + out->count, names[i], len);
+            out->count += len;
+            out->data[out->count++] = '\n';
+        }
+    }
+    free(names);
+    free(offsets);
+    string_clear(&blob);
+    return 0;
+}
+
+// ls [-1aA] [path...]: plain listings only; other options run the real ls
+static int utility_ls(char** args, int in_fd, int out_fd) {
+    (void)in_fd;
+    bool all = false, almost_all = false;
+    // Columns only on the screen, one name per line into files and pipes
+    bool columns = fd_is_screen(out_fd);
+    int operands = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] != '-' || args[i][1] == '\0') {
+            operands++;
+            continue;
+        }
+        for (const char* flag = args[i] + 1; *flag; flag++) {
+            if (*flag == 'a') all = true;
+            if (*flag == 'A') almost_all = true;
+            if (*flag == '1') columns = false;
+        }
+    }
+
+    int status = 0;
+    String out = {0};
+    // Files first, then each directory under a heading when there are several
+    char** dirs = arena_alloc(&command_arena, (operands + 1) * sizeof(char*));
+    char** files = arena_alloc(&command_arena, (operands + 1) * sizeof(char*));
+    size_t dir_count = 0, file_count = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') continue;
+        struct stat st;
+        if (stat(args[i], &st) == -1) {
+            shell_error("\nls: cannot access '%s': %s\n", args[i], strerror(errno));
+            status = 2;
+        } else if (S_ISDIR(st.st_mode)) {
+            dirs[dir_count++] = args[i];
+        } else {
+            files[file_count++] = args[i];
+        }
+    }
+    if (operands == 0) dirs[dir_count++] = ".";
+    qsort(files, file_count, sizeof(char*), compare_collated);
+    qsort(dirs, dir_count, sizeof(char*), compare_collated);
+
+    if (columns) {
+        append_columns(&out, files, file_count);
+    } else {
+        for (size_t i = 0; i < file_count; i++) {
+            for (const char* p = files[i]; *p; p++) string_append(&out, *p);
+            string_append(&out, '\n');
+        }
+    }
+    for (size_t i = 0; i < dir_count; i++) {
+        bool heading = operands > 1;
+        if (heading) {
+            if (out.count > 0) string_append(&out, '\n');
+            for (const char* p = dirs[i]; *p; p++) string_append(&out, *p);
+            string_append(&out, ':');
+            string_append(&out, '\n');
+        }
+        int dir_status = ls_directory(dirs[i], all, almost_all, columns, &out);
+        if (dir_status > status) status = dir_status;
+    }
+    if (out.count > 0) emit_output(out_fd, out.data, out.count);
+    string_clear(&out);
+    return status;
+}
+
+// Expression evaluator for test and [. Errors set *error and make the
+// command exit with status 2.
+typedef struct {
+    char** args;
+    int count;
+    int pos;
+    const char* error;
+} TestParser;
+
+static bool test_integer(TestParser* p, const char* text, long long* value) {
+    char* end;
+    errno = 0;
+    while (isspace((unsigned char)*text)) text++;
+    *value = strtoll(text, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (*text == '\0' || *end != '\0' || errno != 0) {
+        p->error = "integer expression expected";
+        return false;
+    }
+    return true;
+}
+
+static bool test_is_binary(const char* op) {
+    static const char* const ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL
+    };
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) return true;
+    }
+    return false;
+}
+
+static bool test_unary(TestParser* p, const char* op, const char* arg) {
+    struct stat st;
+    char flag = op[1];
+    if (flag == 'z') return arg[0] == '\0';
+    if (flag == 'n') return arg[0] != '\0';
+    if (flag == 't') {
+        long long fd;
+        return test_integer(p, arg, &fd) && isatty((int)fd);
+    }
+    if (flag == 'h' || flag == 'L') return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    if (flag == 'r') return access(arg, R_OK) == 0;
+    if (flag == 'w') return access(arg, W_OK) == 0;
+    if (flag == 'x') return access(arg, X_OK) == 0;
+    if (stat(arg, &st) == -1) return false;
+    switch (flag) {
+        case 'e': return true;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+        default: return false;
+    }
+}
+
+static bool test_is_unary(const char* op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("zntLhrwxefdbcpSsugkOG", op[1]);
+}
+
+static bool test_binary(TestParser* p, const char* left, const char* op, const char* right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0;
+    if (strcmp(op, "<") == 0) return strcoll(left, right) < 0;
+    if (strcmp(op, ">") == 0) return strcoll(left, right) > 0;
+    if (op[1] == 'n' || op[1] == 'o' || strcmp(op, "-ef") == 0) {
+        struct stat a, b;
+        bool have_a = stat(left, &a) == 0;
+        bool have_b = stat(right, &b) == 0;
+        if (op[1] == 'e') return have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        bool newer = have_a && (!have_b || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                                (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+        bool older = have_b && (!have_a || a.st_mtim.tv_sec < b.st_mtim.tv_sec ||
+                                (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec < b.st_mtim.tv_nsec));
+        return op[1] == 'n' ? newer : older;
+    }
+    long long a, b;
+    if (!test_integer(p, left, &a) || !test_integer(p, right, &b)) return false;
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+static bool test_or(TestParser* p);
+
+static bool test_primary(TestParser* p) {
+    if (p->pos >= p->count) {
+        p->error = "argument expected";
+        return false;
+    }
+    char** a = p->args + p->pos;
+    int left = p->count - p->pos;
+    if (left >= 3 && test_is_binary(a[1])) {
+        p->pos += 3;
+        return test_binary(p, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "!") == 0) {
+        p->pos++;
+        return !test_primary(p);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        p->pos++;
+        bool value = test_or(p);
+        if (p->pos >= p->count || strcmp(p->args[p->pos], ")") != 0) {
+            if (p->error == NULL) p->error = "')' expected";
+            return false;
+        }
+        p->pos++;
+        return value;
+    }
+    if (left >= 2 && test_is_unary(a[0])) {
+        p->pos += 2;
+        return test_unary(p, a[0], a[1]);
+    }
+    p->pos++;
+    return a[0][0] != '\0';
+}
+
+static bool test_and(TestParser* p) {
+    bool value = test_primary(p);
+    while (p->pos < p->count && strcmp(p->args[p->pos], "-a") == 0) {
+        p->pos++;
+        value = test_primary(p) && value;
+    }
+    return value;
+}
+
+static bool test_or(TestParser* p) {
+    bool value = test_and(p);
+    while (p->pos < p->count && strcmp(p->args[p->pos], "-o") == 0) {
+        p->pos++;
+        value = test_and(p) || value;
+    }
+    return value;
+}
+
+static int utility_test(char** args, int in_fd, int out_fd) {
+    (void)in_fd;
+    (void)out_fd;
+    int count = 0;
+    while (args[count + 1] != NULL) count++;
+    if (strcmp(args[0], "[") == 0) {
+        if (count == 0 || strcmp(args[count], "]") != 0) {
+            shell_error("\n[: missing `]'\n");
+            return 2;
+        }
+        count--;
+    }
+    if (count == 0) return 1;
+
+    TestParser p = {.args = args + 1, .count = count};
+    bool value = test_or(&p);
+    if (p.error == NULL && p.pos < p.count) p.error = "too many arguments";
+    if (p.error != NULL) {
+        shell_error("\n%s: %s\n", args[0], p.error);
+        return 2;
+    }
+    return value ? 0 : 1;
+}
+
+// Runs an in-process utility with its redirections and reports the
+// shell's own resource usage for it
+static int run_utility(const Builtin* builtin, char** args, CommandStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    struct rusage before, after;
+    getrusage(RUSAGE_THREAD, &before);
+    long long start = monotonic_ns();
+
+    Redirections io;
+    redirections_init(&io, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    int status = 1;
+    if (handle_io_redirection(args, &io) == 0) {
+        error_fd = io.fds[STDERR_FILENO];
+        status = builtin->utility(args, io.fds[STDIN_FILENO], io.fds[STDOUT_FILENO]);
+        error_fd = STDERR_FILENO;
+    }
+    redirections_close(&io);
+    shell_flush();
+
+    stats->wall_ns = monotonic_ns() - start;
+    getrusage(RUSAGE_THREAD, &after);
+    timersub(&after.ru_utime, &before.ru_utime, &stats->utime);
+    timersub(&after.ru_stime, &before.ru_stime, &stats->stime);
+    stats->maxrss_kb = after.ru_maxrss;
+    stats->voluntary_ctxsw = after.ru_nvcsw - before.ru_nvcsw;
+    stats->involuntary_ctxsw = after.ru_nivcsw - before.ru_nivcsw;
+    return status;
+}
+
+static int handle_help(char** args) {
+    (void)args;
+    execute_help_command();
+    return 0;
+}
+
+// Every builtin, sorted by name for bsearch(). Shell builtins act on the
+// shell itself and always run here. Utilities also exist as programs;
+// they run in-process when they are the whole foreground command and
+// otherwise (in a pipeline, with "&", or with an option not listed in
+// options) the program on $PATH runs instead.
+static const Builtin builtins[] = {
+    {"[", NULL, utility_test, NULL, false},
+    {"bg", handle_bg, NULL, NULL, false},
+    {"cat", NULL, utility_cat, "u", true},
+    {"cd", handle_cd, NULL, NULL, false},
+    {"echo", NULL, utility_echo, NULL, false},
+    {"exit", handle_exit, NULL, NULL, false},
+    {"export", handle_export, NULL, NULL, false},
+    {"false", NULL, utility_false, NULL, false},
+    {"fg", handle_fg, NULL, NULL, false},
+    {"hash", handle_hash, NULL, NULL, false},
+    {"help", handle_help, NULL, NULL, false},
+    {"jobs", handle_jobs, NULL, NULL, false},
+    {"ls", NULL, utility_ls, "1aA", false},
+    {"parallel", handle_parallel, NULL, NULL, false},
+    {"pwd", NULL, utility_pwd, "LP", false},
+    {"scrollback", handle_scrollback, NULL, NULL, false},
+    {"shellstat", handle_shellstat, NULL, NULL, false},
+    {"test", NULL, utility_test, NULL, false},
+    {"time", handle_time, NULL, NULL, false},
+    {"timeout", handle_timeout, NULL, NULL, false},
+    {"timing", handle_timing, NULL, NULL, false},
+    {"true", NULL, utility_true, NULL, false},
+    {"ulimit", handle_ulimit, NULL, NULL, false},
+    {"unset", handle_unset, NULL, NULL, false},
+    {"wait", handle_wait, NULL, NULL, false},
+};
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+
+static int compare_builtin(const void* key, const void* entry) {
+    return strcmp(key, ((const Builtin*)entry)->name);
+}
+
+const Builtin* builtin_find(const char* name) {
+    return bsearch(name, builtins, BUILTIN_COUNT, sizeof(Builtin), compare_builtin);
+}
+
+// Runs one command that is not a shell builtin: an in-process utility
+// when builtin is one and qualifies, a child process otherwise. A command
+// under a timeout or ulimit always gets a child, since only a child can
+// be stopped at its deadline or limited without limiting the shell.
+static int run_resolved(char** args, const Builtin* builtin, CommandStats* stats, bool background) {
+    bool pipeline = false;
+    for (int i = 0; args[i] != NULL && !pipeline; i++) pipeline = args[i] == pipe_token;
+    bool constrained = command_timeout.duration_ns > 0 || command_limits_set != 0;
+    if (builtin != NULL && builtin->utility != NULL && !background && !pipeline && !constrained &&
+        utility_runs_inline(builtin, args)) {
+        return run_utility(builtin, args, stats);
+    }
+    return _command(args, stats, background);
+}
+
+int run_command(char** args, CommandStats* stats, bool background) {
+    return run_resolved(args, builtin_find(args[0]), stats, background);
+}
+
+// Runs one parsed command, builtins first, and returns its exit status.
+// builtin is what args[0] names, looked up when the line was compiled.
+// Shell builtins always run in the shell itself, even when followed by "&".
+int execute_command(char** args, const Builtin* builtin, bool background) {
+    if (args[0] == NULL) return last_status;
+    if (builtin != NULL && builtin->handler != NULL) {
+        command_background = background;
+        int status = builtin->handler(args);
+        command_background = false;
+        return status;
+    }
+
+    CommandStats stats;
+    int status = run_resolved(args, builtin, &stats, background);
+    if (report_timing) print_command_stats(&stats);
+    return status;
+}
+
+// Lines of run_lines() text not yet run, where here-document bodies
+// come from
+static char* lines_rest = NULL;
+static FILE* batch_input = NULL;
+
+static bool read_rest_line(String* line) {
+    if (lines_rest == NULL || *lines_rest == '\0') return false;
+    char* newline = strchr(lines_rest, '\n');
+    size_t len = newline ? (size_t)(newline - lines_rest) : strlen(lines_rest);
+    string_set(line, lines_rest, len);
+    lines_rest = newline ? newline + 1 : NULL;
+    return true;
+}
+
+static bool read_batch_line(String* line) {
+    char* text = NULL;
+    size_t capacity = 0;
+    ssize_t len = getline(&text, &capacity, batch_input);
+    if (len > 0 && text[len - 1] == '\n') len--;
+    if (len >= 0) string_set(line, text, len);
+    free(text);
+    return len >= 0;
+}
+
+// Whether line, less its leading tabs for <<-, is the delimiter
+static bool heredoc_ends(const char* line, size_t len, const char* delimiter, bool strip_tabs) {
+    if (strip_tabs) {
+        while (len > 0 && *line == '\t') {
+            line++;
+            len--;
+        }
+    }
+    return len == strlen(delimiter) && memcmp(line, delimiter, len) == 0;
+}
+
+// Reads lines up to the one holding only delimiter and returns them as
+// one string in the command arena
+static char* heredoc_read(const char* delimiter, bool strip_tabs) {
+    String body = {0};
+    String line = {0};
+    bool ended = false;
+    while (heredoc_reader != NULL && heredoc_reader(&line)) {
+        const char* text = line.data ? line.data : "";
+        if ((ended = heredoc_ends(text, line.count, delimiter, strip_tabs))) break;
+        size_t skip = 0;
+        while (strip_tabs && skip < line.count && text[skip] == '\t') skip++;
+        for (size_t i = skip; i < line.count; i++) string_append(&body, text[i]);
+        string_append(&body, '\n');
+    }
+    if (!ended) {
+        shell_error("\nwarning: here-document delimited by end-of-file (wanted `%s')\n", delimiter);
+    }
+
+    char* copy = arena_alloc(&command_arena, body.count + 1);
+    if (body.count > 0) memcpy(copy, body.data, body.count);
+    copy[body.count] = '\0';
+    string_clear(&body);
+    string_clear(&line);
+    return copy;
+}
+
+// Replaces the delimiter after each "<<" in args with the body of its
+// here-document, read from the input that follows the line. A body to be
+// expanded is marked with HEREDOC_EXPAND.
+static void read_heredocs(char** args) {
+    for (int i = 0; args[i] != NULL; i++) {
+        int kind = redirect_kind(args[i]);
+        if (kind != REDIR_HEREDOC && kind != REDIR_HEREDOC_TABS) continue;
+        if (args[i + 1] == NULL || is_operator_token(args[i + 1])) continue;
+        const char* delimiter = args[i + 1];
+        bool quoted = delimiter[0] == HEREDOC_QUOTED;
+        char* body = heredoc_read(delimiter + quoted, kind == REDIR_HEREDOC_TABS);
+        if (!quoted) {
+            size_t len = strlen(body);
+            char* marked = arena_alloc(&command_arena, len + 2);
+            marked[0] = HEREDOC_EXPAND;
+            memcpy(marked + 1, body, len + 1);
+            body = marked;
+        }
+        args[i + 1] = body;
+        i++;
+    }
+}
+
+// Whether text, one or more lines typed at the prompt, ends inside a
+// here-document, so ENTER should add a line rather than run it
+bool heredoc_pending(const char* text) {
+    Arena arena = {0};
+    String line = {0};
+    bool pending = false;
+    const char* next = text;
+    while (next != NULL && *next != '\0' && !pending) {
+        const char* newline = strchr(next, '\n');
+        string_set(&line, next, newline ? (size_t)(newline - next) : strlen(next));
+        next = newline ? newline + 1 : NULL;
+
+        char** args = parse_command(line.data, &arena);
+        for (int i = 0; args[i] != NULL && !pending; i++) {
+            int kind = redirect_kind(args[i]);
+            if (kind != REDIR_HEREDOC && kind != REDIR_HEREDOC_TABS) continue;
+            if (args[i + 1] == NULL || is_operator_token(args[i + 1])) continue;
+            const char* delimiter = args[++i];
+            if (delimiter[0] == HEREDOC_QUOTED) delimiter++;
+            pending = true;
+            // The body runs up to the delimiter's line
+            while (next != NULL && *next != '\0' && pending) {
+                newline = strchr(next, '\n');
+                size_t len = newline ? (size_t)(newline - next) : strlen(next);
+                pending = !heredoc_ends(next, len, delimiter, kind == REDIR_HEREDOC_TABS);
+                next = newline ? newline + 1 : NULL;
+            }
+        }
+    }
+    string_clear(&line);
+    arena_free(&arena);
+    return pending;
+}
+
+// Command plans
+
+// Recursive-descent parser from parse_command() tokens to plan nodes:
+//   list     := and_or ((";" | "&") and_or)* [";" | "&"]
+//   and_or   := pipeline (("&&" | "||") pipeline)*
+//   pipeline := stage ("|" stage)*
+//   stage    := word... | "(" list ")" [redirection...]
+// Tokens are copied to out as they are consumed and node ranges index
+// out, so a compound list ended by "&" can be wrapped in "(" ")" there.
+typedef struct {
+    char** in;
+    size_t pos;
+    char** out;
+    int out_count;
+    PlanNode* nodes;
+    int node_count;
+    bool failed;
+} PlanParser;
+
+static int plan_error(PlanParser* p) {
+    if (!p->failed) {
+        const char* token = p->in[p->pos];
+        if (token == NULL) {
+            shell_error("\nSyntax error: unexpected end of line\n");
+        } else {
+            shell_error("\nSyntax error near unexpected token `%s'\n", token);
+        }
+    }
+    p->failed = true;
+    return -1;
+}
+
+static void plan_take(PlanParser* p) {
+    p->out[p->out_count++] = p->in[p->pos++];
+}
+
+static int plan_node(PlanParser* p, NodeKind kind, int left, int right) {
+    PlanNode* node = &p->nodes[p->node_count];
+    *node = (PlanNode){.kind = kind, .left = left, .right = right, .start = -1, .end = -1};
+    return p->node_count++;
+}
+
+static int plan_list(PlanParser* p, int depth);
+
+// Whether ch is a mark parse_command() leaves where an expansion starts
+static bool is_mark(char ch) {
+    return (ch >= SUBST_COMMAND && ch <= SUBST_VARIABLE_QUOTED && ch != SUBST_END) ||
+           ch == GLOB_STAR || ch == GLOB_ANY || ch == GLOB_CLASS;
+}
+
+// Whether word needs expand_words() before it can be run
+static bool word_expands(const char* word) {
+    for (; *word != '\0'; word++) {
+        if (is_mark(*word)) return true;
+    }
+    return false;
+}
+
+static int plan_pipeline(PlanParser* p, int depth) {
+    int start = p->out_count;
+    bool expands = false;
+    while (true) {
+        if (p->in[p->pos] == lparen_token) {
+            int open = p->out_count;
+            plan_take(p);
+            int body = plan_list(p, depth + 1);
+            if (body < 0 || p->in[p->pos] != rparen_token) return plan_error(p);
+            plan_take(p);
+            int group = plan_node(p, NODE_GROUP, body, -1);
+            p->nodes[group].start = open;
+            p->nodes[group].end = p->out_count;
+            // Only redirections may follow the ")"
+            while (p->in[p->pos] != NULL && !is_control_token(p->in[p->pos])) {
+                if (fd_token_number(p->in[p->pos]) >= 0) plan_take(p);
+                if (redirect_kind(p->in[p->pos]) < 0) return plan_error(p);
+                plan_take(p);
+                if (p->in[p->pos] == NULL || is_operator_token(p->in[p->pos])) return plan_error(p);
+                expands |= word_expands(p->in[p->pos]);
+                plan_take(p);
+            }
+        } else {
+            int words = 0;
+            for (; p->in[p->pos] != NULL && !is_control_token(p->in[p->pos]); words++) {
+                // Assignments before the command are taken out by expansion
+                expands |= word_expands(p->in[p->pos]) || (words == 0 && is_assignment(p->in[p->pos]));
+                plan_take(p);
+            }
+            if (words == 0) return plan_error(p);
+        }
+        if (p->in[p->pos] != pipe_token) break;
+        plan_take(p);
+    }
+    int node = plan_node(p, NODE_COMMAND, -1, -1);
+    p->nodes[node].start = start;
+    p->nodes[node].end = p->out_count;
+    const char* first = p->out[start];
+    p->nodes[node].builtin = is_operator_token(first) ? NULL : builtin_find(first);
+    p->nodes[node].expands = expands;
+    return node;
+}
+
+static int plan_and_or(PlanParser* p, int depth) {
+    int left = plan_pipeline(p, depth);
+    while (left >= 0 && (p->in[p->pos] == and_token || p->in[p->pos] == or_token)) {
+        NodeKind kind = p->in[p->pos] == and_token ? NODE_AND : NODE_OR;
+        plan_take(p);
+        int right = plan_pipeline(p, depth);
+        if (right < 0) return -1;
+        left = plan_node(p, kind, left, right);
+    }
+    return left;
+}
+
+// Turns the compound list in out[mark, out_count), whose nodes start at
+// first_node, into the single command "(" list ")", so that "a && b &"
+// runs in the background as a whole, in a forked shell as bash does it
+static int plan_wrap(PlanParser* p, int item, int mark, int first_node) {
+    memmove(&p->out[mark + 1], &p->out[mark], (p->out_count - mark) * sizeof(char*));
+    p->out[mark] = lparen_token;
+    p->out_count++;
+    for (int n = first_node; n < p->node_count; n++) {
+        if (p->nodes[n].start < 0) continue;
+        p->nodes[n].start++;
+        p->nodes[n].end++;
+    }
+    p->out[p->out_count++] = rparen_token;
+    int group = plan_node(p, NODE_GROUP, item, -1);
+    p->nodes[group].start = mark;
+    p->nodes[group].end = p->out_count;
+    int command = plan_node(p, NODE_COMMAND, -1, -1);
+    p->nodes[command].start = mark;
+    p->nodes[command].end = p->out_count;
+    return command;
+}
+
+// Returns the root node of the list, or -1 when it is empty or wrong
+static int plan_list(PlanParser* p, int depth) {
+    int list = -1;
+    while (p->in[p->pos] != NULL && !(depth > 0 && p->in[p->pos] == rparen_token)) {
+        int mark = p->out_count;
+        int first_node = p->node_count;
+        int item = plan_and_or(p, depth);
+        if (item < 0) return -1;
+        const char* separator = p->in[p->pos];
+        if (separator == amp_token) {
+            if (p->nodes[item].kind != NODE_COMMAND) item = plan_wrap(p, item, mark, first_node);
+            p->nodes[item].background = true;
+        }
+        list = list < 0 ? item : plan_node(p, NODE_SEQUENCE, list, item);
+        if (separator != amp_token && separator != semi_token) break;
+        plan_take(p);
+    }
+    return list;
+}
+
+// Returns the compiled plan for line, from the cache when the same text
+// ran recently, so recalled history lines and repeated script lines skip
+// tokenizing and parsing. A miss replaces the least recently used plan.
+// Returns NULL after reporting a syntax error.
+const Plan* plan_get(const char* line) {
+    size_t len = strlen(line);
+    size_t hash = hash_string(line);
+    Plan* slot = &plan_cache[0];
+    for (int i = 0; i < PLAN_CACHE_SLOTS; i++) {
+        Plan* plan = &plan_cache[i];
+        if (plan->text != NULL && plan->hash == hash && plan->len == len &&
+            memcmp(plan->text, line, len) == 0) {
+            plan->used = ++plan_cache_clock;
+            return plan;
+        }
+        if (plan->used < slot->used) slot = plan;
+    }
+
+    char* text = malloc(2 * (len + 1));
+    if (!text) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(text, line, len + 1);
+    memcpy(text + len + 1, line, len + 1);
+
+    // Wrapping adds two tokens per "&", and every node but a wrapper
+    // consumes a token of its own
+    PlanParser p = {.in = parse_command(text + len + 1, &command_arena)};
+    size_t count = 0;
+    while (p.in[count] != NULL) count++;
+    p.out = arena_alloc(&command_arena, (3 * count + 1) * sizeof(char*));
+    p.nodes = arena_alloc(&command_arena, (3 * count + 1) * sizeof(PlanNode));
+    int root = plan_list(&p, 0);
+    if (root < 0 || p.in[p.pos] != NULL) plan_error(&p);
+    if (p.failed) {
+        free(text);
+        return NULL;
+    }
+
+    size_t tokens_size = (p.out_count + 1) * sizeof(char*);
+    char* block = malloc(tokens_size + p.node_count * sizeof(PlanNode));
+    if (!block) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    free(slot->text);
+    free(slot->tokens);
+    slot->text = text;
+    slot->words = text + len + 1;
+    slot->len = len;
+    slot->hash = hash;
+    slot->tokens = (char**)block;
+    memcpy(slot->tokens, p.out, p.out_count * sizeof(char*));
+    slot->tokens[p.out_count] = NULL;
+    slot->token_count = p.out_count;
+    slot->nodes = (PlanNode*)(block + tokens_size);
+    memcpy(slot->nodes, p.nodes, p.node_count * sizeof(PlanNode));
+    slot->node_count = p.node_count;
+    slot->root = root;
+    slot->used = ++plan_cache_clock;
+    return slot;
+}
+
+// Command and process substitution
+
+// Runs text in this forked child, as a shell of its own with the given
+// stdin, stdout and stderr, and exits with its status
+static void substitution_run(const char* text, int in_fd, int out_fd, int err_fd) {
+    Redirections io;
+    redirections_init(&io, in_fd, out_fd, err_fd);
+    child_prepare(&io, -1);
+    subshell_enter();
+    // Every line run resets the command arena the text is in
+    char* copy = strdup(text);
+    int status = copy != NULL ? run_lines(copy) : 1;
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+// Runs the $(...) text and appends its output, less trailing newlines, to
+// out. The output is read from a pipe into out as it is produced, so it
+// needs no temporary file and has no size limit. In interactive mode the
+// command reads nothing from the terminal and its errors go to the
+// scrollback. Returns its exit status.
+static int substitute_command(const char* text, String* out) {
+    int out_pipe[2];
+    int err_pipe[2] = {-1, -1};
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        shell_error("\nPipe failed: %s\n", strerror(errno));
+        return 1;
+    }
+    if (interactive_mode && pipe2(err_pipe, O_CLOEXEC) == -1) {
+        shell_error("\nPipe failed: %s\n", strerror(errno));
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return 1;
+    }
+    int in_fd = interactive_mode ? open("/dev/null", O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+
+    shell_flush();
+    pid_t pid = fork();
+    if (pid == 0) substitution_run(text, in_fd, out_pipe[1], interactive_mode ? err_pipe[1] : STDERR_FILENO);
+    close(out_pipe[1]);
+    if (err_pipe[1] != -1) close(err_pipe[1]);
+    if (in_fd > STDIN_FILENO) close(in_fd);
+    if (pid == -1) {
+        shell_error("\nFork failed: %s\n", strerror(errno));
+        close(out_pipe[0]);
+        if (err_pipe[0] != -1) close(err_pipe[0]);
+        return 1;
+    }
+
+    size_t start = out->count;
+    struct pollfd fds[2] = {{.fd = out_pipe[0], .events = POLLIN}, {.fd = err_pipe[0], .events = POLLIN}};
+    while (fds[0].fd != -1 || fds[1].fd != -1) {
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) break;
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd == -1 || fds[i].revents == 0) continue;
+            ssize_t n;
+            if (i == 0) {
+                string_reserve(out, out->count + OUTPUT_READ_SIZE);
+                n = read(fds[i].fd, out->data + out->count, OUTPUT_READ_SIZE);
+                if (n > 0) out->count += n;
+            } else {
+                char buf[4096];
+                n = read(fds[i].fd, buf, sizeof(buf));
+                if (n > 0) output_feed(buf, n);
+            }
+            if (n == 0 || (n == -1 && errno != EINTR)) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fds[i].fd != -1) close(fds[i].fd);
+    }
+    if (err_pipe[0] != -1) output_render();
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {}
+    while (out->count > start && out->data[out->count - 1] == '\n') out->count--;
+    return exit_status_of(status);
+}
+
+// Starts the <(...) or >(...) text on a pipe and returns the shell's end
+// of it, moved above the fds redirections name, or -1. A >(...) of a
+// foreground command is waited for once the command is over, since its
+// output may still be on the way. The others finish on their own in a
+// grandchild, which is nobody's to reap, as bash leaves them.
+static int substitute_process(const char* text, bool input, bool background) {
+    if (substitution_count == SUBST_MAX) {
+        shell_error("\nToo many process substitutions\n");
+        return -1;
+    }
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        shell_error("\nPipe failed: %s\n", strerror(errno));
+        return -1;
+    }
+    int keep = input ? pipe_fds[0] : pipe_fds[1];
+    int give = input ? pipe_fds[1] : pipe_fds[0];
+    if (keep < REDIRECT_FDS) {
+        int moved = fcntl(keep, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+        close(keep);
+        keep = moved;
+    }
+    if (keep == -1) {
+        shell_error("\nRedirection failed: %s\n", strerror(errno));
+        close(give);
+        return -1;
+    }
+
+    // In interactive mode it must not read the terminal or draw under
+    // ncurses
+    int screen[2] = {-1, -1};
+    int null_fd = -1;
+    if (interactive_mode) {
+        if (pipe2(screen, O_CLOEXEC) == -1) screen[0] = screen[1] = -1;
+        if (input) null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    int in_fd = input ? (interactive_mode ? null_fd : STDIN_FILENO) : give;
+    int out_fd = !input ? (screen[1] != -1 ? screen[1] : STDOUT_FILENO) : give;
+    int err_fd = screen[1] != -1 ? screen[1] : STDERR_FILENO;
+    bool detach = input || background;
+
+    shell_flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (detach) {
+            pid_t worker = fork();
+            if (worker != 0) _exit(worker == -1 ? 1 : 0);
+        }
+        substitution_run(text, in_fd, out_fd, err_fd);
+    }
+    close(give);
+    if (screen[1] != -1) close(screen[1]);
+    if (null_fd != -1) close(null_fd);
+    if (pid == -1) {
+        shell_error("\nFork failed: %s\n", strerror(errno));
+        close(keep);
+        if (screen[0] != -1) close(screen[0]);
+        return -1;
+    }
+    if (detach) {
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {}
+        pid = 0;
+    }
+    substitutions[substitution_count++] = (Substitution){.pid = pid, .fd = keep, .output = screen[0]};
+    return keep;
+}
+
+// Ends the process substitutions of the command that just ran. Closing
+// the shell's ends lets each one see EOF, or EPIPE, once the command is
+// done with it; then the ones to wait for are waited for, and in
+// interactive mode what they printed goes to the scrollback.
+static void substitutions_finish(void) {
+    for (int i = 0; i < substitution_count; i++) close(substitutions[i].fd);
+    for (int i = 0; i < substitution_count; i++) {
+        Substitution* sub = &substitutions[i];
+        if (sub->output != -1) {
+            // Only one being waited for is read to the end
+            if (sub->pid == 0) fcntl(sub->output, F_SETFL, O_NONBLOCK);
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(sub->output, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR)) {
+                if (n > 0) output_feed(buf, n);
+            }
+            close(sub->output);
+        }
+        if (sub->pid > 0) {
+            while (waitpid(sub->pid, NULL, 0) == -1 && errno == EINTR) {}
+        }
+    }
+    if (substitution_count > 0 && interactive_mode) output_render();
+    substitution_count = 0;
+}
+
+// The words of a command as expand_words() builds them, and the
+// assignments that came before it
+typedef struct {
+    char** words;
+    int* origin;
+    size_t count;
+    size_t capacity;
+    char** assignments;
+    size_t assignment_count;
+    bool substituted;       // Whether a $(...) ran, setting last_status
+} Expansion;
+
+static void expansion_add(Expansion* e, char* word, int origin) {
+    if (e->count + 2 > e->capacity) {
+        size_t capacity = e->capacity * 2;
+        char** words = arena_alloc(&command_arena, capacity * sizeof(char*));
+        int* origins = arena_alloc(&command_arena, capacity * sizeof(int));
+        memcpy(words, e->words, e->count * sizeof(char*));
+        memcpy(origins, e->origin, e->count * sizeof(int));
+        e->words = words;
+        e->origin = origins;
+        e->capacity = capacity;
+    }
+    e->words[e->count] = word;
+    e->origin[e->count++] = origin;
+}
+
+// Copies the first len bytes of text to the command arena
+static char* arena_copy(const char* text, size_t len) {
+    char* copy = arena_alloc(&command_arena, len + 1);
+    if (len > 0) memcpy(copy, text, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// The character a glob mark stands for when it is taken literally
+static char glob_literal(char ch) {
+    switch (ch) {
+    case GLOB_STAR: return '*';
+    case GLOB_ANY: return '?';
+    case GLOB_CLASS: return '[';
+    default: return ch;
+    }
+}
+
+static bool is_glob_mark(char ch) {
+    return ch == GLOB_STAR || ch == GLOB_ANY || ch == GLOB_CLASS;
+}
+
+// Returns the ']' closing the class whose contents start at p, or NULL.
+// A ']' right after the opening '[' or its '!' belongs to the class.
+static const char* glob_class_end(const char* p, const char* end) {
+    if (p < end && (*p == '!' || *p == '^')) p++;
+    if (p < end && *p == ']') p++;
+    while (p < end && *p != ']') p++;
+    return p < end ? p : NULL;
+}
+
+// Matches ch against the pattern item at *p, which is not a GLOB_STAR,
+// and moves *p past the item
+static bool glob_one(const char** p, const char* end, unsigned char ch) {
+    const char* item = *p;
+    if (*item == GLOB_ANY) {
+        *p = item + 1;
+        return true;
+    }
+    const char* close = *item == GLOB_CLASS ? glob_class_end(item + 1, end) : NULL;
+    if (close == NULL) {
+        // An unclosed class is a plain '['
+        *p = item + 1;
+        return (unsigned char)glob_literal(*item) == ch;
+    }
+    const char* q = item + 1;
+    bool negate = *q == '!' || *q == '^';
+    if (negate) q++;
+    bool found = false;
+    do {
+        unsigned char lo = glob_literal(*q), hi = lo;
+        if (q + 2 < close && q[1] == '-') {
+            hi = glob_literal(q[2]);
+            q += 3;
+        } else {
+            q++;
+        }
+        if (lo <= ch && ch <= hi) found = true;
+    } while (q < close);
+    *p = close + 1;
+    return found != negate;
+}
+
+// Whether name matches the pattern [p, end), backtracking to the last
+// star on a mismatch
+static bool glob_match(const char* p, const char* end, const char* name) {
+    const char* star = NULL;
+    const char* star_name = NULL;
+    while (*name != '\0') {
+        if (p < end && *p == GLOB_STAR) {
+            while (p < end && *p == GLOB_STAR) p++;
+            star = p;
+            star_name = name;
+            continue;
+        }
+        const char* next = p;
+        if (p < end && glob_one(&next, end, *name)) {
+            p = next;
+            name++;
+        } else if (star != NULL) {
+            p = star;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (p < end && *p == GLOB_STAR) p++;
+    return p == end;
+}
+
+static DirListing* dir_cache_get(const char* path);
+
+// Paths matching a glob pattern, before they are sorted
+typedef struct {
+    char** paths;
+    size_t count;
+    size_t capacity;
+} GlobMatches;
+
+static void glob_add(GlobMatches* m, const String* path) {
+    if (m->count == m->capacity) {
+        m->capacity = m->capacity == 0 ? 16 : m->capacity * 2;
+        char** grown = arena_alloc(&command_arena, m->capacity * sizeof(char*));
+        if (m->count > 0) memcpy(grown, m->paths, m->count * sizeof(char*));
+        m->paths = grown;
+    }
+    m->paths[m->count++] = arena_copy(path->data, path->count);
+}
+
+// Matches pattern, the rest of a glob after the directory path holds,
+// one component at a time. Directories come from the listings the
+// completion code caches, so a pattern repeated over an unchanged
+// directory reads nothing but its mtime; a component's literal prefix
+// narrows the sorted listing by binary search.
+static void glob_walk(String* path, const char* pattern, GlobMatches* m) {
+    size_t base = path->count;
+    const char* end = pattern + strcspn(pattern, "/");
+    const char* literal_end = pattern;
+    while (literal_end < end && !is_glob_mark(*literal_end)) literal_end++;
+
+    if (literal_end == end) {
+        for (const char* c = pattern; c < end; c++) string_append(path, *c);
+        while (*end == '/') string_append(path, *end++);
+        string_append(path, '\0');
+        path->count--;
+        struct stat st;
+        if (*end != '\0') {
+            glob_walk(path, end, m);
+        } else if (lstat(path->data, &st) == 0) {
+            glob_add(m, path);
+        }
+        path->count = base;
+        return;
+    }
+
+    string_append(path, '\0');
+    DirListing* listing = dir_cache_get(base == 0 ? "." : path->data);
+    path->count = base;
+    if (listing == NULL) return;
+    size_t prefix_len = literal_end - pattern;
+    size_t lo = 0, hi = listing->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(listing->names[mid], pattern, prefix_len) < 0) lo = mid + 1; else hi = mid;
+    }
+    // Copy the matches out first: walking into them can evict the listing
+    bool dirs_only = *end == '/';
+    size_t count = 0;
+    char** names = NULL;
+    for (size_t i = lo; i < listing->count && strncmp(listing->names[i], pattern, prefix_len) == 0; i++) {
+        const char* name = listing->names[i];
+        size_t len = strlen(name);
+        bool is_dir = name[len - 1] == '/';
+        if (is_dir) len--;
+        if (name[0] == '.' && pattern[0] != '.') continue;
+        if (dirs_only && !is_dir) continue;
+        char* copy = arena_copy(name, len);
+        if (!glob_match(pattern, end, copy)) continue;
+        if (names == NULL) names = arena_alloc(&command_arena, (listing->count - i) * sizeof(char*));
+        names[count++] = copy;
+    }
+    for (size_t i = 0; i < count; i++) {
+        for (const char* c = names[i]; *c != '\0'; c++) string_append(path, *c);
+        // The listing already shows that a last component exists
+        if (*end == '\0') glob_add(m, path); else glob_walk(path, end, m);
+        path->count = base;
+    }
+}
+
+// Adds the paths matching pattern, a word holding glob marks, to e in
+// collation order. Returns whether anything matched.
+static bool glob_expand(const char* pattern, Expansion* e) {
+    GlobMatches m = {0};
+    String path = {0};
+    string_reserve(&path, PATH_MAX);
+    glob_walk(&path, pattern, &m);
+    string_clear(&path);
+    qsort(m.paths, m.count, sizeof(char*), compare_collated);
+    for (size_t i = 0; i < m.count; i++) expansion_add(e, m.paths[i], -1);
+    return m.count > 0;
+}
+
+// Adds the word being built in field to e, copied to the command arena.
+// With glob set the field holds glob marks, and the paths they match are
+// added instead, or the word as typed when nothing matches.
+static void expansion_add_field(Expansion* e, String* field, bool glob) {
+    string_append(field, '\0');
+    field->count--;
+    if (!glob || !glob_expand(field->data, e)) {
+        char* word = arena_copy(field->data, field->count);
+        for (char* c = word; glob && *c != '\0'; c++) *c = glob_literal(*c);
+        expansion_add(e, word, -1);
+    }
+    field->count = 0;
+}
+
+// Returns the length of the variable name at p, just after its mark
+static size_t variable_reference_length(const char* p) {
+    return *p == '?' || *p == '$' ? 1 : variable_name_length(p);
+}
+
+// Writes word to text the way it was typed, for an error message
+static void substitution_source(const char* word, String* text) {
+    static const char* const opens[] = {"$(", "$(", "<(", ">("};
+    text->count = 0;
+    while (*word != '\0') {
+        if (*word >= SUBST_COMMAND && *word <= SUBST_OUTPUT) {
+            for (const char* p = opens[*word - SUBST_COMMAND]; *p != '\0'; p++) string_append(text, *p);
+            for (word++; *word != SUBST_END; word++) string_append(text, *word);
+            string_append(text, ')');
+            word++;
+        } else if (*word == SUBST_VARIABLE || *word == SUBST_VARIABLE_QUOTED) {
+            size_t len = variable_reference_length(++word);
+            bool braced = word[len] == SUBST_END;
+            string_append(text, '$');
+            if (braced) string_append(text, '{');
+            for (size_t k = 0; k < len; k++) string_append(text, word[k]);
+            if (braced) string_append(text, '}');
+            word += len + braced;
+        } else {
+            string_append(text, glob_literal(*word++));
+        }
+    }
+    string_append(text, '\0');
+}
+
+// Appends the value of the variable whose name is the len bytes at name
+static void variable_append(const char* name, size_t len, String* out) {
+    char number[24];
+    const char* value = NULL;
+    if (*name == '?') {
+        snprintf(number, sizeof(number), "%d", last_status);
+        value = number;
+    } else if (*name == '$') {
+        snprintf(number, sizeof(number), "%d", (int)(shell_pid != 0 ? shell_pid : getpid()));
+        value = number;
+    } else if (len < NAME_MAX) {
+        char key[NAME_MAX];
+        memcpy(key, name, len);
+        key[len] = '\0';
+        value = variable_get(key);
+    }
+    for (; value != NULL && *value != '\0'; value++) string_append(out, *value);
+}
+
+// Expands args, the words of the command starting at token first of the
+// line being run, into a new argv in the command arena held by e:
+// - $NAME and ${NAME} become the variable's value, $? the last status
+//   and $$ the shell's pid
+// - $(...) becomes the command's output
+// - <(...) and >(...) become the /dev/fd path of their pipe
+// - Unquoted *, ? and [...] are replaced by the paths they match, in
+//   collation order, and kept as typed when nothing matches
+// An unquoted variable or $(...) is split at blanks, and a word it leaves
+// empty is dropped; glob characters in its value match as well. Leading
+// name=value words go to e->assignments instead, expanded but neither
+// split nor globbed. Group bodies are expanded by the group's own shell
+// and here-document delimiters not at all. Returns false after reporting
+// an error, with last_status set.
+static bool expand_words(char** args, int first, bool background, Expansion* e) {
+    *e = (Expansion){.capacity = MAX_ARGS};
+    e->words = arena_alloc(&command_arena, e->capacity * sizeof(char*));
+    e->origin = arena_alloc(&command_arena, e->capacity * sizeof(int));
+    String field = {0};
+    String output = {0};
+    bool failed = false;
+    bool command_seen = false;  // Whether this stage's command word came yet
+
+    for (int i = 0; args[i] != NULL && !failed; i++) {
+        bool target = i > 0 && redirect_kind(args[i - 1]) >= 0;
+        bool assignment = !command_seen && !target && is_assignment(args[i]);
+        if (args[i] == pipe_token) {
+            command_seen = false;
+        } else if (!is_operator_token(args[i]) && !target && !assignment) {
+            command_seen = true;
+        }
+
+        int copy = 0;
+        int kind = redirect_kind(args[i]);
+        if (args[i] == lparen_token) {
+            copy = group_close(&args[i]) + 1;
+        } else if ((kind == REDIR_HEREDOC || kind == REDIR_HEREDOC_TABS) && args[i + 1] != NULL) {
+            copy = 2;
+        } else if (!assignment && !word_expands(args[i])) {
+            copy = 1;
+        }
+        for (int k = 0; k < copy; k++) expansion_add(e, args[i + k], first + i + k);
+        if (copy > 0) {
+            i += copy - 1;
+            continue;
+        }
+
+        size_t before = e->count;
+        bool started = false;  // Whether field holds a word, even an empty one
+        bool glob = false;     // Whether field holds glob marks
+        field.count = 0;
+        for (const char* p = args[i]; *p != '\0' && !failed; p++) {
+            char mark = *p;
+            if (is_glob_mark(mark)) {
+                string_append(&field, assignment ? glob_literal(mark) : mark);
+                glob |= !assignment;
+                started = true;
+                continue;
+            }
+            if (!is_mark(mark)) {
+                string_append(&field, mark);
+                started = true;
+                continue;
+            }
+
+            bool split = !assignment && (mark == SUBST_VARIABLE || mark == SUBST_COMMAND);
+            output.count = 0;
+            String* out = split ? &output : &field;
+            if (mark == SUBST_VARIABLE || mark == SUBST_VARIABLE_QUOTED) {
+                size_t len = variable_reference_length(p + 1);
+                variable_append(p + 1, len, out);
+                p += len;
+                if (p[1] == SUBST_END) p++;
+            } else {
+                const char* end = strchr(p + 1, SUBST_END);
+                char* text = arena_copy(p + 1, end - (p + 1));
+                p = end;
+
+                if (mark == SUBST_INPUT || mark == SUBST_OUTPUT) {
+                    int fd = substitute_process(text, mark == SUBST_INPUT, background);
+                    if (fd == -1) {
+                        last_status = 1;
+                        failed = true;
+                        break;
+                    }
+                    char path[32];
+                    snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+                    for (const char* c = path; *c != '\0'; c++) string_append(&field, *c);
+                    started = true;
+                    continue;
+                }
+                last_status = substitute_command(text, out);
+                e->substituted = true;
+                // CTRL+C abandons the whole line, as it does a list
+                if (last_status == 128 + SIGINT) failed = true;
+            }
+            if (!split) {
+                started = true;
+                continue;
+            }
+            for (size_t k = 0; k < output.count; k++) {
+                char ch = output.data[k];
+                if (ch != ' ' && ch != '\t' && ch != '\n') {
+                    if (ch == '*' || ch == '?' || ch == '[') {
+                        ch = ch == '*' ? GLOB_STAR : ch == '?' ? GLOB_ANY : GLOB_CLASS;
+                        glob = true;
+                    }
+                    string_append(&field, ch);
+                    started = true;
+                } else if (started) {
+                    expansion_add_field(e, &field, glob);
+                    started = false;
+                    glob = false;
+                }
+            }
+        }
+        if (failed) break;
+
+        if (assignment) {
+            if (e->assignments == NULL) {
+                size_t n = i;
+                while (args[n] != NULL) n++;
+                e->assignments = arena_alloc(&command_arena, (n - i) * sizeof(char*));
+            }
+            e->assignments[e->assignment_count++] = arena_copy(field.data, field.count);
+            continue;
+        }
+        if (started) expansion_add_field(e, &field, glob);
+
+        // A redirection needs exactly one file
+        if (e->count != before + 1 && before > 0 && redirect_kind(e->words[before - 1]) >= 0) {
+            substitution_source(args[i], &field);
+            shell_error("\n%s: ambiguous redirect\n", field.data);
+            last_status = 1;
+            failed = true;
+        }
+    }
+    string_clear(&field);
+    string_clear(&output);
+    if (failed) return false;
+
+    e->words[e->count] = NULL;
+    expanded_args = e->words;
+    expanded_origin = e->origin;
+    expanded_count = e->count;
+    return true;
+}
+
+// Returns a copy of environ in the command arena with the assignments of
+// e in place of the variables they name, for the command they precede
+static char** assignment_environ(const Expansion* e) {
+    size_t count = 0;
+    while (environ[count] != NULL) count++;
+    char** env = arena_alloc(&command_arena, (count + e->assignment_count + 1) * sizeof(char*));
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        bool replaced = false;
+        for (size_t k = 0; k < e->assignment_count && !replaced; k++) {
+            size_t len = strcspn(e->assignments[k], "=") + 1;
+            replaced = strncmp(environ[i], e->assignments[k], len) == 0;
+        }
+        if (!replaced) env[n++] = environ[i];
+    }
+    for (size_t k = 0; k < e->assignment_count; k++) env[n++] = e->assignments[k];
+    env[n] = NULL;
+    return env;
+}
+
+// Whether a list goes on after a command: not once the shell is exiting
+// or the command was interrupted, as bash abandons a list on CTRL+C
+static bool plan_continues(int status) {
+    return shell_running && status != 128 + SIGINT;
+}
+
+// Runs node of plan over tokens, this run's copy of plan->tokens, and
+// returns its exit status. Commands cut their range out of tokens, so a
+// copy serves one run only.
+int plan_execute(const Plan* plan, char** tokens, int n) {
+    const PlanNode* node = &plan->nodes[n];
+    int status;
+    switch (node->kind) {
+    case NODE_COMMAND: {
+        tokens[node->end] = NULL;
+        char** args = &tokens[node->start];
+        const Builtin* builtin = node->builtin;
+        bool assigned = false;
+        if (node->expands) {
+            Expansion e;
+            if (!expand_words(args, node->start, node->background, &e)) {
+                substitutions_finish();
+                return last_status;
+            }
+            args = e.words;
+            if (e.assignment_count > 0 && args[0] == NULL) {
+                // Assignments alone set shell variables
+                for (size_t k = 0; k < e.assignment_count; k++) {
+                    const char* entry = e.assignments[k];
+                    size_t len = strcspn(entry, "=");
+                    variable_set(entry, len, entry + len + 1, false);
+                }
+                substitutions_finish();
+                expanded_args = NULL;
+                last_status = e.substituted ? last_status : 0;
+                return last_status;
+            }
+            // Otherwise they are exported to the command alone
+            if (e.assignment_count > 0) {
+                variables_init();
+                environ = assignment_environ(&e);
+                assigned = true;
+            }
+            builtin = args[0] == NULL || is_operator_token(args[0]) ? NULL : builtin_find(args[0]);
+        }
+        status = execute_command(args, builtin, node->background);
+        if (assigned) environ = variables.envp;
+        if (node->expands) {
+            substitutions_finish();
+            expanded_args = NULL;
+        }
+        last_status = status;
+        return status;
+    }
+    case NODE_GROUP:
+        return plan_execute(plan, tokens, node->left);
+    case NODE_SEQUENCE:
+        status = plan_execute(plan, tokens, node->left);
+        return plan_continues(status) ? plan_execute(plan, tokens, node->right) : status;
+    case NODE_AND:
+    case NODE_OR:
+        status = plan_execute(plan, tokens, node->left);
+        if ((status == 0) != (node->kind == NODE_AND) || !plan_continues(status)) return status;
+        return plan_execute(plan, tokens, node->right);
+    }
+    return last_status;
+}
+
+// Returns the group node whose "(" is argv[0] in the line being run, or
+// in the expanded copy of its command being run, or -1
+int group_find(char** argv) {
+    if (active_plan == NULL) return -1;
+    int start;
+    if (argv >= active_tokens && argv < active_tokens + active_plan->token_count) {
+        start = argv - active_tokens;
+    } else if (expanded_args != NULL && argv >= expanded_args && argv < expanded_args + expanded_count) {
+        start = expanded_origin[argv - expanded_args];
+    } else {
+        return -1;
+    }
+    for (int n = 0; n < active_plan->node_count; n++) {
+        if (active_plan->nodes[n].kind == NODE_GROUP && active_plan->nodes[n].start == start) return n;
+    }
+    return -1;
+}
+
+// Compiles (or recalls) and executes one line of input. Blank lines and
+// comments leave the last exit status untouched; a syntax error runs
+// nothing and returns 2.
+int run_line(char* line) {
+    while (isspace((unsigned char)*line)) line++;
+    if (*line == '\0' || *line == '#') return last_status;
+    stat_count(STAT_LINES);
+
+    const Plan* plan = plan_get(line);
+    if (plan == NULL) {
+        arena_reset(&command_arena);
+        return 2;
+    }
+    size_t size = (plan->token_count + 1) * sizeof(char*);
+    char** tokens = arena_alloc(&command_arena, size);
+    memcpy(tokens, plan->tokens, size);
+    read_heredocs(tokens);
+
+    const Plan* saved_plan = active_plan;
+    char** saved_tokens = active_tokens;
+    active_plan = plan;
+    active_tokens = tokens;
+    int status = plan_execute(plan, tokens, plan->root);
+    active_plan = saved_plan;
+    active_tokens = saved_tokens;
+    arena_reset(&command_arena);
+    return status;
+}
+
+// Runs text that may hold several newline-separated lines, such as a
+// multi-line paste, one line at a time. Here-document bodies are taken
+// from the lines that follow their command.
+int run_lines(char* text) {
+    bool (*saved_reader)(String*) = heredoc_reader;
+    char* saved_rest = lines_rest;
+    heredoc_reader = read_rest_line;
+    lines_rest = text;
+    int status = last_status;
+    while (lines_rest != NULL && shell_running) {
+        char* line = lines_rest;
+        char* newline = strchr(line, '\n');
+        if (newline) *newline = '\0';
+        lines_rest = newline ? newline + 1 : NULL;
+        status = last_status = run_line(line);
+    }
+    heredoc_reader = saved_reader;
+    lines_rest = saved_rest;
+    return status;
+}
+
+// Headless front end for scripts, -c and piped stdin: reads buffered lines
+// and never touches ncurses. Returns the exit status of the last command.
+int shell_batch_loop(FILE* input) {
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    batch_input = input;
+    heredoc_reader = read_batch_line;
+    stats_signal_init();
+
+    while (shell_running && (len = getline(&line, &capacity, input)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+        // No SIGCHLD handler here; finished background jobs are collected
+        // between lines
+        jobs_reap();
+        jobs_notify();
+        stats_poll();
+        last_status = run_line(line);
+    }
+    heredoc_reader = NULL;
+    free(line);
+    fflush(stdout);
+    return last_status;
+}
+
+static void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    // A full pipe already guarantees a wakeup
+    ssize_t ignored = write(sigchld_pipe[1], "", 1);
+    (void)ignored;
+    errno = saved_errno;
+}
+
+static void sigint_handler(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+void shell_initialize(void) {
+    interactive_mode = true;
+    setlocale(LC_ALL, "");
+    initscr();
+    cbreak();
+    noecho();
+    keypad(stdscr, TRUE);
+    scrollok(stdscr, TRUE);
+
+    // Input is waited for with poll(), so getch() never blocks
+    nodelay(stdscr, TRUE);
+
+    // Pastes arrive wrapped in ESC[200~ ... ESC[201~
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    define_key("\033[201~", KEY_PASTE_END);
+    set_bracketed_paste(true);
+
+    // Job control: SIGCHLD wakes the input loop through a self-pipe, ^C
+    // only abandons the edit line and the shell may take the terminal
+    // back from a job without being stopped by SIGTTOU
+    shell_pgid = getpgrp();
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        endwin();
+        fprintf(stderr, "pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = sigint_handler;
+    sa.sa_flags = 0;  // Interrupts a blocking wait
+    sigaction(SIGINT, &sa, NULL);
+    stats_signal_init();
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    // An in-process utility writing to a closed pipe gets EPIPE instead
+    // of taking the shell down
+    signal(SIGPIPE, SIG_IGN);
+
+    // Add initial PID information
+    pid_t shell_pid = getpid();
+    shell_print("Custom Shell started - PID: %d\n", shell_pid);
+    shell_flush();
+}
+
+// Turns the terminal's bracketed-paste mode on for the line editor and
+// off while commands own the terminal
+void set_bracketed_paste(bool enabled) {
+    refresh();
+    const char* seq = enabled ? BRACKETED_PASTE_ON : BRACKETED_PASTE_OFF;
+    write_all(STDOUT_FILENO, seq, strlen(seq));
+}
+
+void shell_terminate(void) {
+    command_index_stop();
+    set_bracketed_paste(false);
+    endwin();
+    interactive_mode = false;
+}
+
+// Reads the operator starting at *cursor, if any, and moves the cursor
+// past it. Returns the operator's static token or NULL.
+static char* scan_operator(char** cursor) {
+    char* p = *cursor;
+    char* op;
+    size_t len = 1;
+    switch (p[0]) {
+    case '|':
+        op = p[1] == '|' ? or_token : pipe_token;
+        len = p[1] == '|' ? 2 : 1;
+        break;
+    case ';':
+        op = semi_token;
+        break;
+    case '(':
+        op = lparen_token;
+        break;
+    case ')':
+        op = rparen_token;
+        break;
+    case '&':
+        if (p[1] == '&') {
+            op = and_token;
+            len = 2;
+        } else if (p[1] != '>') {
+            op = amp_token;
+        } else if (p[2] == '>') {
+            op = redirect_tokens[REDIR_BOTH_APPEND];
+            len = 3;
+        } else {
+            op = redirect_tokens[REDIR_BOTH];
+            len = 2;
+        }
+        break;
+    case '<':
+        if (p[1] == '<' && p[2] == '<') {
+            op = redirect_tokens[REDIR_HERE_STRING];
+            len = 3;
+        } else if (p[1] == '<' && p[2] == '-') {
+            op = redirect_tokens[REDIR_HEREDOC_TABS];
+            len = 3;
+        } else if (p[1] == '<') {
+            op = redirect_tokens[REDIR_HEREDOC];
+            len = 2;
+        } else if (p[1] == '&') {
+            op = redirect_tokens[REDIR_DUP_IN];
+            len = 2;
+        } else {
+            op = redirect_tokens[REDIR_IN];
+        }
+        break;
+    case '>':
+        if (p[1] == '>') {
+            op = redirect_tokens[REDIR_APPEND];
+            len = 2;
+        } else if (p[1] == '&') {
+            op = redirect_tokens[REDIR_DUP_OUT];
+            len = 2;
+        } else {
+            op = redirect_tokens[REDIR_OUT];
+            len = p[1] == '|' ? 2 : 1;  // No noclobber, so >| is plain >
+        }
+        break;
+    default:
+        return NULL;
+    }
+    *cursor = p + len;
+    return op;
+}
+
+// Copies the $(...), <(...) or >(...) at *cursor to write as mark, the
+// text between the parentheses and SUBST_END, and moves the cursor past
+// it. The text keeps its quotes for the shell that will run it, and an
+// unclosed substitution runs to the end of the line. The copy is one
+// byte shorter than the original, so it fits where the original was.
+static char* substitution_copy(char** cursor, char* write, char mark) {
+    char* read = *cursor + 2;
+    int depth = 1;
+    *write++ = mark;
+    while (*read != '\0') {
+        char ch = *read;
+        if (ch == '"' || ch == '\'') {
+            *write++ = *read++;
+            while (*read != '\0' && *read != ch) *write++ = *read++;
+            if (*read == ch) *write++ = *read++;
+            continue;
+        }
+        if (ch == '(') depth++;
+        if (ch == ')' && --depth == 0) {
+            read++;
+            break;
+        }
+        *write++ = *read++;
+    }
+    *write++ = SUBST_END;
+    *cursor = read;
+    return write;
+}
+
+// Copies the $NAME, ${NAME}, $? or $$ at *cursor to write as mark and
+// the name, followed by SUBST_END if it was braced, and moves the cursor
+// past it. The copy is never longer than the original. Returns NULL,
+// copying nothing, if no variable starts at the cursor.
+static char* variable_copy(char** cursor, char* write, char mark) {
+    char* read = *cursor + 1;
+    bool braced = *read == '{';
+    if (braced) read++;
+    size_t len = variable_name_length(read);
+    if (len == 0 && (*read == '?' || *read == '$')) len = 1;
+    if (len == 0 || (braced && read[len] != '}')) return NULL;
+    *write++ = mark;
+    memmove(write, read, len);
+    write += len;
+    read += len;
+    if (braced) {
+        *write++ = SUBST_END;
+        read++;
+    }
+    *cursor = read;
+    return write;
+}
+
+// Splits line into argv in place: each token is a slice of the line
+// buffer, terminated by overwriting the delimiter after it, with quote
+// characters squeezed out as the token is scanned. Quotes may appear
+// anywhere inside a word ("a b"c is the single word a bc). Substitutions,
+// variables and unquoted glob characters are left in their word as marks
+// for expand_words(), and a # that starts a word ends the line. The argv array
+// comes from arena, so parsing allocates nothing once the arena is warm.
+char** parse_command(char* line, Arena* arena) {
+    size_t capacity = MAX_ARGS;
+    char** tokens = arena_alloc(arena, capacity * sizeof(char*));
+    size_t position = 0;
+    char* read = line;
+
+    while (true) {
+        // Skip leading whitespace; an unquoted # starting a word comments
+        // out the rest of the line
+        while (isspace((unsigned char)*read)) read++;
+        if (*read == '\0' || *read == '#') break;
+
+        // Keep room for this token, a possible operator after it and the NULL
+        if (position + 3 > capacity) {
+            char** grown = arena_alloc(arena, capacity * 2 * sizeof(char*));
+            memcpy(grown, tokens, position * sizeof(char*));
+            tokens = grown;
+            capacity *= 2;
+        }
+
+        // Operators are tokens of their own even without surrounding
+        // spaces; <( and >( start a process substitution instead
+        bool process = (read[0] == '<' || read[0] == '>') && read[1] == '(';
+        char* op = process ? NULL : scan_operator(&read);
+        if (op != NULL) {
+            tokens[position++] = op;
+            continue;
+        }
+        // A lone digit right before a redirection names the fd it changes
+        if (isdigit((unsigned char)read[0]) && (read[1] == '<' || read[1] == '>')) {
+            tokens[position++] = fd_tokens[read[0] - '0'];
+            read++;
+            continue;
+        }
+
+        char* token = read;
+        char* write = read;
+        // Where an unbraced variable name ended, so a quote right after it
+        // can end the name with SUBST_END in the byte the quote frees
+        char* name_end = NULL;
+        char* copied;
+        bool quoted = false;
+        if (process) write = substitution_copy(&read, write, read[0] == '<' ? SUBST_INPUT : SUBST_OUTPUT);
+        while (*read != '\0' && !isspace((unsigned char)*read) && !strchr("|&;()<>", *read)) {
+            if (*read == '"' || *read == '\'') {
+                char quote_char = *read++;
+                quoted = true;
+                if (write == name_end) *write++ = SUBST_END;
+                while (*read != '\0' && *read != quote_char) {
+                    if (quote_char == '"' && read[0] == '$' && read[1] == '(') {
+                        write = substitution_copy(&read, write, SUBST_QUOTED);
+                    } else if (quote_char == '"' && read[0] == '$' &&
+                               (copied = variable_copy(&read, write, SUBST_VARIABLE_QUOTED)) != NULL) {
+                        write = copied;
+                        if (write[-1] != SUBST_END) name_end = write;
+                    } else {
+                        *write++ = *read++;
+                    }
+                }
+                if (*read == quote_char) {
+                    read++;  // An unclosed quote runs to the end
+                    if (write == name_end) *write++ = SUBST_END;
+                }
+            } else if (read[0] == '$' && read[1] == '(') {
+                write = substitution_copy(&read, write, SUBST_COMMAND);
+            } else if (read[0] == '$' && (copied = variable_copy(&read, write, SUBST_VARIABLE)) != NULL) {
+                write = copied;
+                if (write[-1] != SUBST_END) name_end = write;
+            } else if (*read == '*' || *read == '?') {
+                *write++ = *read++ == '*' ? GLOB_STAR : GLOB_ANY;
+            } else if (*read == '[' && read[strcspn(read, "] \t\n|&;()<>")] == ']') {
+                // Only a [ closed later in the word starts a class, so
+                // the [ command stays a word
+                *write++ = GLOB_CLASS;
+                read++;
+            } else {
+                *write++ = *read++;
+            }
+        }
+
+        // Read an operator ending the word before the terminator can
+        // overwrite its first character
+        bool at_end = *read == '\0';
+        op = scan_operator(&read);
+        *write = '\0';
+        bool delimiter = position > 0 && (tokens[position - 1] == redirect_tokens[REDIR_HEREDOC] ||
+                                          tokens[position - 1] == redirect_tokens[REDIR_HEREDOC_TABS]);
+        if (quoted && delimiter) {
+            // The quotes squeezed out leave room for the mark, and the
+            // byte after the word was its terminator
+            memmove(token + 1, token, write - token + 1);
+            token[0] = HEREDOC_QUOTED;
+        }
+        tokens[position++] = token;
+        if (op != NULL) {
+            tokens[position++] = op;
+        } else if (at_end) {
+            break;
+        } else {
+            read++;
+        }
+    }
+
+    tokens[position] = NULL;
+    return tokens;
+}
+
+// Expands the body of a here-document whose delimiter was not quoted, as
+// sh does: $NAME, ${NAME}, $?, $$ and $(...) are replaced, but nothing is
+// split or globbed, and a backslash keeps a following $, ` or \ literal.
+// Returns the text in the command arena.
+char* heredoc_expand(const char* body) {
+    size_t len = strlen(body);
+    char* text = arena_copy(body, len);
+    char* scratch = arena_alloc(&command_arena, len + 2);
+    String out = {0};
+    char* read = text;
+    char* copied;
+    while (*read != '\0') {
+        if (read[0] == '\\' && (read[1] == '$' || read[1] == '`' || read[1] == '\\')) {
+            string_append(&out, read[1]);
+            read += 2;
+        } else if (read[0] == '$' && read[1] == '(') {
+            char* end = substitution_copy(&read, scratch, SUBST_COMMAND);
+            end[-1] = '\0';
+            substitute_command(scratch + 1, &out);
+        } else if (read[0] == '$' && (copied = variable_copy(&read, scratch, SUBST_VARIABLE)) != NULL) {
+            *copied = '\0';  // An unbraced name has no end of its own
+            variable_append(scratch + 1, variable_reference_length(scratch + 1), &out);
+        } else {
+            string_append(&out, *read++);
+        }
+    }
+    char* result = arena_copy(out.data ? out.data : "", out.count);
+    string_clear(&out);
+    return result;
+}
+
+// Reverse-i-search index
+static inline size_t trigram_bucket(const char* p) {
+    uint32_t t = ((uint32_t)(unsigned char)p[0] << 16) |
+                 ((uint32_t)(unsigned char)p[1] << 8) |
+                 (uint32_t)(unsigned char)p[2];
+    return (t * 2654435761u) >> 16;
+}
+
+static void posting_add(Posting* posting, uint32_t id) {
+    // Entries are added in order, so a repeat within one entry is the tail
+    if (posting->count > 0 && posting->ids[posting->count - 1] == id) return;
+    if (posting->count >= posting->capacity) {
+        uint32_t new_cap = posting->capacity == 0 ? 4 : posting->capacity * 2;
+        uint32_t* new_ids = realloc(posting->ids, new_cap * sizeof(uint32_t));
+        if (!new_ids) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        posting->ids = new_ids;
+        posting->capacity = new_cap;
+    }
+    posting->ids[posting->count++] = id;
+}
+
+// Indexes history entries added since the last call. The first call
+// indexes the whole history; after that each ENTER adds one entry.
+void search_index_update(SearchIndex* index, const History* history) {
+    if (index->buckets == NULL) {
+        index->buckets = calloc(TRIGRAM_BUCKETS, sizeof(Posting));
+        if (!index->buckets) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    size_t count = history_count(history);
+    for (size_t i = index->indexed; i < count; i++) {
+        size_t len;
+        const char* entry = history_entry(history, i, &len);
+        for (size_t j = 0; j + 3 <= len; j++) {
+            posting_add(&index->buckets[trigram_bucket(entry + j)], (uint32_t)i);
+        }
+    }
+    index->indexed = count;
+}
+
+void search_index_free(SearchIndex* index) {
+    if (index->buckets) {
+        for (size_t i = 0; i < TRIGRAM_BUCKETS; i++) free(index->buckets[i].ids);
+        free(index->buckets);
+    }
+    free(index->candidates);
+    string_clear(&index->candidate_term);
+    memset(index, 0, sizeof(*index));
+}
+
+// Keeps the ids in ids[0, n) that also appear in the sorted list other.
+// Similar sizes are merged linearly; a much longer list is galloped
+// through so the cost follows the shorter one.
+static size_t intersect_sorted(uint32_t* ids, size_t n, const uint32_t* other, size_t m) {
+    size_t out = 0;
+    size_t lo = 0;
+    if (m < n * 8) {
+        for (size_t i = 0; i < n && lo < m; i++) {
+            while (lo < m && other[lo] < ids[i]) lo++;
+            if (lo < m && other[lo] == ids[i]) ids[out++] = ids[i];
+        }
+        return out;
+    }
+    for (size_t i = 0; i < n && lo < m; i++) {
+        uint32_t id = ids[i];
+        size_t step = 1;
+        size_t hi = lo;
+        while (hi < m && other[hi] < id) {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        if (hi > m) hi = m;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (other[mid] < id) lo = mid + 1; else hi = mid;
+        }
+        if (lo < m && other[lo] == id) ids[out++] = id;
+    }
+    return out;
+}
+
+// Returns the shortest posting list among term's trigrams
+static const Posting* search_index_seed(const SearchIndex* index, const char* term, size_t term_len) {
+    const Posting* seed = NULL;
+    for (size_t j = 0; j + 3 <= term_len; j++) {
+        const Posting* p = &index->buckets[trigram_bucket(term + j)];
+        if (seed == NULL || p->count < seed->count) seed = p;
+    }
+    return seed;
+}
+
+// Recomputes the candidate set for term from seed, or narrows the previous
+// set when term extends the term it was computed for
+static void search_index_candidates(SearchIndex* index, const Posting* seed,
+                                    const char* term, size_t term_len) {
+    size_t first_new = 0;
+    bool narrow = index->candidate_term.count >= 3 &&
+                  index->candidate_indexed == index->indexed &&
+                  index->candidate_term.count <= term_len &&
+                  memcmp(index->candidate_term.data, term, index->candidate_term.count) == 0;
+
+    if (narrow) {
+        // Only the trigrams that end in the newly typed characters are new
+        first_new = index->candidate_term.count - 2;
+    } else {
+        if (seed->count > index->candidate_capacity) {
+            uint32_t* new_ids = realloc(index->candidates, seed->count * sizeof(uint32_t));
+            if (!new_ids) {
+                endwin();
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+            index->candidates = new_ids;
+            index->candidate_capacity = seed->count;
+        }
+        if (seed->count > 0) memcpy(index->candidates, seed->ids, seed->count * sizeof(uint32_t));
+        index->candidate_count = seed->count;
+    }
+
+    for (size_t j = first_new; j + 3 <= term_len && index->candidate_count > 0; j++) {
+        const Posting* p = &index->buckets[trigram_bucket(term + j)];
+        index->candidate_count = intersect_sorted(index->candidates, index->candidate_count,
+                                                  p->ids, p->count);
+    }
+    string_set(&index->candidate_term, term, term_len);
+    index->candidate_indexed = index->indexed;
+}
+
+// Returns the newest history entry below `before` that contains term, or
+// -1. Terms shorter than a trigram fall back to a backwards scan, which
+// stops at the first (usually very recent) hit. Terms made only of very
+// common trigrams are checked lazily from the newest entry of the
+// shortest posting list rather than materialized, since nearly every
+// entry there matches.
+int search_index_find(SearchIndex* index, const History* history, const char* term,
+                      size_t term_len, int before) {
+    if (term_len == 0) return -1;
+    search_index_update(index, history);
+
+    if (term_len < 3) {
+        for (int i = before - 1; i >= 0; i--) {
+            size_t len;
+            const char* entry = history_entry(history, i, &len);
+            if (memmem(entry, len, term, term_len) != NULL) return i;
+        }
+        return -1;
+    }
+
+    bool cached = index->candidate_term.count == term_len &&
+                  index->candidate_indexed == index->indexed &&
+                  memcmp(index->candidate_term.data, term, term_len) == 0;
+    bool narrowable = index->candidate_term.count >= 3 &&
+                      index->candidate_indexed == index->indexed &&
+                      index->candidate_term.count < term_len &&
+                      memcmp(index->candidate_term.data, term, index->candidate_term.count) == 0;
+    const uint32_t* ids;
+    size_t count;
+
+    if (cached || narrowable) {
+        if (!cached) search_index_candidates(index, NULL, term, term_len);
+        ids = index->candidates;
+        count = index->candidate_count;
+    } else {
+        const Posting* seed = search_index_seed(index, term, term_len);
+        if (seed->count <= SEARCH_MATERIALIZE_MAX) {
+            search_index_candidates(index, seed, term, term_len);
+            ids = index->candidates;
+            count = index->candidate_count;
+        } else {
+            index->candidate_term.count = 0;
+            ids = seed->ids;
+            count = seed->count;
+        }
+    }
+
+    // Skip candidates at or after `before`, then verify from the newest
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((int)ids[mid] < before) lo = mid + 1; else hi = mid;
+    }
+    for (size_t k = lo; k > 0; k--) {
+        size_t len;
+        const char* entry = history_entry(history, ids[k - 1], &len);
+        if (memmem(entry, len, term, term_len) != NULL) return (int)ids[k - 1];
+    }
+    return -1;
+}
+
+// Runs one reverse-i-search lookup, timing it
+static int search_find(ShellState* state, int before) {
+    long long start = monotonic_ns();
+    int found = search_index_find(&state->search_index, &state->history,
+                                  state->search_term.data, state->search_term.count, before);
+    stat_record(STAT_SEARCH_SCAN, monotonic_ns() - start);
+    return found;
+}
+
+// Loads history entry i into the edit line as the current match
+static void search_accept_match(ShellState* state, int i) {
+    size_t len;
+    const char* entry = history_entry(&state->history, i, &len);
+    gap_set(&state->current_cmd, entry, len);
+    state->cursor_pos = len;
+}
+
+void handle_search(int ch, ShellState* state) {
+    static int matched_pos = -1;
+    int total = (int)history_count(&state->history);
+    
+    switch (ch) {
+        case ctrl('r'):  // Another ctrl-r press
+            // If we have a current match, look for the next one
+            if (matched_pos >= 0) {
+                int found = search_find(state, matched_pos);
+                if (found >= 0) {
+                    matched_pos = found;
+                    search_accept_match(state, found);
+                } else {
+                    flash();  // Visual feedback that no more matches were found
+                }
+            }
+            break;
+            
+        case '\t':  // Continue in the fuzzy finder with the same term
+            state->searching = false;
+            fuzzy_open(state, state->search_term.data ? state->search_term.data : "", state->search_term.count);
+            string_clear(&state->search_term);
+            matched_pos = -1;
+            return;
+
+        case ctrl('c'):  // Cancel search
+        case 27:         // ESC key
+            state->searching = false;
+            string_clear(&state->search_term);
+            matched_pos = -1;
+            break;
+            
+        case ENTER:      // Accept the current selection
+            state->searching = false;
+            string_clear(&state->search_term);
+            matched_pos = -1;
+            break;
+            
+        case KEY_BACKSPACE:
+        case 127:
+            if (state->search_term.count > 0) {
+                state->search_term.count--;
+                state->search_term.data[state->search_term.count] = '\0';
+                
+                // Try to find a match with the updated search term
+                matched_pos = search_find(state, total);
+                if (matched_pos >= 0) search_accept_match(state, matched_pos);
+            }
+            break;
+            
+        default:
+            if (isprint(ch)) {
+                string_append(&state->search_term, ch);
+                string_append(&state->search_term, '\0');
+                state->search_term.count--;
+                
+                // Look for a match
+                matched_pos = search_find(state, total);
+                if (matched_pos >= 0) {
+                    search_accept_match(state, matched_pos);
+                } else {
+                    flash();  // Visual feedback that no match was found
+                }
+            }
+            break;
+    }
+    
+    // Update display
+    move(getcury(stdscr), 0);
+    clrtoeol();
+    if (state->searching) {
+        printw("(reverse-i-search)`%.*s': %.*s", 
+               (int)state->search_term.count, state->search_term.data ? state->search_term.data : "", 
+               (int)gap_length(&state->current_cmd), gap_text(&state->current_cmd));
+    } else {
+        state->view.valid = false;
+        redraw_prompt(state);
+    }
+    refresh();
+}
+
+// Fuzzy history finder
+
+static size_t fuzzy_thread_limit(void) {
+    static long cpus = 0;
+    if (cpus == 0) cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    return cpus < FUZZY_THREADS_MAX ? (size_t)cpus : FUZZY_THREADS_MAX;
+}
+
+// Letters share a bit with their other case; bytes other than letters
+// and digits share bits, which only lets a few extra lines through
+static inline uint64_t fuzzy_bit(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    if (c >= 'a' && c <= 'z') return 1ULL << (c - 'a');
+    if (c >= '0' && c <= '9') return 1ULL << (26 + c - '0');
+    return 1ULL << (36 + c % 28);
+}
+
+static uint64_t fuzzy_mask(const char* text, size_t len) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; i++) mask |= fuzzy_bit((unsigned char)text[i]);
+    return mask;
+}
+
+static uint32_t fuzzy_hash(const char* text, size_t len) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    return hash;
+}
+
+static void fuzzy_slots_grow(FuzzyIndex* index) {
+    size_t capacity = index->slot_capacity == 0 ? 1024 : index->slot_capacity * 2;
+    uint64_t* slots = calloc(capacity, sizeof(uint64_t));
+    if (!slots) {
+        endwin();
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < index->slot_capacity; i++) {
+        uint64_t slot = index->slots[i];
+        if (slot == 0) continue;
+        size_t j = (slot >> 32) & (capacity - 1);
+        while (slots[j] != 0) j = (j + 1) & (capacity - 1);
+        slots[j] = slot;
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->slot_capacity = capacity;
+}
+
+// Folds the history entries added since the last update into the
+// distinct lines, counting repeats and moving each line to its newest use
+void fuzzy_index_update(FuzzyIndex* index, const History* history) {
+    size_t total = history_count(history);
+    if (index->indexed == total) return;
+    for (size_t id = index->indexed; id < total; id++) {
+        size_t len;
+        const char* text = history_entry(history, id, &len);
+        uint32_t hash = fuzzy_hash(text, len);
+        if ((index->count + 1) * 10 >= index->slot_capacity * 7) fuzzy_slots_grow(index);
+
+        size_t mask = index->slot_capacity - 1;
+        size_t j = hash & mask;
+        FuzzyLine* found = NULL;
+        for (; index->slots[j] != 0; j = (j + 1) & mask) {
+            if ((uint32_t)(index->slots[j] >> 32) != hash) continue;
+            FuzzyLine* line = &index->lines[(uint32_t)index->slots[j] - 1];
+            size_t line_len;
+            const char* line_text = history_entry(history, line->id, &line_len);
+            if (line_len == len && memcmp(line_text, text, len) == 0) {
+                found = line;
+                break;
+            }
+        }
+        if (found != NULL) {
+            found->id = id;
+            found->count++;
+            continue;
+        }
+
+        if (index->count >= index->capacity) {
+            size_t capacity = index->capacity == 0 ? 1024 : index->capacity * 2;
+            FuzzyLine* lines = realloc(index->lines, capacity * sizeof(FuzzyLine));
+            if (!lines) {
+                endwin();
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+            index->lines = lines;
+            index->capacity = capacity;
+        }
+        index->lines[index->count] = (FuzzyLine){.mask = fuzzy_mask(text, len), .id = id, .count = 1};
+        index->slots[j] = (uint64_t)hash << 32 | (uint32_t)(index->count + 1);
+        index->count++;
+    }
+    index->indexed = total;
+    index->match_valid = false;  // New lines were never scanned
+}
+
+void fuzzy_index_free(FuzzyIndex* index) {
+    free(index->lines);
+    free(index->slots);
+    free(index->matches);
+    string_clear(&index->match_term);
+    memset(index, 0, sizeof(*index));
+}
+
+// The term in both cases. It matches case-insensitively unless it holds
+// an uppercase letter.
+typedef struct {
+    char lower[256];
+    char upper[256];
+    size_t len;
+    uint64_t mask;
+} FuzzyTerm;
+
+static void fuzzy_term_init(FuzzyTerm* term, const char* text, size_t len) {
+    bool exact = false;
+    if (len > sizeof(term->lower)) len = sizeof(term->lower);
+    for (size_t i = 0; i < len; i++) exact |= isupper((unsigned char)text[i]) != 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        term->lower[i] = exact ? c : tolower(c);
+        term->upper[i] = exact ? c : toupper(c);
+    }
+    term->len = len;
+    term->mask = fuzzy_mask(text, len);
+}
+
+// Returns the first byte in [p, end) equal to a or b, 16 bytes at a time
+// where SSE2 is available
+static const char* fuzzy_find(const char* p, const char* end, char a, char b) {
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int hits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+        if (hits != 0) return p + __builtin_ctz(hits);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == a || *p == b) return p;
+    }
+    return NULL;
+}
+
+static const bool fuzzy_separator[256] = {
+    [' '] = true, ['/'] = true, ['-'] = true, ['_'] = true, ['.'] = true,
+    [':'] = true, ['='] = true, ['|'] = true, ['\''] = true, ['"'] = true,
+};
+
+// Scores text against term in the manner of fzf: 0 when the term is not
+// a subsequence of it, otherwise more for matches at word starts and in
+// runs, less for gaps. The shortest window ending at the first complete
+// match is scored; positions (when non-NULL) receives the matched bytes.
+static int fuzzy_score(const char* text, size_t len, const FuzzyTerm* term, uint32_t* positions) {
+    const char* end = text + len;
+    const char* p = text;
+    if (term->len == 0) return 1;
+    for (size_t k = 0; k < term->len; k++) {
+        p = fuzzy_find(p, end, term->lower[k], term->upper[k]);
+        if (p == NULL) return 0;
+        p++;
+    }
+    // Walk back from the last match for the latest possible start
+    const char* start = p - 1;
+    for (size_t k = term->len; k-- > 0;) {
+        while (*start != term->lower[k] && *start != term->upper[k]) start--;
+        if (k > 0) start--;
+    }
+
+    int score = 0;
+    int run = 0;
+    bool in_gap = false;
+    size_t k = 0;
+    for (const char* q = start; q < p && k < term->len; q++) {
+        size_t i = q - text;
+        if (*q != term->lower[k] && *q != term->upper[k]) {
+            score -= in_gap ? 1 : 3;
+            in_gap = true;
+            run = 0;
+            continue;
+        }
+        int bonus = 0;
+        if (i == 0) {
+            bonus = 10;
+        } else if (fuzzy_separator[(unsigned char)q[-1]]) {
+            bonus = 8;
+        } else if (*q >= 'A' && *q <= 'Z' && q[-1] >= 'a' && q[-1] <= 'z') {
+            bonus = 6;
+        }
+        if (run > 0 && bonus < 4 + run) bonus = 4 + run;
+        score += 16 + bonus;
+        if (positions) positions[k] = (uint32_t)i;
+        in_gap = false;
+        run++;
+        k++;
+    }
+    return score > 1 ? score : 1;
+}
+
+// Orders candidates: match quality first, then how often and how lately
+// the line was run. Recency counts in doublings of age, so the last few
+// dozen commands stand out and old ones fade together.
+static int fuzzy_rank(const FuzzyLine* line, int score, size_t entries) {
+    int frequency = 32 - __builtin_clz(line->count);  // 1 + log2(count)
+    size_t age = entries - line->id;
+    int recency = 40 - 2 * (64 - __builtin_clzll(age));
+    if (recency < 0) recency = 0;
+    return score * 4 + frequency * 8 + recency;
+}
+
+static inline bool fuzzy_better(FuzzyResult a, FuzzyResult b) {
+    return a.score > b.score || (a.score == b.score && a.line > b.line);
+}
+
+static void fuzzy_keep(FuzzyResult* results, size_t* count, FuzzyResult candidate) {
+    if (*count == FUZZY_RESULTS_MAX && !fuzzy_better(candidate, results[*count - 1])) return;
+    size_t i = *count < FUZZY_RESULTS_MAX ? (*count)++ : FUZZY_RESULTS_MAX - 1;
+    while (i > 0 && fuzzy_better(candidate, results[i - 1])) {
+        results[i] = results[i - 1];
+        i--;
+    }
+    results[i] = candidate;
+}
+
+// One thread's share of a scan: candidates [begin, end) of source (every
+// line when source is NULL), newest first, so that the best ranks are
+// met early and most later candidates fail the first comparison in
+// fuzzy_keep(). Matching lines are packed, still in order, against the
+// end of the same range of out, which may be source itself.
+typedef struct {
+    const FuzzyIndex* index;
+    const History* history;
+    const FuzzyTerm* term;
+    const uint32_t* source;
+    uint32_t* out;
+    size_t begin;
+    size_t end;
+    size_t match_count;
+    FuzzyResult results[FUZZY_RESULTS_MAX];
+    size_t result_count;
+} FuzzyWorker;
+
+static void* fuzzy_scan(void* arg) {
+    FuzzyWorker* w = arg;
+    size_t entries = history_count(w->history);
+    uint64_t mask = w->term->mask;
+    for (size_t i = w->end; i-- > w->begin;) {
+        uint32_t n = w->source ? w->source[i] : (uint32_t)i;
+        const FuzzyLine* line = &w->index->lines[n];
+        if ((mask & ~line->mask) != 0) continue;
+        size_t len;
+        const char* text = history_entry(w->history, line->id, &len);
+        int score = fuzzy_score(text, len, w->term, NULL);
+        if (score == 0) continue;
+        w->out[w->end - ++w->match_count] = n;
+        fuzzy_keep(w->results, &w->result_count,
+                   (FuzzyResult){.line = n, .score = fuzzy_rank(line, score, entries)});
+    }
+    return NULL;
+}
+
+// Ranks the distinct history lines against term into index->results.
+// When term extends the previous term only the previous matches can
+// match, so only they are scanned. Large scans are split across threads.
+void fuzzy_search(FuzzyIndex* index, const History* history, const char* term, size_t len) {
+    FuzzyTerm fterm;
+    fuzzy_term_init(&fterm, term, len);
+    bool narrow = index->match_valid && index->match_term.count <= len &&
+                  (index->match_term.count == 0 || memcmp(index->match_term.data, term, index->match_term.count) == 0);
+    size_t candidates = narrow ? index->match_count : index->count;
+    if (!narrow && index->match_capacity < index->count) {
+        free(index->matches);
+        index->match_capacity = index->capacity;
+        index->matches = malloc(index->match_capacity * sizeof(uint32_t));
+        if (!index->matches) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    size_t threads = candidates / FUZZY_CHUNK_MIN;
+    if (threads > fuzzy_thread_limit()) threads = fuzzy_thread_limit();
+    if (threads < 1) threads = 1;
+    FuzzyWorker workers[FUZZY_THREADS_MAX];
+    pthread_t tids[FUZZY_THREADS_MAX];
+    for (size_t t = 0; t < threads; t++) {
+        FuzzyWorker* w = &workers[t];
+        w->index = index;
+        w->history = history;
+        w->term = &fterm;
+        w->source = narrow ? index->matches : NULL;
+        w->out = index->matches;
+        w->begin = candidates * t / threads;
+        w->end = candidates * (t + 1) / threads;
+        w->match_count = 0;
+        w->result_count = 0;
+    }
+    size_t started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, fuzzy_scan, &workers[started]) != 0) break;
+    }
+    fuzzy_scan(&workers[0]);
+    for (size_t t = started; t < threads; t++) fuzzy_scan(&workers[t]);  // Threads that failed to start
+    for (size_t t = 1; t < started; t++) pthread_join(tids[t], NULL);
+
+    // Close the gaps between the threads' matches and merge their rankings
+    index->match_count = 0;
+    index->result_count = 0;
+    for (size_t t = 0; t < threads; t++) {
+        FuzzyWorker* w = &workers[t];
+        memmove(index->matches + index->match_count, index->matches + w->end - w->match_count,
+                w->match_count * sizeof(uint32_t));
+        index->match_count += w->match_count;
+        for (size_t r = 0; r < w->result_count; r++) {
+            fuzzy_keep(index->results, &index->result_count, w->results[r]);
+        }
+    }
+    string_set(&index->match_term, term, len);
+    index->match_valid = true;
+}
+
+// Draws one candidate with its matched bytes in bold
+static void fuzzy_draw_line(const char* text, size_t len, const FuzzyTerm* term, bool selected) {
+    uint32_t positions[256];
+    size_t matched = term->len > 0 && fuzzy_score(text, len, term, positions) > 0 ? term->len : 0;
+    size_t width = COLS > 3 ? (size_t)COLS - 3 : 0;
+    size_t k = 0;
+    if (selected) attron(A_REVERSE);
+    addstr(selected ? "> " : "  ");
+    for (size_t i = 0; i < len && i < width; i++) {
+        bool hit = k < matched && positions[k] == i;
+        if (hit) {
+            attron(A_BOLD);
+            k++;
+        }
+        addch(text[i] == '\n' || text[i] == '\t' ? ' ' : (unsigned char)text[i]);
+        if (hit) attroff(A_BOLD);
+    }
+    if (selected) attroff(A_REVERSE);
+}
+
+// Draws the best candidates nearest the prompt line, above it when there
+// is room and below it otherwise, with the term on the prompt line
+// The list sits above the prompt unless the prompt is near the top
+static bool fuzzy_above(const ShellState* state) {
+    int line = state->current_line;
+    return line >= FUZZY_ROWS || line >= LINES - 1 - line;
+}
+
+static void fuzzy_draw(ShellState* state) {
+    FuzzyIndex* index = &state->fuzzy_index;
+    FuzzyTerm term;
+    fuzzy_term_init(&term, state->fuzzy_term.data ? state->fuzzy_term.data : "", state->fuzzy_term.count);
+    int line = state->current_line;
+    bool above = fuzzy_above(state);
+    int rows = above ? line : LINES - 1 - line;
+    if (rows > FUZZY_ROWS) rows = FUZZY_ROWS;
+
+    for (int r = 0; r < rows; r++) {
+        move(above ? line - 1 - r : line + 1 + r, 0);
+        clrtoeol();
+        if ((size_t)r >= index->result_count) continue;
+        size_t len;
+        const char* text = history_entry(&state->history, index->lines[index->results[r].line].id, &len);
+        fuzzy_draw_line(text, len, &term, (size_t)r == state->fuzzy_selected);
+    }
+    move(line, 0);
+    clrtoeol();
+    printw("(fuzzy %zu/%zu)`%.*s': ", index->match_count, index->count,
+           (int)state->fuzzy_term.count, state->fuzzy_term.data ? state->fuzzy_term.data : "");
+    refresh();
+}
+
+// Searches again if the term changed and redraws the finder; called once
+// per batch of keys
+void fuzzy_refresh(ShellState* state) {
+    if (state->fuzzy_dirty) {
+        fuzzy_index_update(&state->fuzzy_index, &state->history);
+        fuzzy_search(&state->fuzzy_index, &state->history,
+                     state->fuzzy_term.data ? state->fuzzy_term.data : "", state->fuzzy_term.count);
+        state->fuzzy_selected = 0;
+        state->fuzzy_dirty = false;
+    }
+    fuzzy_draw(state);
+}
+
+void fuzzy_close(ShellState* state) {
+    state->fuzzy = false;
+    string_clear(&state->fuzzy_term);
+    output_repaint(state);  // Puts back the output the list covered
+}
+
+void handle_fuzzy(int ch, ShellState* state) {
+    FuzzyIndex* index = &state->fuzzy_index;
+    switch (ch) {
+        case ENTER:  // Put the highlighted line on the prompt
+            if (state->fuzzy_selected < index->result_count) {
+                size_t len;
+                const char* text = history_entry(&state->history,
+                                                 index->lines[index->results[state->fuzzy_selected].line].id, &len);
+                gap_set(&state->current_cmd, text, len);
+                state->cursor_pos = len;
+            }
+            fuzzy_close(state);
+            break;
+
+        case ctrl('c'):
+        case ctrl('g'):
+        case ctrl('t'):
+        case 27:  // ESC
+            fuzzy_close(state);
+            break;
+
+        case KEY_UP:
+        case ctrl('p'):
+        case KEY_DOWN:
+        case ctrl('n'): {  // Away from the prompt is further down the ranking
+            bool up = ch == KEY_UP || ch == ctrl('p');
+            if (up == fuzzy_above(state)) {
+                if (state->fuzzy_selected + 1 < index->result_count) state->fuzzy_selected++;
+            } else if (state->fuzzy_selected > 0) {
+                state->fuzzy_selected--;
+            }
+            break;
+        }
+
+        case KEY_BACKSPACE:
+        case 127:
+            if (state->fuzzy_term.count > 0) {
+                state->fuzzy_term.count--;
+                state->fuzzy_dirty = true;
+            }
+            break;
+
+        default:
+            if (ch < 256 && isprint(ch)) {
+                string_append(&state->fuzzy_term, ch);
+                state->fuzzy_dirty = true;
+            }
+            break;
+    }
+}
+
+void fuzzy_open(ShellState* state, const char* term, size_t len) {
+    state->fuzzy = true;
+    state->fuzzy_dirty = true;
+    state->fuzzy_selected = 0;
+    string_set(&state->fuzzy_term, term, len);
+}
+
+// Tab completion
+
+static void completion_add(Completion* c, const char* name, size_t len) {
+    if (c->total == 0) {
+        string_set(&c->common, name, len);
+    } else {
+        size_t n = 0;
+        while (n < c->common.count && n < len && c->common.data[n] == name[n]) n++;
+        c->common.count = n;
+    }
+    c->total++;
+    if (c->matches.count >= COMPLETION_LIST_MAX) return;
+    if (c->matches.count >= c->matches.capacity) {
+        size_t new_cap = c->matches.capacity == 0 ? DATA_START_CAPACITY : c->matches.capacity * 2;
+        String* new_data = realloc(c->matches.data, new_cap * sizeof(String));
+        if (!new_data) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        c->matches.data = new_data;
+        c->matches.capacity = new_cap;
+    }
+    String* match = &c->matches.data[c->matches.count++];
+    string_init(match);
+    string_set(match, name, len);
+}
+
+static bool completion_listed(const Completion* c, const char* name, size_t len) {
+    for (size_t i = 0; i < c->matches.count; i++) {
+        if (c->matches.data[i].count == len && memcmp(c->matches.data[i].data, name, len) == 0) return true;
+    }
+    return false;
+}
+
+void completion_free(Completion* c) {
+    for (size_t i = 0; i < c->matches.count; i++) string_clear(&c->matches.data[i]);
+    free(c->matches.data);
+    string_clear(&c->common);
+    memset(c, 0, sizeof(*c));
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(((const String*)a)->data, ((const String*)b)->data);
+}
+
+// Reads the entries of the directory open as fd into blob and returns how
+// many there are, with *names pointing at them in sorted order. With
+// executables set only executable files are kept; otherwise every entry
+// is kept and directories get a trailing '/'. Takes ownership of fd.
+static size_t read_dir_names(int fd, bool executables, String* blob, char*** names) {
+    *names = NULL;
+    blob->count = 0;
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return 0;
+    }
+
+    size_t* offsets = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        // d_type saves a stat() per entry; only links and file systems
+        // that do not report it need one
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (executables && (is_dir || faccessat(dirfd(dir), name, X_OK, 0) != 0)) continue;
+
+        if (count == capacity) {
+            capacity = capacity == 0 ? DATA_START_CAPACITY : capacity * 2;
+            size_t* grown = realloc(offsets, capacity * sizeof(size_t));
+            if (!grown) {
+                endwin();
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+            offsets = grown;
+        }
+        size_t len = strlen(name);
+        string_reserve(blob, blob->count + len + 2);
+        offsets[count++] = blob->count;
+        memcpy(blob->data + blob->count, name, len);
+        blob->count += len;
+        if (is_dir) blob->data[blob->count++] = '/';
+        blob->data[blob->count++] = '\0';
+    }
+    closedir(dir);
+
+    if (count > 0) {
+        *names = malloc(count * sizeof(char*));
+        if (!*names) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < count; i++) (*names)[i] = blob->data + offsets[i];
+        qsort(*names, count, sizeof(char*), compare_names);
+    }
+    free(offsets);
+    return count;
+}
+
+// A listing stays valid while its directory's mtime is unchanged, unless
+// it was taken so soon after that mtime that a later change could carry
+// the same coarse timestamp
+static bool listing_current(const struct stat* st, const struct timespec* mtime, time_t scanned) {
+    return st->st_mtim.tv_sec == mtime->tv_sec && st->st_mtim.tv_nsec == mtime->tv_nsec &&
+           mtime->tv_sec + 1 < scanned;
+}
+
+// Command-name trie. Nodes refer to each other by index into one array;
+// index 0 is the root, so 0 also means "no node".
+static uint32_t trie_child(CommandIndex* index, uint32_t node, unsigned char ch, bool create) {
+    uint32_t prev = TRIE_NONE;
+    uint32_t child = index->nodes[node].child;
+    while (child != TRIE_NONE && index->nodes[child].ch < ch) {
+        prev = child;
+        child = index->nodes[child].sibling;
+    }
+    if (child != TRIE_NONE && index->nodes[child].ch == ch) return child;
+    if (!create) return TRIE_NONE;
+
+    if (index->node_count == index->node_capacity) {
+        size_t new_cap = index->node_capacity * 2;
+        TrieNode* grown = realloc(index->nodes, new_cap * sizeof(TrieNode));
+        if (!grown) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        index->nodes = grown;
+        index->node_capacity = new_cap;
+    }
+    uint32_t created = (uint32_t)index->node_count++;
+    index->nodes[created] = (TrieNode){.sibling = child, .ch = ch};
+    if (prev == TRIE_NONE) {
+        index->nodes[node].child = created;
+    } else {
+        index->nodes[prev].sibling = created;
+    }
+    return created;
+}
+
+// Adds (delta 1) or removes (delta -1) one $PATH directory's claim on
+// name. Subtree counts only change when the first claim arrives or the
+// last one goes, so a name found in two directories counts once. Nodes
+// are never freed; a node with a zero count is simply skipped.
+static void trie_update(CommandIndex* index, const char* name, int delta) {
+    if (index->nodes == NULL) {
+        index->node_capacity = TRIE_START_CAPACITY;
+        index->nodes = malloc(index->node_capacity * sizeof(TrieNode));
+        if (!index->nodes) {
+            endwin();
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        index->nodes[0] = (TrieNode){0};
+        index->node_count = 1;
+    }
+
+    uint32_t node = 0;
+    for (const char* p = name; *p != '\0'; p++) {
+        node = trie_child(index, node, (unsigned char)*p, delta > 0);
+        if (node == TRIE_NONE) return;
+    }
+    TrieNode* end = &index->nodes[node];
+    if (delta > 0) {
+        if (end->refs++ > 0) return;
+    } else {
+        if (end->refs == 0 || --end->refs > 0) return;
+    }
+
+    node = 0;
+    index->nodes[0].count += delta;
+    for (const char* p = name; *p != '\0'; p++) {
+        node = trie_child(index, node, (unsigned char)*p, false);
+        index->nodes[node].count += delta;
+    }
+}
+
+// Finds the node for prefix; false when no live name starts with it
+static bool trie_find(const CommandIndex* index, const char* prefix, size_t len, uint32_t* found) {
+    if (index->nodes == NULL) return false;
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        node = trie_child((CommandIndex*)index, node, (unsigned char)prefix[i], false);
+        if (node == TRIE_NONE) return false;
+    }
+    *found = node;
+    return index->nodes[node].count > 0;
+}
+
+// Lists names below node in sorted order until the list is full
+static void trie_collect(const CommandIndex* index, uint32_t node, String* name, Completion* c) {
+    if (index->nodes[node].refs > 0) completion_add(c, name->data, name->count);
+    for (uint32_t child = index->nodes[node].child;
+         child != TRIE_NONE && c->matches.count < COMPLETION_LIST_MAX;
+         child = index->nodes[child].sibling) {
+        if (index->nodes[child].count == 0) continue;
+        string_append(name, index->nodes[child].ch);
+        trie_collect(index, child, name, c);
+        name->count--;
+    }
+}
+
+static void path_dir_free(PathDir* dir) {
+    free(dir->path);
+    free(dir->names);
+    string_clear(&dir->blob);
+}
+
+// Rescans a $PATH directory whose mtime changed and applies the
+// difference between the old and new sorted listings to the trie. The
+// directory is read without the lock; only the trie update holds it.
+static void command_index_scan(CommandIndex* index, PathDir* dir, bool remove) {
+    String blob = {0};
+    char** names = NULL;
+    size_t count = 0;
+    if (!remove) {
+        struct stat st;
+        int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            if (fd != -1) close(fd);
+            if (dir->count == 0) return;  // Still missing
+        } else if (dir->scanned && listing_current(&st, &dir->mtime, dir->scan_time)) {
+            close(fd);
+            return;
+        } else {
+            dir->mtime = st.st_mtim;
+            dir->scan_time = time(NULL);
+            count = read_dir_names(fd, true, &blob, &names);
+        }
+        dir->scanned = true;
+    }
+
+    pthread_mutex_lock(&index->lock);
+    size_t i = 0, j = 0;
+    while (i < dir->count || j < count) {
+        int cmp = i == dir->count ? 1 : j == count ? -1 : strcmp(dir->names[i], names[j]);
+        if (cmp < 0) {
+            trie_update(index, dir->names[i++], -1);
+        } else if (cmp > 0) {
+            trie_update(index, names[j++], 1);
+        } else {
+            i++;
+            j++;
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+
+    free(dir->names);
+    string_clear(&dir->blob);
+    dir->blob = blob;
+    dir->names = names;
+    dir->count = count;
+}
+
+static bool command_index_stopping(CommandIndex* index) {
+    pthread_mutex_lock(&index->lock);
+    bool stop = index->stop;
+    pthread_mutex_unlock(&index->lock);
+    return stop;
+}
+
+// Brings the trie up to date with path_env. When $PATH itself changed,
+// directories still on it keep their listings and the ones that left are
+// diffed against nothing. Empty entries (the current directory) are not
+// indexed, since their contents change with every cd.
+static void command_index_refresh(CommandIndex* index, const char* path_env) {
+    if (index->indexed_path == NULL || strcmp(index->indexed_path, path_env) != 0) {
+        PathDir* dirs = NULL;
+        size_t count = 0, capacity = 0;
+        for (const char* dir = path_env; dir != NULL; ) {
+            const char* end = strchr(dir, ':');
+            size_t len = end ? (size_t)(end - dir) : strlen(dir);
+            bool listed = len == 0;
+            for (size_t i = 0; i < count && !listed; i++) {
+                listed = strlen(dirs[i].path) == len && memcmp(dirs[i].path, dir, len) == 0;
+            }
+            if (!listed) {
+                if (count == capacity) {
+                    capacity = capacity == 0 ? 16 : capacity * 2;
+                    PathDir* grown = realloc(dirs, capacity * sizeof(PathDir));
+                    if (!grown) {
+                        endwin();
+                        fprintf(stderr, "Memory allocation failed\n");
+                        exit(1);
+                    }
+                    dirs = grown;
+                }
+                PathDir* slot = &dirs[count++];
+                memset(slot, 0, sizeof(*slot));
+                for (size_t i = 0; i < index->dir_count; i++) {
+                    PathDir* old = &index->dirs[i];
+                    if (old->path != NULL && strlen(old->path) == len && memcmp(old->path, dir, len) == 0) {
+                        *slot = *old;
+                        old->path = NULL;
+                        break;
+                    }
+                }
+                if (slot->path == NULL) slot->path = strndup(dir, len);
+            }
+            dir = end ? end + 1 : NULL;
+        }
+        for (size_t i = 0; i < index->dir_count; i++) {
+            if (index->dirs[i].path == NULL) continue;
+            command_index_scan(index, &index->dirs[i], true);
+            path_dir_free(&index->dirs[i]);
+        }
+        free(index->dirs);
+        index->dirs = dirs;
+        index->dir_count = count;
+        free(index->indexed_path);
+        index->indexed_path = strdup(path_env);
+    }
+
+    for (size_t i = 0; i < index->dir_count && !command_index_stopping(index); i++) {
+        command_index_scan(index, &index->dirs[i], false);
+    }
+}
+
+static void* command_index_main(void* arg) {
+    CommandIndex* index = arg;
+    pthread_mutex_lock(&index->lock);
+    while (!index->stop) {
+        if (!index->dirty) {
+            pthread_cond_wait(&index->cond, &index->lock);
+            continue;
+        }
+        index->dirty = false;
+        index->busy = true;
+        char* path_env = strdup(index->path_env);
+        pthread_mutex_unlock(&index->lock);
+        if (path_env) command_index_refresh(index, path_env);
+        free(path_env);
+        pthread_mutex_lock(&index->lock);
+        index->busy = false;
+        index->generation++;
+        pthread_cond_broadcast(&index->cond);
+    }
+    pthread_mutex_unlock(&index->lock);
+    return NULL;
+}
+
+// Asks the index thread to catch up with $PATH and any directory that
+// changed, starting the thread on first use, then waits up to wait_ms
+// for it. A refresh is a stat() per $PATH directory unless something
+// changed, so the wait normally ends well within a keystroke.
+void command_index_request(int wait_ms) {
+    CommandIndex* index = &command_index;
+    const char* path_env = getenv("PATH");
+    if (path_env == NULL) path_env = "/usr/local/bin:/usr/bin:/bin";
+
+    pthread_mutex_lock(&index->lock);
+    if (index->path_env == NULL || strcmp(index->path_env, path_env) != 0) {
+        char* copy = strdup(path_env);
+        if (copy != NULL) {
+            free(index->path_env);
+            index->path_env = copy;
+        }
+    }
+    if (!index->started && index->path_env != NULL) {
+        // Signals are for the input thread; block them all in the new one
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        index->started = pthread_create(&index->thread, NULL, command_index_main, index) == 0;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    // A refresh already under way may have read the directories before
+    // they changed, so wait for the one after it
+    unsigned long target = index->generation + (index->busy ? 2 : 1);
+    index->dirty = true;
+    pthread_cond_broadcast(&index->cond);
+
+    if (wait_ms > 0 && index->started) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)wait_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (index->generation < target) {
+            if (pthread_cond_timedwait(&index->cond, &index->lock, &deadline) == ETIMEDOUT) break;
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+void command_index_stop(void) {
+    CommandIndex* index = &command_index;
+    pthread_mutex_lock(&index->lock);
+    bool started = index->started;
+    index->stop = true;
+    pthread_cond_broadcast(&index->cond);
+    pthread_mutex_unlock(&index->lock);
+    if (!started) return;
+    pthread_join(index->thread, NULL);
+
+    for (size_t i = 0; i < index->dir_count; i++) path_dir_free(&index->dirs[i]);
+    free(index->dirs);
+    free(index->nodes);
+    free(index->path_env);
+    free(index->indexed_path);
+    index->dirs = NULL;
+    index->nodes = NULL;
+    index->path_env = NULL;
+    index->indexed_path = NULL;
+    index->dir_count = index->node_count = index->node_capacity = 0;
+    index->started = false;
+}
+
+// Builtins and $PATH executables starting with prefix
+static void complete_command(const char* prefix, size_t len, Completion* c) {
+    CommandIndex* index = &command_index;
+    pthread_mutex_lock(&index->lock);
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        const char* name = builtins[i].name;
+        size_t name_len = strlen(name);
+        if (name_len < len || memcmp(name, prefix, len) != 0) continue;
+        uint32_t node;
+        if (!trie_find(index, name, name_len, &node) || index->nodes[node].refs == 0) {
+            completion_add(c, name, name_len);
+        }
+    }
+
+    uint32_t node;
+    if (trie_find(index, prefix, len, &node)) {
+        String name = {0};
+        string_set(&name, prefix, len);
+        size_t before = c->total;
+        trie_collect(index, node, &name, c);
+        c->total = before + index->nodes[node].count;
+
+        // The list may be cut short, so the shared prefix comes from the
+        // trie: follow the only live child until a name ends or branches
+        uint32_t walk = node;
+        while (index->nodes[walk].refs == 0) {
+            uint32_t only = TRIE_NONE;
+            int live = 0;
+            for (uint32_t child = index->nodes[walk].child; child != TRIE_NONE && live < 2;
+                 child = index->nodes[child].sibling) {
+                if (index->nodes[child].count > 0) {
+                    only = child;
+                    live++;
+                }
+            }
+            if (live != 1) break;
+            string_append(&name, index->nodes[only].ch);
+            walk = only;
+        }
+        if (name.count < c->common.count && memcmp(name.data, c->common.data, name.count) == 0) {
+            c->common.count = name.count;
+        }
+        string_clear(&name);
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+// Returns the cached listing of the directory at path, reading it again
+// when it changed. The least recently used slot is replaced on a miss.
+static DirListing* dir_cache_get(const char* path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1) return NULL;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    DirListing* slot = &dir_cache[0];
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        DirListing* listing = &dir_cache[i];
+        if (listing->names != NULL && listing->dev == st.st_dev && listing->ino == st.st_ino) {
+            slot = listing;
+            break;
+        }
+        if (listing->used < slot->used) slot = listing;
+    }
+    slot->used = ++dir_cache_clock;
+    if (slot->names != NULL && slot->dev == st.st_dev && slot->ino == st.st_ino &&
+        listing_current(&st, &slot->mtime, slot->scan_time)) {
+        close(fd);
+        return slot;
+    }
+
+    free(slot->names);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->scan_time = time(NULL);
+    slot->count = read_dir_names(fd, false, &slot->blob, &slot->names);
+    return slot->names != NULL ? slot : NULL;
+}
+
+// Entries of the word's directory that start with its last component.
+// The block of names sharing the prefix is found by binary search, so
+// only the matches themselves are visited. Dot files are only offered
+// when the component starts with a dot.
+static void complete_path(const char* word, size_t len, Completion* c) {
+    const char* slash = memrchr(word, '/', len);
+    char dir[PATH_MAX];
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == word) {
+        strcpy(dir, "/");
+    } else if ((size_t)(slash - word) < sizeof(dir)) {
+        memcpy(dir, word, slash - word);
+        dir[slash - word] = '\0';
+    } else {
+        return;
+    }
+    const char* stem = slash ? slash + 1 : word;
+    size_t stem_len = word + len - stem;
+
+    DirListing* listing = dir_cache_get(dir);
+    if (listing == NULL) return;
+    size_t lo = 0, hi = listing->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(listing->names[mid], stem, stem_len) < 0) lo = mid + 1; else hi = mid;
+    }
+    for (size_t i = lo; i < listing->count && strncmp(listing->names[i], stem, stem_len) == 0; i++) {
+        const char* name = listing->names[i];
+        if (name[0] == '.' && (stem_len == 0 || stem[0] != '.')) continue;
+        completion_add(c, name, strlen(name));
+    }
+}
+
+// Words from the newest history entries that start with prefix
+static void complete_history_word(const History* history, const char* prefix, size_t len,
+                                  Completion* c) {
+    size_t count = history_count(history);
+    size_t oldest = count > COMPLETION_HISTORY_SCAN ? count - COMPLETION_HISTORY_SCAN : 0;
+    for (size_t i = count; i-- > oldest && c->matches.count < COMPLETION_LIST_MAX; ) {
+        size_t entry_len;
+        const char* entry = history_entry(history, i, &entry_len);
+        size_t pos = 0;
+        while (pos < entry_len) {
+            while (pos < entry_len && (isspace((unsigned char)entry[pos]) || strchr("|&;()<>", entry[pos]))) pos++;
+            size_t start = pos;
+            while (pos < entry_len && !isspace((unsigned char)entry[pos]) && !strchr("|&;()<>", entry[pos])) pos++;
+            size_t word_len = pos - start;
+            if (word_len > len && memcmp(entry + start, prefix, len) == 0 &&
+                !completion_listed(c, entry + start, word_len)) {
+                completion_add(c, entry + start, word_len);
+            }
+        }
+    }
+}
+
+// Finds the word ending at the cursor and returns its offset in line.
+// The word is copied to word without its quote characters, and *command
+// tells whether it names the command to run.
+static size_t completion_word(const char* line, size_t cursor, String* word, bool* command) {
+    size_t start = cursor;
+    bool in_word = false;
+    bool command_pos = true;
+    bool redirect_target = false;
+    char quote = 0;
+    for (size_t i = 0; i < cursor; i++) {
+        char ch = line[i];
+        if (quote) {
+            if (ch == quote) quote = 0;
+            continue;
+        }
+        if (isspace((unsigned char)ch) || strchr("|&;()<>", ch)) {
+            if (in_word) {
+                if (!redirect_target) command_pos = false;
+                redirect_target = false;
+            }
+            in_word = false;
+            if (ch == '|' || ch == '&') command_pos = true;
+            if (ch == '<' || ch == '>') redirect_target = true;
+            continue;
+        }
+        if (!in_word) {
+            in_word = true;
+            start = i;
+        }
+        if (ch == '"' || ch == '\'') quote = ch;
+    }
+    if (!in_word) start = cursor;
+    *command = command_pos && !redirect_target;
+
+    word->count = 0;
+    for (size_t i = start; i < cursor; i++) {
+        if (line[i] != '"' && line[i] != '\'') string_append(word, line[i]);
+    }
+    return start;
+}
+
+// Collects the candidates for the word ending at the cursor. A command
+// name comes from the builtins and the $PATH trie, anything with a slash
+// or in argument position from the file system, and history words are
+// offered when neither matches. Returns the word's offset in line; the
+// candidates replace the word from *stem onwards.
+size_t completion_collect(const char* line, size_t cursor, const History* history,
+                          String* word, size_t* stem, Completion* c) {
+    bool command;
+    size_t start = completion_word(line, cursor, word, &command);
+    *stem = 0;
+    if (command && memchr(word->data, '/', word->count) == NULL) {
+        command_index_request(COMPLETION_WAIT_MS);
+        complete_command(word->data, word->count, c);
+    } else {
+        const char* slash = memrchr(word->data, '/', word->count);
+        *stem = slash ? (size_t)(slash - word->data) + 1 : 0;
+        complete_path(word->data, word->count, c);
+    }
+    if (c->total == 0 && history != NULL) {
+        *stem = 0;
+        complete_history_word(history, word->data, word->count, c);
+    }
+    return start;
+}
+
+// Lists the candidates below the edit line in columns, the way ls does,
+// and leaves the line to be drawn again underneath
+static void completion_list(ShellState* state, Completion* c) {
+    qsort(c->matches.data, c->matches.count, sizeof(String), compare_strings);
+    size_t width = 0;
+    for (size_t i = 0; i < c->matches.count; i++) {
+        if (c->matches.data[i].count > width) width = c->matches.data[i].count;
+    }
+    width += 2;
+    size_t columns = (size_t)COLS > width ? (size_t)COLS / width : 1;
+    size_t rows = (c->matches.count + columns - 1) / columns;
+
+    // The edit line goes to the scrollback with the listing, as it would
+    // on ENTER
+    move(state->current_line, 0);
+    clrtoeol();
+    char* cwd = get_formatted_cwd();
+    String text = {0};
+    string_reserve(&text, strlen(SHELL) + strlen(cwd) + 3);
+    text.count = sprintf(text.data, "%s%s  ", SHELL, cwd);
+    size_t length = gap_length(&state->current_cmd);
+    string_reserve(&text, text.count + length + 1);
+    memcpy(text.data + text.count, gap_text(&state->current_cmd), length);
+    text.count += length;
+    string_append(&text, '\n');
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t col = 0; col < columns; col++) {
+            size_t i = col * rows + r;
+            if (i >= c->matches.count) break;
+            const String* match = &c->matches.data[i];
+            for (size_t k = 0; k < match->count; k++) string_append(&text, match->data[k]);
+            if (col + 1 < columns && i + rows < c->matches.count) {
+                for (size_t k = match->count; k < width; k++) string_append(&text, ' ');
+            }
+        }
+        string_append(&text, '\n');
+    }
+    scrollback.esc_state = ESC_NONE;
+    output_feed(text.data, text.count);
+    string_clear(&text);
+    if (c->total > c->matches.count) {
+        shell_print("(%zu more)\n", c->total - c->matches.count);
+    }
+    shell_flush();
+    if (getcurx(stdscr) != 0) addch('\n');
+    state->current_line = getcury(stdscr);
+    state->view.valid = false;
+}
+
+// Tab: completes the word before the cursor as far as every candidate
+// agrees. A unique candidate is finished with a space, or with '/' for a
+// directory so the next Tab can descend into it. When candidates remain,
+// the next Tab lists them.
+void handle_completion(ShellState* state, bool again) {
+    char* line = gap_text(&state->current_cmd);
+    String word = {0};
+    Completion c = {0};
+    size_t stem;
+    size_t start = completion_collect(line, state->cursor_pos, &state->history, &word, &stem, &c);
+
+    if (c.total == 0) {
+        beep();
+    } else if (c.total == 1 || c.common.count > word.count - stem) {
+        // Rewrite the word, keeping or adding quotes when it needs them
+        String replacement = {0};
+        char quote = line[start] == '"' || line[start] == '\'' ? line[start] : 0;
+        bool special = false;
+        for (size_t i = 0; i < c.common.count && !special; i++) {
+            special = isspace((unsigned char)c.common.data[i]) || strchr("|&;()<>\"'", c.common.data[i]);
+        }
+        for (size_t i = 0; i < stem && !special; i++) {
+            special = isspace((unsigned char)word.data[i]) || strchr("|&;()<>\"'", word.data[i]);
+        }
+        if (quote == 0 && special) quote = memchr(c.common.data, '"', c.common.count) ? '\'' : '"';
+        if (quote) string_append(&replacement, quote);
+        for (size_t i = 0; i < stem; i++) string_append(&replacement, word.data[i]);
+        for (size_t i = 0; i < c.common.count; i++) string_append(&replacement, c.common.data[i]);
+        bool directory = c.common.count > 0 && c.common.data[c.common.count - 1] == '/';
+        if (c.total == 1 && !directory) {
+            if (quote) string_append(&replacement, quote);
+            size_t length = gap_length(&state->current_cmd);
+            if (state->cursor_pos == length || !isspace((unsigned char)line[state->cursor_pos])) {
+                string_append(&replacement, ' ');
+            }
+        }
+        gap_delete(&state->current_cmd, start, state->cursor_pos - start);
+        gap_insert(&state->current_cmd, start, replacement.data, replacement.count);
+        state->cursor_pos = start + replacement.count;
+        string_clear(&replacement);
+        state->tab_pending = c.total > 1;
+    } else if (again) {
+        completion_list(state, &c);
+    } else {
+        state->tab_pending = true;
+        beep();
+    }
+
+    string_clear(&word);
+    completion_free(&c);
+}
+
+// Command server
+//
+// shell --server <socket> runs client command lines on a pool of worker
+// processes forked from one initialized shell, so each command costs a
+// parse and a launch rather than a shell startup. A worker serves one
+// client at a time, in a session child of its own; further clients wait
+// in the listen backlog.
+//
+// A client writes command lines, newline-terminated, and may send more
+// before the results come back. Here-document bodies follow their line
+// as in a script. Replies are frames of a type byte, a 4-byte big-endian
+// length and the payload: 'o' for stdout, 'e' for stderr and, once per
+// command line, 'x' with the exit status as a 4-byte big-endian integer.
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void server_stop_handler(int sig) {
+    (void)sig;
+    server_stopping = 1;
+}
+
+// Sends one frame unless the client has gone away
+static void server_frame(ServerSession* session, char type, const void* data, uint32_t len) {
+    if (session->client_gone) return;
+    char header[5];
+    uint32_t be_len = htonl(len);
+    header[0] = type;
+    memcpy(header + 1, &be_len, sizeof(be_len));
+    if (!write_all(session->sock, header, sizeof(header)) ||
+        (len > 0 && !write_all(session->sock, data, len))) {
+        session->client_gone = true;
+    }
+}
+
+// Frames everything the pipe holds right now. Returns false at EOF.
+static bool server_forward(ServerSession* session, int fd, char type) {
+    static __thread char buf[SERVER_READ_SIZE];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0) {
+            server_frame(session, type, buf, n);
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return n != 0;  // EAGAIN: drained for now
+        }
+    }
+}
+
+// Streams command output to the client while the command runs, so a
+// command writing more than a pipe holds never blocks. Once the client
+// hangs up, the pipes lose their reader and the command gets EPIPE, as it
+// would from a closed terminal.
+static void* server_relay(void* arg) {
+    ServerSession* session = arg;
+    struct pollfd fds[4] = {
+        {.fd = session->out_fd, .events = POLLIN},
+        {.fd = session->err_fd, .events = POLLIN},
+        {.fd = session->wake_pipe[0], .events = POLLIN},
+        {.fd = session->sock, .events = 0},  // Only POLLHUP is of interest
+    };
+    while (fds[2].revents == 0) {
+        if (poll(fds, 4, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        pthread_mutex_lock(&session->lock);
+        if (fds[3].revents & (POLLHUP | POLLERR)) {
+            session->client_gone = true;
+            fds[3].fd = -1;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].revents != 0 && !server_forward(session, fds[i].fd, i == 0 ? 'o' : 'e')) {
+                fds[i].fd = -1;  // Every writer is gone
+            }
+        }
+        if (session->client_gone && fds[0].fd != -1) {
+            // dup2 keeps the fd numbers valid for the session's last drain
+            dup2(session->null_fd, session->out_fd);
+            dup2(session->null_fd, session->err_fd);
+            fds[0].fd = fds[1].fd = fds[3].fd = -1;
+        }
+        pthread_mutex_unlock(&session->lock);
+    }
+    return NULL;
+}
+
+// Makes a pipe whose write end becomes fd target and returns its
+// non-blocking read end
+static int server_pipe(int target) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    dup2(fds[1], target);  // The copy drops O_CLOEXEC, so children inherit it
+    close(fds[1]);
+    return fds[0];
+}
+
+// Runs one client's command lines with stdout and stderr going to it.
+// Returns once the client closes its side or runs exit.
+static void server_session(int sock, int null_fd) {
+    ServerSession session = {.sock = sock, .null_fd = null_fd, .lock = PTHREAD_MUTEX_INITIALIZER};
+    int input_fd = fcntl(sock, F_DUPFD_CLOEXEC, 0);
+    FILE* input = input_fd != -1 ? fdopen(input_fd, "r") : NULL;
+    session.out_fd = server_pipe(STDOUT_FILENO);
+    session.err_fd = server_pipe(STDERR_FILENO);
+    pthread_t relay;
+    if (input == NULL || session.out_fd == -1 || session.err_fd == -1 ||
+        pipe2(session.wake_pipe, O_CLOEXEC) == -1 ||
+        pthread_create(&relay, NULL, server_relay, &session) != 0) {
+        fprintf(stderr, "shell: server: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    batch_input = input;
+    heredoc_reader = read_batch_line;
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while (shell_running && !session.client_gone && (len = getline(&line, &capacity, input)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+        jobs_reap();
+        jobs_notify();
+        last_status = run_line(line);
+        fflush(stdout);
+        fflush(stderr);
+
+        // Foreground commands have exited, so all their output is in the
+        // pipes; send it ahead of the status
+        uint32_t status = htonl((uint32_t)last_status);
+        pthread_mutex_lock(&session.lock);
+        server_forward(&session, session.out_fd, 'o');
+        server_forward(&session, session.err_fd, 'e');
+        server_frame(&session, 'x', &status, sizeof(status));
+        pthread_mutex_unlock(&session.lock);
+    }
+    heredoc_reader = NULL;
+    free(line);
+    fclose(input);
+
+    // Background jobs still holding the pipes lose their reader
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    write_all(session.wake_pipe[1], "", 1);
+    pthread_join(relay, NULL);
+    close(session.out_fd);
+    close(session.err_fd);
+    close(session.wake_pipe[0]);
+    close(session.wake_pipe[1]);
+}
+
+// Serves clients one after another. Each session runs in a child forked
+// from this worker, which never runs a command itself, so the variables,
+// limits, caches, jobs and directory one client leaves behind are gone
+// when the next one connects.
+static void server_worker(int listen_fd, int null_fd) {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    pid_t worker = getpid();
+    while (true) {
+        int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "shell: server: accept: %s\n", strerror(errno));
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Ends with its worker when the server stops
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != worker) _exit(1);
+            close(listen_fd);
+            server_session(sock, null_fd);
+            _exit(0);
+        }
+        if (pid == -1) fprintf(stderr, "shell: server: fork: %s\n", strerror(errno));
+        close(sock);
+        while (pid > 0 && waitpid(pid, NULL, 0) == -1 && errno == EINTR) {}
+    }
+}
+
+static pid_t server_spawn_worker(int listen_fd, int null_fd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        server_worker(listen_fd, null_fd);
+        _exit(0);
+    }
+    if (pid == -1) fprintf(stderr, "shell: server: fork: %s\n", strerror(errno));
+    return pid;
+}
+
+// Listens on the Unix socket at path with workers worker processes and
+// replaces any that die, until SIGTERM or SIGINT. The socket is created
+// accessible to the owner only, since clients run arbitrary commands.
+int shell_server(const char* path, long workers) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "shell: server: socket path too long: %s\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        fprintf(stderr, "shell: server: socket: %s\n", strerror(errno));
+        return 1;
+    }
+    // A socket left by a server that died can be replaced; a live one not
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "shell: server: %s is in use\n", path);
+            close(listen_fd);
+            return 1;
+        }
+        unlink(path);
+    }
+    mode_t old_mask = umask(077);
+    int bound = bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "shell: server: %s: %s\n", path, strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+
+    // Commands get no input, and output goes nowhere between clients
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null_fd == -1) {
+        fprintf(stderr, "shell: server: %s\n", strerror(errno));
+        return 1;
+    }
+    dup2(null_fd, STDIN_FILENO);
+    // A client that disconnects must not kill the worker writing to it
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_stop_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+    pid_t* pids = calloc(workers, sizeof(pid_t));
+    if (!pids) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    fprintf(stderr, "shell: serving %s with %ld workers\n", path, workers);
+    for (long w = 0; w < workers; w++) pids[w] = server_spawn_worker(listen_fd, null_fd);
+
+    while (!server_stopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (long w = 0; w < workers && !server_stopping; w++) {
+            if (pids[w] != pid) continue;
+            fprintf(stderr, "shell: server: worker %d exited, restarting\n", pid);
+            pids[w] = server_spawn_worker(listen_fd, null_fd);
+        }
+    }
+
+    for (long w = 0; w < workers; w++) {
+        if (pids[w] > 0) kill(pids[w], SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {}
+    unlink(path);
+    close(listen_fd);
+    close(null_fd);
+    free(pids);
+    return 0;
+}
+
+#ifndef SHELL_NO_MAIN
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-c command | script | --server socket [-j workers]]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    variables_init();
+    stats_start_ns = monotonic_ns();
+    if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            return 2;
+        }
+        last_status = run_lines(argv[2]);
+        fflush(stdout);
+        if (variable_get("SHELLSTAT_FILE")) stats_dump(NULL);
+        return last_status;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+        long workers = 0;
+        bool ok = argc == 3;
+        if (argc == 5 && strcmp(argv[3], "-j") == 0) {
+            char* end;
+            workers = strtol(argv[4], &end, 10);
+            ok = *end == '\0' && workers > 0;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 2;
+        }
+        return shell_server(argv[2], workers);
+    }
+    if (argc >= 2) {
+        FILE* script = fopen(argv[1], "r");
+        if (script == NULL) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+            return 127;
+        }
+        int status = shell_batch_loop(script);
+        fclose(script);
+        if (variable_get("SHELLSTAT_FILE")) stats_dump(NULL);
+        return status;
+    }
+    if (!isatty(STDIN_FILENO)) {
+        int status = shell_batch_loop(stdin);
+        if (variable_get("SHELLSTAT_FILE")) stats_dump(NULL);
+        return status;
+    }
+
+    shell_interactive_loop();
+    stats_dump(NULL);
+    return last_status;
+}
+#endif